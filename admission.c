@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "serverutil.h"
+#include "sharedutil.h"
+#include "admission.h"
+
+Admission* create_admission(void) {
+    Admission* admission = calloc(1, sizeof(Admission));
+    admission->admissionAccess = create_lock(malloc(sizeof(sem_t)));
+    admission->numConnections = 0;
+    return admission;
+}
+
+/* Finds the count for a source address, adding a new one if the address has
+ * no connections. The admission lock must be held by the caller.
+ */
+static AddressCount* find_address(Admission* admission, unsigned int address) {
+    AddressCount** bucket = &admission->buckets[address % ADMISSION_BUCKETS];
+    AddressCount* count = *bucket;
+    while (count != NULL && count->address != address) {
+        count = count->next;
+    }
+    if (count == NULL) {
+        count = malloc(sizeof(AddressCount));
+        count->address = address;
+        count->count = 0;
+        count->next = *bucket;
+        *bucket = count;
+    }
+    return count;
+}
+
+/* Removes the count for a source address once it has no connections left.
+ * The admission lock must be held by the caller.
+ */
+static void forget_address(Admission* admission, unsigned int address) {
+    AddressCount** position = &admission->buckets[address % ADMISSION_BUCKETS];
+    while (*position != NULL) {
+        AddressCount* count = *position;
+        if (count->address == address && count->count <= 0) {
+            *position = count->next;
+            free(count);
+            return;
+        }
+        position = &count->next;
+    }
+}
+
+char* admit_connection(Server* server, unsigned int address, int isForced) {
+    Admission* admission = server->admission;
+    ServerOptions* options = server->options;
+    char* reason = NULL;
+
+    take_lock(admission->admissionAccess);
+    AddressCount* count = address != 0 ?
+            find_address(admission, address) : NULL;
+    if (!isForced && options->maxClients > 0 &&
+            admission->numConnections >= options->maxClients) {
+        reason = "FULL";
+    } else if (!isForced && count != NULL && options->maxPerAddress > 0 &&
+            count->count >= options->maxPerAddress) {
+        reason = "BUSY";
+    } else {
+        admission->numConnections++;
+        if (count != NULL) {
+            count->count++;
+        }
+    }
+    if (count != NULL && count->count == 0) {
+        forget_address(admission, address);
+    }
+    release_lock(admission->admissionAccess);
+    return reason;
+}
+
+void release_connection(Server* server, Client* client) {
+    Admission* admission = server->admission;
+    if (!client->isAdmitted) {
+        return;
+    }
+
+    take_lock(admission->admissionAccess);
+    admission->numConnections--;
+    if (client->sourceAddress != 0) {
+        AddressCount* count = find_address(admission, client->sourceAddress);
+        count->count--;
+        if (count->count <= 0) {
+            forget_address(admission, client->sourceAddress);
+        }
+    }
+    release_lock(admission->admissionAccess);
+    client->isAdmitted = 0;
+}
+
+unsigned int source_address(int socket) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(struct sockaddr_in);
+    if (getpeername(socket, (struct sockaddr*) &address, &length) ||
+            address.sin_family != AF_INET) {
+        return 0;
+    }
+    return address.sin_addr.s_addr;
+}
+
+int accept_clients(Server* server, int listener) {
+    int accepted = 0;
+    while (accepted < ACCEPT_BATCH) {
+        struct sockaddr_in from;
+        socklen_t length = sizeof(struct sockaddr_in);
+        int clientSocket = accept4(listener, (struct sockaddr*) &from,
+                &length, SOCK_CLOEXEC);
+        if (clientSocket < 0) {
+            // Out of descriptors, so give closing clients a moment rather
+            // than spinning on a socket which stays readable
+            if (errno == EMFILE || errno == ENFILE) {
+                usleep(ACCEPT_BACKOFF_US);
+            }
+            // Otherwise, nothing is left to accept (or the client gave up
+            // while waiting)
+            break;
+        }
+        accepted++;
+
+        unsigned int address = from.sin_family == AF_INET ?
+                from.sin_addr.s_addr : 0;
+        char* reason = admit_connection(server, address, 0);
+        if (reason != NULL) {
+            // Shed the connection before giving it any memory or threads,
+            // telling it why on a best effort basis
+            char notice[MAX_BUF];
+            int noticeLength = sprintf(notice, "ERR:%s\n", reason);
+            send(clientSocket, notice, noticeLength,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(clientSocket);
+            add_to_server_stats(server, STAT_REJECT);
+            continue;
+        }
+        initialise_client(server, clientSocket, address);
+    }
+    return accepted;
+}
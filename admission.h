@@ -0,0 +1,111 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+#define ACCEPT_BATCH 64
+#define ADMISSION_BUCKETS 256
+#define ACCEPT_BACKOFF_US 10000
+
+/* The AddressCount datastructure holds the number of connections currently
+ * admitted from a single source address.
+ *
+ * address: The IPv4 source address, in network byte order.
+ *
+ * count: The number of connections admitted from the address.
+ *
+ * next: A pointer to the next address in the same bucket.
+ */
+typedef struct AddressCount {
+    unsigned int address;
+    int count;
+    struct AddressCount* next;
+} AddressCount;
+
+/* The Admission datastructure holds the number of connections the server has
+ * admitted, in total and from each source address, so that a storm of new
+ * connections is turned away before any memory or threads are given to it.
+ *
+ * admissionAccess: A lock that should be used when accessing the counts.
+ *
+ * numConnections: The number of client connections currently admitted,
+ *  including those which are still in their handshake.
+ *
+ * buckets: A hash table of AddressCounts, indexed by source address.
+ */
+typedef struct Admission {
+    sem_t* admissionAccess;
+    int numConnections;
+    AddressCount* buckets[ADMISSION_BUCKETS];
+} Admission;
+
+/* The create_admission function initialises an Admission datastructure with
+ * no connections admitted.
+ *
+ * Returns:
+ *      (Admission*) - The newly allocated datastructure
+ */
+Admission* create_admission(void);
+
+/* The accept_clients function accepts every connection waiting on one of the
+ * server's listening sockets (up to ACCEPT_BATCH at a time), which must be
+ * non-blocking. Each connection is either admitted and given to
+ * initialise_client, or rejected straight away with ERR:FULL (the server has
+ * --max-clients connections) or ERR:BUSY (the source address has
+ * --max-per-address connections) and closed. Connections on a Unix domain
+ * socket have no source address, so are only counted against --max-clients.
+ * If the process runs out of file descriptors, it waits ACCEPT_BACKOFF_US
+ * before returning, leaving the rest of the connections queued in the
+ * backlog.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      listener - The listening socket to accept connections from
+ *
+ * Returns:
+ *      (int) - The number of connections accepted (admitted or not)
+ */
+int accept_clients(Server* server, int listener);
+
+/* The admit_connection function counts a new connection from the given
+ * source address against the server's limits.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      address - The IPv4 source address in network byte order, or 0 if the
+ *          connection has no IPv4 address (which is only globally limited)
+ *      isForced - Whether the connection is counted even if it is over the
+ *          limits, as for connections handed over from another process
+ *
+ * Returns:
+ *      (char*) NULL - if the connection has been admitted
+ *      (char*) - The reason the connection was not admitted
+ */
+char* admit_connection(Server* server, unsigned int address, int isForced);
+
+/* The release_connection function stops counting a client's connection
+ * against the server's limits, if it was admitted.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - The client whose connection is being closed
+ */
+void release_connection(Server* server, Client* client);
+
+/* The source_address function finds the IPv4 source address of a connected
+ * socket.
+ *
+ * Parameters:
+ *      socket - A connected socket
+ *
+ * Returns:
+ *      (unsigned int) - The address in network byte order, or 0 if there is
+ *          no IPv4 address
+ */
+unsigned int source_address(int socket);
+#endif
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "sharedutil.h"
+#include "timerwheel.h"
+#include "authtable.h"
+
+/* Compares a client's token against a token from the table, looking at every
+ * byte of the table's token whatever the client sent.
+ */
+static int tokens_equal(char* token, size_t length, AuthToken* entry) {
+    unsigned char difference = length != entry->length;
+    for (size_t i = 0; i < entry->length; i++) {
+        unsigned char byte = i < length ? token[i] : 0;
+        difference |= byte ^ (unsigned char) entry->token[i];
+    }
+    return difference == 0;
+}
+
+/* Reads the whole of a file into a newly allocated, null terminated string,
+ * returning NULL if it cannot be read.
+ */
+static char* read_file(char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    size_t capacity = MAX_BUF;
+    size_t length = 0;
+    char* text = malloc(capacity);
+    size_t got;
+    while ((got = fread(text + length, 1, capacity - length - 1, file)) > 0) {
+        length += got;
+        if (capacity - length - 1 == 0) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    text[length] = '\0';
+    fclose(file);
+    return text;
+}
+
+AuthTable* load_auth_table(char* path) {
+    char* text = read_file(path);
+    if (text == NULL) {
+        return NULL;
+    }
+
+    // Split the file into lines in place, counting the non-empty ones
+    int numTokens = 0;
+    for (char* line = text; *line != '\0'; line++) {
+        if (*line == '\n' || *line == '\r') {
+            *line = '\0';
+        } else if (line == text || line[-1] == '\0') {
+            numTokens++;
+        }
+    }
+    if (numTokens == 0) {
+        free(text);
+        return NULL;
+    }
+
+    AuthTable* table = malloc(sizeof(AuthTable));
+    if (getrandom(&table->seed, sizeof(table->seed), 0) !=
+            sizeof(table->seed)) {
+        table->seed = current_time_us() ^ ((unsigned long long) getpid() << 32);
+    }
+    table->numBuckets = 1;
+    while (table->numBuckets < (size_t) numTokens * 2) {
+        table->numBuckets *= 2;
+    }
+    table->buckets = calloc(table->numBuckets, sizeof(AuthToken*));
+    table->tokens = malloc(sizeof(AuthToken) * numTokens);
+    table->numTokens = numTokens;
+    table->text = text;
+
+    int i = 0;
+    for (char* line = text; i < numTokens; line += strlen(line) + 1) {
+        if (*line == '\0') {
+            continue;
+        }
+        AuthToken* entry = &table->tokens[i++];
+        entry->token = line;
+        entry->length = strlen(line);
+        unsigned long long hash = hash_seeded(table->seed, line,
+                entry->length);
+        AuthToken** bucket = &table->buckets[hash & (table->numBuckets - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+    }
+    return table;
+}
+
+int check_auth_token(Server* server, char* token) {
+    AuthTable* table = __atomic_load_n(&server->authTable, __ATOMIC_ACQUIRE);
+    size_t length = strlen(token);
+    unsigned long long hash = hash_seeded(table->seed, token, length);
+    AuthToken* entry = table->buckets[hash & (table->numBuckets - 1)];
+
+    int isMatch = 0;
+    for (; entry != NULL; entry = entry->next) {
+        isMatch |= tokens_equal(token, length, entry);
+    }
+    return isMatch;
+}
+
+/* Frees a table which has been replaced. This is called by the timer wheel,
+ * and frees the timer itself, so it must not be rearmed.
+ */
+static long long retire_auth_table(Timer* timer) {
+    AuthTable* table = (AuthTable*) timer->arg;
+    free(table->buckets);
+    free(table->tokens);
+    free(table->text);
+    free(table);
+    return 0;
+}
+
+int reload_auth_table(Server* server) {
+    AuthTable* table = load_auth_table(server->authPath);
+    if (table == NULL) {
+        fprintf(stderr, "Could not reload authfile\n");
+        return 0;
+    }
+
+    AuthTable* oldTable = __atomic_exchange_n(&server->authTable, table,
+            __ATOMIC_ACQ_REL);
+    fprintf(stderr, "Reloaded %d auth tokens\n", table->numTokens);
+
+    // A check which loaded the old table just before the swap takes a few
+    // microseconds at most, so it has finished long before the table goes
+    if (server->timers != NULL) {
+        init_timer(&oldTable->retire, retire_auth_table, oldTable);
+        arm_timer(server->timers, &oldTable->retire, AUTH_RETIRE_MS);
+    }
+    return 1;
+}
@@ -0,0 +1,102 @@
+#ifndef AUTHTABLE_H
+#define AUTHTABLE_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+#include "timerwheel.h"
+#define AUTH_RETIRE_MS 5000
+
+/* The AuthToken datastructure holds a single token which clients may
+ * authenticate with.
+ *
+ * token: The token, pointing into its table's text.
+ *
+ * length: The length of the token.
+ *
+ * next: A pointer to the next token in the same bucket.
+ */
+typedef struct AuthToken {
+    char* token;
+    size_t length;
+    struct AuthToken* next;
+} AuthToken;
+
+/* The AuthTable datastructure holds every token in an authfile, hashed into
+ * buckets so that checking a token takes the same time however many tokens
+ * there are. A table is never changed once it has been loaded; reloading the
+ * authfile builds a new table and swaps it in, so checking a token never
+ * takes a lock.
+ *
+ * seed: A random value mixed into every hash, so that which bucket a client's
+ *  token lands in reveals nothing about the tokens in the table.
+ *
+ * numBuckets: The number of buckets, which is always a power of two.
+ *
+ * buckets: The head of each bucket's list of tokens.
+ *
+ * tokens: Every token in the table, in a single allocation.
+ *
+ * numTokens: The number of tokens in the table.
+ *
+ * text: The authfile's contents, which the tokens point into.
+ *
+ * retire: Frees the table once it has been replaced, and every check which
+ *  could still be reading it has long since finished.
+ */
+typedef struct AuthTable {
+    unsigned long long seed;
+    size_t numBuckets;
+    AuthToken** buckets;
+    AuthToken* tokens;
+    int numTokens;
+    char* text;
+    Timer retire;
+} AuthTable;
+
+/* The load_auth_table function reads an authfile into a new table. Every
+ * non-empty line of the file is a token.
+ *
+ * Parameters:
+ *      path - The path of the authfile
+ *
+ * Returns:
+ *      (AuthTable*) - The newly loaded table
+ *      (AuthTable*) NULL - if the file could not be read or has no tokens
+ */
+AuthTable* load_auth_table(char* path);
+
+/* The check_auth_token function checks whether a client's token is in the
+ * server's current auth table. Only the one bucket the token hashes to is
+ * searched, and every token in it is compared in full without stopping at
+ * the first difference, so the time taken does not depend on how much of the
+ * token is right.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      token - The token the client sent
+ *
+ * Returns:
+ *      (int) 1 - if the token is in the table
+ *      (int) 0 - otherwise
+ */
+int check_auth_token(Server* server, char* token);
+
+/* The reload_auth_table function reads the server's authfile again, and swaps
+ * the new table in for the current one, which is freed AUTH_RETIRE_MS later.
+ * Handshakes already checking the old table finish with it, and every later
+ * check uses the new one. If the authfile cannot be read, the current table
+ * is kept.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *
+ * Returns:
+ *      (int) 1 - if the table was reloaded
+ *      (int) 0 - otherwise
+ */
+int reload_auth_table(Server* server);
+#endif
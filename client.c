@@ -4,29 +4,99 @@
 #include <string.h>
 #include <strings.h>
 #include <stdarg.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <netdb.h>
+#include <getopt.h>
 #include "client.h"
+#include "clientutil.h"
 #include "sharedutil.h"
+#include "sharedring.h"
 
 int main(int argc, char* argv[]) {
 
+    // Grab any options given before the client's name
+    char* scriptPath = NULL;
+    double speed = 1;
+    int compressLevel = 0;
+    int isFastJoin = 0;
+    int isSharedMemory = 0;
+    int isReconnecting = 0;
+    int backlogLimit = DEFAULT_BACKLOG;
+    long maxMessage = DEFAULT_MAX_MESSAGE;
+    struct option options[] = {
+        {"replay", required_argument, NULL, 'r'},
+        {"speed", required_argument, NULL, 's'},
+        {"compress", required_argument, NULL, 'z'},
+        {"fast-join", no_argument, NULL, 'f'},
+        {"shared-memory", no_argument, NULL, 'm'},
+        {"reconnect", no_argument, NULL, 'c'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"max-message", required_argument, NULL, 'M'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "r:s:z:fmcb:M:", options, 
+            NULL)) != -1) {
+        switch (option) {
+            case 'r':
+                scriptPath = optarg;
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'z':
+                compressLevel = atoi(optarg);
+                break;
+            case 'f':
+                isFastJoin = 1;
+                break;
+            case 'm':
+                isSharedMemory = 1;
+                break;
+            case 'c':
+                isReconnecting = 1;
+                break;
+            case 'b':
+                backlogLimit = atoi(optarg);
+                break;
+            case 'M':
+                maxMessage = atol(optarg);
+                break;
+            default:
+                client_usage();
+        }
+    }
+    if (argc - optind != 3 || speed < 0 || compressLevel < 0 || 
+            compressLevel > 9 || backlogLimit < 0 || maxMessage < 1 ||
+            (isSharedMemory && strchr(argv[optind + 2], '/') == NULL)) {
+        client_usage();
+    }
+    argv += optind - 1;
+
     // Grab client name and auth string
     char* name = argv[1];
 
     FILE* authFilePath = fopen(argv[2], "r");
-    if (argc != 4 || authFilePath == NULL) {
-        fprintf(stderr, "Usage: client name authfile port\n");
-        client_exit(USAGE, NULL);
+    if (authFilePath == NULL) {
+        client_usage();
     }
 
     char auth[MAX_BUF] = "AUTH:";
     char authBuffer[MAX_BUF];
     strcat(auth, strtok(fgets(authBuffer, MAX_BUF - 1, authFilePath), "\n"));
     fclose(authFilePath);
+
+    // Open the replay script before connecting, so a bad path is a usage error
+    Replay* replay = NULL;
+    if (scriptPath != NULL && 
+            (replay = setup_replay(scriptPath, speed)) == NULL) {
+        client_usage();
+    }
     
     // Establish connection with server
     char* port = argv[3];
@@ -36,11 +106,27 @@ int main(int argc, char* argv[]) {
         client_exit(COMMS, NULL);
     }  
     
-    // Setup client's datastructure instance
+    // Setup client's datastructure instance, with rings to offer the server
+    // if it should be reached through shared memory
     Client* client = setup_client(socket, name, auth);
+    client->replay = replay;
+    client->assembler = setup_assembler(maxMessage);
+    client->isOutputBuffered = setup_output();
+    if (isSharedMemory && 
+            (client->offeredRings = create_shared_rings()) == NULL) {
+        fprintf(stderr, "Communications error\n");
+        client_exit(COMMS, NULL);
+    }
+
+    // A reconnecting client keeps going when writing to a dropped connection,
+    // and notices the drop when reading from it instead
+    if (isReconnecting) {
+        client->reconnect = setup_reconnect(port, compressLevel, isFastJoin,
+                isSharedMemory, backlogLimit);
+        signal(SIGPIPE, SIG_IGN);
+    }
 
-    // Authenticate client and negotiate names with the server
-    if (!authenticate_client(client) || !resolve_client_name(client)) {
+    if (!join_server(client, compressLevel, isFastJoin)) {
         fprintf(stderr, "Authentication error\n");
         client_exit(FAILAUTH, client);
     }
@@ -50,8 +136,10 @@ int main(int argc, char* argv[]) {
     pthread_create(&serverTid, 0, listen_to_server, (void*) client);
 
     pthread_t userTid;
-    // Setup another thread to listen to user input and send back to server.
-    pthread_create(&userTid, 0, listen_to_user, (void*) client);
+    // Setup another thread to listen to user input (or play back the replay
+    // script) and send back to server.
+    pthread_create(&userTid, 0, 
+            replay == NULL ? listen_to_user : replay_script, (void*) client);
    
     // If threads do not exit, wait for both to return so main does not exit
     pthread_join(serverTid, NULL);
@@ -62,6 +150,26 @@ int main(int argc, char* argv[]) {
 }
 
 int connect_to_server(char* port) {
+    // A path is a Unix domain socket the server is listening on
+    if (strchr(port, '/') != NULL) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(struct sockaddr_un));
+        address.sun_family = AF_UNIX;
+        if (strlen(port) >= sizeof(address.sun_path)) {
+            return 0;
+        }
+        strcpy(address.sun_path, port);
+        int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socketFD < 0 || connect(socketFD, (struct sockaddr*) &address,
+                sizeof(struct sockaddr_un))) {
+            if (socketFD >= 0) {
+                close(socketFD);
+            }
+            return 0;
+        }
+        return socketFD;
+    }
+
     // Setup address information storage variables
     struct addrinfo* ai = NULL;
     struct addrinfo hints;
@@ -79,25 +187,121 @@ int connect_to_server(char* port) {
     // Free address information before returning whether connection established
     freeaddrinfo(ai);
     if (connection < 0) {
+        close(socketFD);
         return 0;
     } else {
         return socketFD;
     }
 }
 
-int authenticate_client(Client* client) {
+int join_server(Client* client, int compressLevel, int isFastJoin) {
+    // Authenticate client and negotiate names with the server, either step by
+    // step or all at once
+    int isJoined = isFastJoin ? fast_join_client(client, compressLevel) :
+            authenticate_client(client, compressLevel) && 
+            resolve_client_name(client);
+
+    // A server which did not agree to shared memory never uses the rings
+    free_shared_rings(client->offeredRings);
+    client->offeredRings = NULL;
+    return isJoined;
+}
+
+void rejoin_server(Client* client) {
+    Reconnect* reconnect = client->reconnect;
+    fprintf(stderr, "Connection lost, reconnecting\n");
+    drop_connection(client);
+
+    for (int attempt = 0; ; attempt++) {
+        // Buffered output (e.g. from a failed handshake) is never held back
+        // for the whole wait
+        fflush(stdout);
+        wait_to_reconnect(reconnect, attempt);
+        int socket = connect_to_server(reconnect->port);
+        if (!socket) {
+            continue;
+        }
+
+        // Rings which cannot be set up are simply not offered this time
+        take_lock(client->writeLock);
+        reopen_connection(client, socket);
+        release_lock(client->writeLock);
+        if (reconnect->isSharedMemory) {
+            client->offeredRings = create_shared_rings();
+        }
+        if (join_server(client, reconnect->compressLevel, 
+                reconnect->isFastJoin)) {
+            break;
+        }
+    }
+
+    // Without a session, nothing which was cut off is ever finished
+    if (reconnect->sessionToken == 0) {
+        forget_assemblies(client->assembler);
+    }
+    send_backlog(client);
+    fprintf(stderr, "Reconnected\n");
+}
+
+/* Gives up on a handshake whose connection has failed. A client which is
+ * rejoining the server goes on to its next attempt, and any other client
+ * exits with a COMMS error.
+ */
+static int abandon_handshake(Client* client) {
+    if (client->reconnect == NULL || client->reconnect->isConnected) {
+        fprintf(stderr, "Communications error\n");
+        client_exit(COMMS, NULL);
+    }
+    return 0;
+}
+
+int authenticate_client(Client* client, int compressLevel) {
     char buffer[MAX_BUF];
+    char capabilities[MAX_BUF];
+    sprintf(capabilities, "CAPS:%sSUFFIX,CHUNKED,PRESENCE%s%s", 
+            compressLevel > 0 ? "DEFLATE," : "",
+            client->offeredRings != NULL ? ",SHM" : "",
+            client->reconnect != NULL ? ",RESUME" : "");
+    int isCompressing = 0;
+    int isSharing = 0;
     while (1) {
 
         int response = receive_message(client, buffer);
         if (!response) {
-            fprintf(stderr, "Communications error\n");
-            client_exit(COMMS, NULL);
+            return abandon_handshake(client);
 
         } else if (!strcmp(buffer, "AUTH:")) {
+            // Ask for compression or shared memory (if wanted) and name
+            // suffixes before authenticating. Shared memory rings are passed
+            // along with the line asking for them.
+            if (client->offeredRings != NULL) {
+                offer_shared_rings(client, capabilities);
+            } else {
+                send_message(client, capabilities);
+            }
             send_message(client, client->authString);
         
+        } else if (!strncmp(buffer, "CAPS:", strlen("CAPS:"))) {
+            isCompressing = strstr(buffer, "DEFLATE") != NULL;
+            isSharing = strstr(buffer, "SHM") != NULL;
+            if (strstr(buffer, "CHUNKED") != NULL) {
+                client->capabilities |= CAP_CHUNKED;
+            }
+
+        } else if (!strncmp(buffer, "ERR:", strlen("ERR:"))) {
+            // The server has turned the connection away, e.g. it is full
+            handle_server_message(buffer);
+            return abandon_handshake(client);
+
         } else if (!strcmp(buffer, "OK:")) {
+            // Everything after the server's OK is compressed, or goes through
+            // the rings, if agreed
+            if (isCompressing) {
+                enable_compression(client, compressLevel);
+            }
+            if (isSharing) {
+                enable_shared_rings(client);
+            }
             return 1;
         }
     }
@@ -107,17 +311,28 @@ int authenticate_client(Client* client) {
 int resolve_client_name(Client* client) {
     int nameCounter = -1;
     char buffer[MAX_BUF];
-    char nameBuffer[strlen(client->name) + 3];
+    char nameBuffer[strlen(client->name) + 16];
+    char resumeBuffer[64];
+    int isResuming = client->reconnect != NULL && 
+            client->reconnect->sessionToken != 0;
     
     while (1) {
 
         int response = receive_message(client, buffer);
         if (!response) {
-            fprintf(stderr, "Communications error\n");
-            client_exit(COMMS, NULL);
+            return abandon_handshake(client);
         }
 
-        if (!strcmp(buffer, "WHO:")) {
+        if (!strcmp(buffer, "WHO:") && isResuming) {
+            // Try to resume the session first. If it cannot be resumed, then
+            // the server asks for the name again
+            sprintf(resumeBuffer, "RESUME:%016llx:%llu", 
+                    client->reconnect->sessionToken, 
+                    client->reconnect->lastSequence);
+            send_message(client, resumeBuffer);
+            isResuming = 0;
+
+        } else if (!strcmp(buffer, "WHO:")) {
             if (nameCounter < 0) {
                 sprintf(nameBuffer, "NAME:%s", client->name);
             } else {
@@ -128,27 +343,147 @@ int resolve_client_name(Client* client) {
         } else if (!strcmp(buffer, "NAME_TAKEN:")) {
             nameCounter++;
 
+        } else if (!strncmp(buffer, "NAME:", strlen("NAME:"))) {
+            // The server has given the client the next free name itself
+            client->name = strcpy(realloc(client->name, 
+                    sizeof(char) * (strlen(buffer + 5) + 1)), buffer + 5);
+            nameCounter = -1;
+
         } else if (!strcmp(buffer, "OK:")) {
-            return 1;
+            break;
         }
     }
 
-    // Update the client's name if it has changed
+    // Update the client's name if it has changed (skipping "NAME:")
     if (nameCounter >= 0) {
-        sprintf(client->name, "%s%d", client->name, nameCounter);
+        client->name = strcpy(realloc(client->name, 
+                sizeof(char) * (strlen(nameBuffer + 5) + 1)), nameBuffer + 5);
     }
 
     return 1;
 }
 
+int fast_join_client(Client* client, int compressLevel) {
+    char buffer[MAX_BUF];
+    int isCompressing = 0;
+    int isSharing = 0;
+    int isFastJoin = 0;
+    int wasAsked = 0;
+    int wasAccepted = 0;
+    int isNameSent = 1;
+    int nameCounter = -1;
+    char nameBuffer[strlen(client->name) + 16];
+
+    // Send everything the server would ask for in a single write, without
+    // waiting to be asked, along with any shared memory rings
+    // A reconnecting client with a session tries to resume it in place of
+    // sending its name
+    Reconnect* reconnect = client->reconnect;
+    int isResuming = reconnect != NULL && reconnect->sessionToken != 0;
+    sanitise_message(client->authString);
+    sanitise_message(client->name);
+    char join[strlen(client->name) + 64];
+    if (isResuming) {
+        sprintf(join, "RESUME:%016llx:%llu", reconnect->sessionToken,
+                reconnect->lastSequence);
+    } else {
+        sprintf(join, "NAME:%s", client->name);
+    }
+    char burst[strlen(client->authString) + strlen(join) + 64];
+    sprintf(burst, "CAPS:%sSUFFIX,FASTJOIN,CHUNKED,PRESENCE%s%s\n%s\n%s",
+            compressLevel > 0 ? "DEFLATE," : "",
+            client->offeredRings != NULL ? ",SHM" : "", 
+            reconnect != NULL ? ",RESUME" : "", client->authString, join);
+    if (client->offeredRings != NULL) {
+        offer_shared_rings(client, burst);
+    } else {
+        take_lock(client->writeLock);
+        fprintf(client->writeHandle, "%s\n", burst);
+        fflush(client->writeHandle);
+        release_lock(client->writeLock);
+    }
+
+    while (1) {
+
+        int response = receive_message(client, buffer);
+        if (!response) {
+            return abandon_handshake(client);
+
+        } else if (!strncmp(buffer, "CAPS:", strlen("CAPS:"))) {
+            isCompressing = strstr(buffer, "DEFLATE") != NULL;
+            isSharing = strstr(buffer, "SHM") != NULL;
+            isFastJoin = strstr(buffer, "FASTJOIN") != NULL;
+            if (strstr(buffer, "CHUNKED") != NULL) {
+                client->capabilities |= CAP_CHUNKED;
+            }
+
+        } else if (!strcmp(buffer, "WHO:")) {
+            // A server which does not join fast accepts the auth string,
+            // then asks for the name sent already, and asks again for each
+            // name after one is taken. Any other WHO: means the session could
+            // not be resumed, so the name is sent after all.
+            if (isResuming && (wasAsked || !wasAccepted)) {
+                isResuming = 0;
+                isNameSent = 0;
+            }
+            wasAsked = 1;
+            if (!isNameSent && nameCounter < 0) {
+                sprintf(nameBuffer, "NAME:%s", client->name);
+            } else if (!isNameSent) {
+                sprintf(nameBuffer, "NAME:%s%d", client->name, nameCounter);
+            }
+            if (!isNameSent) {
+                send_message(client, nameBuffer);
+                isNameSent = 1;
+            }
+
+        } else if (!strcmp(buffer, "NAME_TAKEN:")) {
+            nameCounter++;
+            isNameSent = 0;
+
+        } else if (!strncmp(buffer, "NAME:", strlen("NAME:"))) {
+            // The server has given the client the next free name itself
+            client->name = strcpy(realloc(client->name, 
+                    sizeof(char) * (strlen(buffer + 5) + 1)), buffer + 5);
+            nameCounter = -1;
+
+        } else if (!strncmp(buffer, "ERR:", strlen("ERR:"))) {
+            handle_server_message(buffer);
+            return abandon_handshake(client);
+
+        } else if (!strcmp(buffer, "OK:")) {
+            // A server which does not join fast sends OK after the auth
+            // string as well, before asking for the name
+            if (isCompressing && client->compression == NULL) {
+                enable_compression(client, compressLevel);
+            }
+            if (isSharing && client->rings == NULL) {
+                enable_shared_rings(client);
+            }
+            if (isFastJoin || wasAsked) {
+                break;
+            }
+            wasAccepted = 1;
+        }
+    }
+
+    if (nameCounter >= 0) {
+        client->name = strcpy(realloc(client->name, 
+                sizeof(char) * (strlen(nameBuffer + 5) + 1)), nameBuffer + 5);
+    }
+    return 1;
+}
+
 void* listen_to_user(void* args) {
     Client* client = (Client*) args;
     
-    char buffer[MAX_BUF];
+    char* line;
     // Receive messages from user, parse, and send message back to server
-    while (fgets(buffer, MAX_BUF - 1, stdin)) {
-        int response = handle_user_message(buffer);
-        send_message(client, buffer);
+    while ((line = read_user_line(stdin, client->assembler->maxMessage)) !=
+            NULL) {
+        int response = handle_user_message(line);
+        send_user_message(client, line);
+        free(line);
         if (response == LEAVE) {
             client_exit(NORMAL, client);    
         }
@@ -160,12 +495,46 @@ void* listen_to_user(void* args) {
 void* listen_to_server(void* args) {
     Client* client = (Client*) args;
     
+    Reconnect* reconnect = client->reconnect;
     char buffer[MAX_BUF];
-    // Receive messages from the server, parse, and output to user
-    while (receive_message(client, buffer)) {
-        int response = handle_server_message(buffer); 
+    // Receive messages from the server, parse, and output to user. A
+    // reconnecting client rejoins the server whenever the connection drops.
+    // Long chat messages are only handled once they are whole. Messages shown
+    // while the server is busy are written to stdout together.
+    long long pendingSince = 0;
+    while (1) {
+        flush_output(client, &pendingSince);
+        if (!receive_message(client, buffer)) {
+            if (reconnect == NULL) {
+                break;
+            }
+            pendingSince = 0;
+            rejoin_server(client);
+            continue;
+        }
+        if (reconnect != NULL && !track_session(reconnect, buffer)) {
+            // A new session carries on from none of the messages before it
+            forget_assemblies(client->assembler);
+            continue;
+        }
+        char* message = assemble_message(client->assembler, buffer);
+        if (message == NULL) {
+            continue;
+        }
+        if (client->replay != NULL) {
+            record_replay_echo(client, message);
+        }
+        int response = handle_server_message(message); 
+        if (!client->isOutputBuffered) {
+            fflush(stdout);
+        } else if (pendingSince == 0) {
+            pendingSince = current_time_us();
+        }
         if (response == KICKED) {
             client_exit(KICKED, client); 
+        } else if (response == PING) {
+            char pong[] = "PONG:";
+            send_message(client, pong);
         }
     }
 
@@ -200,7 +569,30 @@ int handle_user_message(char* message) {
     return 0;
 }
 
+void client_usage(void) {
+    fprintf(stderr, "Usage: client [--replay script [--speed factor]] "
+            "[--compress level] [--fast-join] [--shared-memory] "
+            "[--reconnect [--backlog lines]] [--max-message bytes] "
+            "name authfile port|path\n");
+    client_exit(USAGE, NULL);
+}
+
 void client_exit(int exitCode, Client* client) {
-    free_client(client);
+    // Report the latency of a replay session before its state is lost
+    if (client != NULL && client->replay != NULL) {
+        print_replay_summary(client->replay);
+        Compression* compression = client->compression;
+        if (compression != NULL) {
+            fprintf(stderr, "compression:SENT:%zu:RAW_SENT:%zu:RECEIVED:%zu:"
+                    "RAW_RECEIVED:%zu\n", compression->compressedOut,
+                    compression->plainOut, compression->compressedIn,
+                    compression->plainIn);
+        }
+    }
+
+    // The client's handles are not closed here, as the other thread may still
+    // be blocked reading from them, and fclose would wait on that stream's
+    // lock forever. Exiting the process reclaims them instead.
+    fflush(stdout);
     exit(exitCode);
 }
@@ -8,10 +8,12 @@
 #include "sharedutil.h"
 
 /* The connect_to_server function sets up a connection from the client to the
- * server on the localhost over IPv4 with the TCP protocol.
+ * server on the localhost over IPv4 with the TCP protocol. If port is a path
+ * (containing a '/'), the client instead connects to a server listening on a
+ * Unix domain socket at that path, e.g. with --unix-listen.
  *
  * Parameters:
- *      port - the port number specified by the user to listen on
+ *      port - the port number (or socket path) the server is listening on
  * 
  * Returns:
  *      (int) socketFD - a socket file descriptor returned from socket(2)
@@ -19,45 +21,122 @@
  */
 int connect_to_server(char* port);
 
+/* The join_server function authenticates the client and negotiates its name
+ * with the server, either step by step (with authenticate_client and
+ * resolve_client_name) or all at once (with fast_join_client). Any shared
+ * memory rings the server did not agree to are freed afterwards.
+ *
+ * Parameters:
+ *      client - The main instance of the client datastructure
+ *      compressLevel - The zlib compression level (1-9) for messages sent to
+ *          the server, or 0 if compression should not be asked for
+ *      isFastJoin - Whether to join with fast_join_client
+ *
+ * Returns:
+ *      (int) 0 - if the client could not join the server
+ *      (int) 1 - if the client has joined the server
+ */
+int join_server(Client* client, int compressLevel, int isFastJoin);
+
+/* The rejoin_server function brings a reconnecting client back to the server
+ * once its connection has dropped. User input is kept in the backlog from
+ * then on. The client then waits out a jittered backoff before each attempt
+ * (see wait_to_reconnect), connects again, and runs its handshake in the same
+ * way as on startup, resuming its session if the server still holds it. Once
+ * the client has rejoined, the backlog is sent. This only returns once the
+ * client has rejoined.
+ *
+ * Parameters:
+ *      client - A reconnecting client whose connection has dropped
+ */
+void rejoin_server(Client* client);
+
 /* The authenticate_client method authenticates the client process clientside.
  * Once a connection has been established on client startup, the client will
  * receive messages from the server, and will send back the client's given auth
  * string if asked.
  *
+ * The client first lists the capabilities it would like with CAPS:. If a
+ * compression level is given, it asks for compression with DEFLATE. If the
+ * server agrees, then the connection is compressed from the server's OK
+ * onwards. Otherwise, the connection carries on uncompressed. It always asks
+ * for SUFFIX (see resolve_client_name). If the client has shared memory rings
+ * to offer, it asks for SHM and passes the rings along with the line, and
+ * the connection moves onto the rings from the server's OK onwards if the
+ * server agrees. A reconnecting client also asks for RESUME, so that it is
+ * given a session it can resume when it rejoins. It always asks for CHUNKED
+ * and PRESENCE too, as it can show long chat messages sent in pieces and
+ * ENTER or LEAVE events sent in batches.
+ *
  * Parameters:
  *      client - The main instance of the client datastructure
+ *      compressLevel - The zlib compression level (1-9) for messages sent to
+ *          the server, or 0 if compression should not be asked for
  *
  * Returns:
  *      (int) 0 - if authentication was unsuccessful (the server stopped
- *          communicating with the client during authentication)
+ *          communicating with the client while it was rejoining the server)
  *      (int) 1 - if authentication was successful (the client received OK from
  *          the server)
  */
-int authenticate_client(Client* client);
+int authenticate_client(Client* client, int compressLevel);
 
 /* The resolve_client_name function negotiates the client's name with the 
  * server clientside. The client will send its given name to the server
  * whenever the server asks for it at this stage. If the client is told that
  * its name has already been taken by a client already connected to the server,
  * then it will increment its "name counter", and update its name by appending
- * this counter. 
+ * this counter. Servers which understood CAPS:SUFFIX instead pick the next
+ * free name themselves, and send it back with NAME:<name> before OK, so that
+ * the name is settled in a single round trip.
+ *
+ * A client rejoining the server with a session first answers WHO: with
+ * RESUME:<token>:<sequence>, and only sends its name if it is asked again.
  *
  * On successful name negotiation, the client will copy down its
- * most recent name. If name negotiation is unsuccessful, then the client exits
- * immediately.
+ * most recent name, so that its own echoed messages can be recognised. If
+ * name negotiation is unsuccessful, then the client exits immediately, unless
+ * it is rejoining the server.
  *
  * Parameters:
  *      client - The main instance of the client datastructure
  *
  * Returns:
+ *      (int) 0 - if the connection failed while rejoining the server
  *      (int) 1 - On successful name negotiation with the server
  */
 int resolve_client_name(Client* client);
 
+/* The fast_join_client function authenticates the client and negotiates its
+ * name clientside in a single round trip, in place of authenticate_client and
+ * resolve_client_name. The client sends its capabilities (with FASTJOIN),
+ * auth string and name in one write as soon as it has connected, and the
+ * server answers once all of them have been checked, with CAPS:FASTJOIN,
+ * the client's name if it had to be changed, and OK.
+ *
+ * A server which does not join fast still prompts with AUTH: and WHO: and
+ * sends OK after each step, which the client follows without sending
+ * anything twice. Compression cannot be asked for from such a server, as the
+ * name has been sent before compression could start. A client rejoining the
+ * server with a session sends RESUME:<token>:<sequence> in place of its
+ * name, and sends its name once the server asks for it instead.
+ *
+ * Parameters:
+ *      client - The main instance of the client datastructure
+ *      compressLevel - The zlib compression level (1-9) for messages sent to
+ *          the server, or 0 if compression should not be asked for
+ *
+ * Returns:
+ *      (int) 0 - if the connection failed while rejoining the server
+ *      (int) 1 - On successfully joining the server
+ */
+int fast_join_client(Client* client, int compressLevel);
+
 /* The listen_to_user function is the main routine for the thread which listens
  * to user input (which is created in main). This routine receives any input
  * from the user (on stdin), and handles this input for the user to see, 
- * before sending an appropriate response to the server. 
+ * before sending an appropriate response to the server. Lines of any length
+ * are read whole, up to the client's --max-message bytes.
  *
  * On exit, this thread will stop the execution of the thread which listens to
  * server commands (in order to properly free resources).
@@ -73,7 +152,13 @@ void* listen_to_user(void* args);
 /* The listen_to_server function is the main routine for the thread which
  * listen to server input (which is created in main). This routine receives
  * any message/command from the server and handles this input in a way that
- * the user can easily read.
+ * the user can easily read. If the client is reconnecting, then the session
+ * is followed in the messages received (see track_session), and the client
+ * rejoins the server whenever the connection drops, rather than exiting. Long
+ * chat messages which the server streams in pieces are put back together
+ * before they are shown (see assemble_message). Unless stdout is a terminal,
+ * messages shown while the server is busy are written out together (see
+ * flush_output).
  *
  * On exit, this thread will stop the execution of the thread which listens to
  * user input (in order to properly free resources).
@@ -95,7 +180,8 @@ void* listen_to_server(void* args);
  * clients in the server, so this message is properly formatted before sending.
  *
  * Parameters:
- *      message - A message buffer containing the raw user input
+ *      message - A message buffer containing the raw user input, with room
+ *          for "SAY:" to be added in front of it
  *
  * Returns:
  *      (int) 0 - if any normal message was sent to the server
@@ -104,12 +190,20 @@ void* listen_to_server(void* args);
  */
 int handle_user_message(char* message);
 
-/* The client_exit function frees up all memory given to a client instance, and
- * exits the process with the supplied exitCode.
+/* The client_usage function outputs the client's usage message to stderr and
+ * exits the process with a USAGE error.
+ */
+void client_usage(void);
+
+/* The client_exit function exits the process with the supplied exitCode. If the
+ * client was replaying a script, then the replay's latency summary (and the
+ * connection's compression stats, if compressed) is output first. The
+ * client's memory and handles are reclaimed by the process exiting, as the
+ * other client thread may still be blocked on them.
  *
  * Parameters:
  *      exitCode - The code which the process will exit with
- *      client - An instance of the client which should be freed before exit
+ *      client - An instance of the client which is exiting
  */
 void client_exit(int exitCode, Client* client);
 #endif
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "server.h"
+#include "sharedutil.h"
+#include "outqueue.h"
+#include "clienttable.h"
+#include "fanout.h"
+
+ClientTable* create_client_table(void) {
+    ClientTable* table = malloc(sizeof(ClientTable));
+    table->capacity = CLIENT_TABLE_INITIAL;
+    table->queues = calloc(table->capacity, sizeof(OutQueue*));
+    table->flags = malloc(table->capacity);
+    table->generations = malloc(sizeof(unsigned int) * table->capacity);
+    table->clients = calloc(table->capacity, sizeof(Client*));
+    table->freeSlots = malloc(sizeof(int) * table->capacity);
+    table->numFree = 0;
+    table->numSlots = 0;
+    table->numClients = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        table->flags[i] = SLOT_EVICTED;
+        table->generations[i] = 1;
+    }
+    return table;
+}
+
+/* Doubles the number of slots the table has room for.
+ */
+static void grow_client_table(ClientTable* table) {
+    int capacity = table->capacity * 2;
+    table->queues = realloc(table->queues, sizeof(OutQueue*) * capacity);
+    table->flags = realloc(table->flags, capacity);
+    table->generations = realloc(table->generations,
+            sizeof(unsigned int) * capacity);
+    table->clients = realloc(table->clients, sizeof(Client*) * capacity);
+    table->freeSlots = realloc(table->freeSlots, sizeof(int) * capacity);
+    for (int i = table->capacity; i < capacity; i++) {
+        table->queues[i] = NULL;
+        table->flags[i] = SLOT_EVICTED;
+        table->generations[i] = 1;
+        table->clients[i] = NULL;
+    }
+    table->capacity = capacity;
+}
+
+ClientHandle add_client_slot(ClientTable* table, Client* client) {
+    if (is_client_table_full(table)) {
+        client->handle = NO_CLIENT_HANDLE;
+        return NO_CLIENT_HANDLE;
+    }
+
+    int slot;
+    if (table->numFree > 0) {
+        slot = table->freeSlots[--table->numFree];
+    } else {
+        if (table->numSlots == table->capacity) {
+            grow_client_table(table);
+        }
+        slot = table->numSlots++;
+    }
+
+    table->queues[slot] = client->outQueue;
+    table->clients[slot] = client;
+    table->numClients++;
+    client->handle = (table->generations[slot] << SLOT_BITS) | slot;
+    update_client_slot(table, client);
+    return client->handle;
+}
+
+int is_client_table_full(ClientTable* table) {
+    return table->numFree == 0 && table->numSlots == MAX_CLIENT_SLOTS;
+}
+
+void remove_client_slot(ClientTable* table, Client* client) {
+    if (find_client_slot(table, client->handle) != client) {
+        return;
+    }
+
+    int slot = client->handle & SLOT_MASK;
+    table->queues[slot] = NULL;
+    table->flags[slot] = SLOT_EVICTED;
+    table->clients[slot] = NULL;
+    table->numClients--;
+    client->handle = NO_CLIENT_HANDLE;
+
+    // Generations wrap around within the bits above the slot, skipping 0
+    unsigned int generation = (table->generations[slot] + 1) &
+            (~0u >> SLOT_BITS);
+    table->generations[slot] = generation == 0 ? 1 : generation;
+    table->freeSlots[table->numFree++] = slot;
+}
+
+void update_client_slot(ClientTable* table, Client* client) {
+    if (find_client_slot(table, client->handle) != client) {
+        return;
+    }
+    OutQueue* queue = client->outQueue;
+    table->flags[client->handle & SLOT_MASK] = rendition_for(queue) |
+            (queue->isEvicted ? SLOT_EVICTED : 0);
+}
+
+Client* find_client_slot(ClientTable* table, ClientHandle handle) {
+    int slot = handle & SLOT_MASK;
+    if (handle == NO_CLIENT_HANDLE || slot >= table->numSlots ||
+            table->generations[slot] != handle >> SLOT_BITS) {
+        return NULL;
+    }
+    return table->clients[slot];
+}
@@ -0,0 +1,139 @@
+#ifndef CLIENTTABLE_H
+#define CLIENTTABLE_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "sharedutil.h"
+#include "server.h"
+#define CLIENT_TABLE_INITIAL 64
+#define SLOT_BITS 20
+#define SLOT_MASK ((1u << SLOT_BITS) - 1)
+#define MAX_CLIENT_SLOTS (1 << SLOT_BITS)
+#define NO_CLIENT_HANDLE 0
+#define SLOT_RENDITION 7
+#define SLOT_EVICTED 8
+
+/* A ClientHandle names one client in the server's ClientTable. The low
+ * SLOT_BITS bits are the client's slot, and the rest are the generation the
+ * slot was at when the client took it. A slot's generation moves on whenever
+ * its client leaves, so a handle kept after then can never find the slot's
+ * next client by mistake. Generations start at 1, so NO_CLIENT_HANDLE is
+ * never a valid handle. A table never holds more than MAX_CLIENT_SLOTS
+ * clients, as any more slots could not be told apart by their handles.
+ */
+typedef unsigned int ClientHandle;
+
+/* The ClientTable datastructure holds every client in the server's client
+ * list in a dense table of slots, stored as one array for each field rather
+ * than one struct for each client. Broadcasts only ever need a client's
+ * flags and outbound queue, so queueing a message for every client is a
+ * single pass along those arrays, and the rest of each Client is never
+ * touched. The table is only changed or read while holding the server's
+ * clientAccess.
+ *
+ * queues: The outbound queue of the client in each slot, or NULL if the slot
+ *  is free.
+ *
+ * flags: A byte for each slot, so that a broadcast can pick each client's
+ *  copy without reading its queue. The SLOT_RENDITION bits hold the client's
+ *  rendition (see rendition_for), and SLOT_EVICTED is set once its queue
+ *  has been found to be evicted, or if the slot is free, so that broadcasts
+ *  pass it over.
+ *
+ * generations: The current generation of each slot.
+ *
+ * clients: The client in each slot, or NULL if the slot is free.
+ *
+ * freeSlots: A stack of the free slots below numSlots, most recently freed on
+ *  top.
+ *
+ * numFree: The number of slots on freeSlots.
+ *
+ * numSlots: The number of slots which have ever been used. Every client is
+ *  in a slot below this.
+ *
+ * numClients: The number of slots currently in use.
+ *
+ * capacity: The number of slots there is room for before the arrays grow.
+ */
+typedef struct ClientTable {
+    struct OutQueue** queues;
+    unsigned char* flags;
+    unsigned int* generations;
+    Client** clients;
+    int* freeSlots;
+    int numFree;
+    int numSlots;
+    int numClients;
+    int capacity;
+} ClientTable;
+
+/* The create_client_table function initialises an empty client table with
+ * room for CLIENT_TABLE_INITIAL clients.
+ *
+ * Returns:
+ *      (ClientTable*) - The newly allocated table
+ */
+ClientTable* create_client_table(void);
+
+/* The add_client_slot function gives a client a slot in the table, reusing
+ * the most recently freed slot if there is one, and sets the client's handle.
+ * The client must already have an outbound queue, whose rendition is copied
+ * into the slot's flags.
+ *
+ * Parameters:
+ *      table - The server's client table
+ *      client - The client being added to the client list
+ *
+ * Returns:
+ *      (ClientHandle) - The client's new handle
+ *      (ClientHandle) NO_CLIENT_HANDLE - if the table already holds
+ *          MAX_CLIENT_SLOTS clients, in which case the client is not added
+ */
+ClientHandle add_client_slot(ClientTable* table, Client* client);
+
+/* The is_client_table_full function checks whether add_client_slot would
+ * turn a client away, so that a caller can refuse a client before it
+ * changes anything else.
+ *
+ * Parameters:
+ *      table - The server's client table
+ *
+ * Returns:
+ *      (int) 1 - if the table holds MAX_CLIENT_SLOTS clients, otherwise 0
+ */
+int is_client_table_full(ClientTable* table);
+
+/* The remove_client_slot function frees a client's slot and moves the slot
+ * on to its next generation, so that the client's handle no longer finds
+ * anything. Clients without a slot are ignored.
+ *
+ * Parameters:
+ *      table - The server's client table
+ *      client - The client being taken out of the client list
+ */
+void remove_client_slot(ClientTable* table, Client* client);
+
+/* The update_client_slot function copies a client's rendition into its
+ * slot's flags again, and must be called whenever the way its outbound queue
+ * has been set up changes after it was given a slot. Clients without a slot
+ * are ignored.
+ *
+ * Parameters:
+ *      table - The server's client table
+ *      client - A client in the client list
+ */
+void update_client_slot(ClientTable* table, Client* client);
+
+/* The find_client_slot function looks up the client which a handle was given
+ * to.
+ *
+ * Parameters:
+ *      table - The server's client table
+ *      handle - A handle returned by add_client_slot
+ *
+ * Returns:
+ *      (Client*) - The client, or NULL if it has since left the table
+ */
+Client* find_client_slot(ClientTable* table, ClientHandle handle);
+#endif
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "client.h"
+#include "clientutil.h"
+#include "sharedutil.h"
+
+Replay* setup_replay(char* scriptPath, double speed) {
+    FILE* script = fopen(scriptPath, "r");
+    if (script == NULL) {
+        return NULL;
+    }
+
+    Replay* replay = malloc(sizeof(Replay));
+    replay->script = script;
+    replay->speed = speed;
+
+    replay->pendingAccess = create_lock(malloc(sizeof(sem_t)));
+    replay->pendingHead = NULL;
+    replay->pendingTail = NULL;
+
+    replay->maxSamples = 64;
+    replay->numSamples = 0;
+    replay->samples = malloc(sizeof(long long) * replay->maxSamples);
+
+    replay->sent = 0;
+    replay->lost = 0;
+    replay->lastProgress = current_time_us();
+    return replay;
+}
+
+void* replay_script(void* args) {
+    Client* client = (Client*) args;
+    Replay* replay = client->replay;
+
+    char line[MAX_BUF];
+    char buffer[MAX_BUF + strlen("SAY:")];
+    while (fgets(line, MAX_BUF - 1, replay->script)) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        // Split the line into its delay and the input to send
+        char* input;
+        long delay = strtol(line, &input, 10);
+        if (input == line || delay < 0) {
+            continue;
+        }
+        input += strspn(input, " \t");
+        if (replay->speed > 0) {
+            usleep((useconds_t) (delay * 1000 / replay->speed));
+        }
+
+        strcpy(buffer, input);
+        int response = handle_user_message(buffer);
+
+        // Record chat messages before sending, so that the echo can never
+        // arrive before the message is pending
+        if (!strncmp(buffer, "SAY:", 4) && buffer[4] != '\0') {
+            PendingMessage* pending = malloc(sizeof(PendingMessage));
+            pending->text = strcpy(malloc(strlen(buffer + 4) + 1),
+                    buffer + 4);
+            sanitise_message(pending->text);
+            pending->next = NULL;
+
+            take_lock(replay->pendingAccess);
+            pending->sentAt = current_time_us();
+            if (replay->pendingTail == NULL) {
+                replay->pendingHead = pending;
+            } else {
+                replay->pendingTail->next = pending;
+            }
+            replay->pendingTail = pending;
+            replay->sent++;
+            replay->lastProgress = pending->sentAt;
+            release_lock(replay->pendingAccess);
+        }
+
+        send_user_message(client, buffer);
+        if (response == LEAVE) {
+            client_exit(NORMAL, client);
+        }
+    }
+
+    // Wait for outstanding echoes until they stop arriving. The reader
+    // thread updates both under pendingAccess.
+    while (1) {
+        take_lock(replay->pendingAccess);
+        int isDraining = replay->pendingHead != NULL &&
+                current_time_us() - replay->lastProgress < REPLAY_DRAIN_US;
+        release_lock(replay->pendingAccess);
+        if (!isDraining) {
+            break;
+        }
+        usleep(REPLAY_POLL_US);
+    }
+
+    client_exit(NORMAL, client);
+    return NULL;
+}
+
+void record_replay_echo(Client* client, char* message) {
+    Replay* replay = client->replay;
+    long long now = current_time_us();
+
+    // Only echoes of the form MSG:<own name>:<text> are of interest
+    size_t nameLength = strlen(client->name);
+    if (strncmp(message, "MSG:", 4) ||
+            strncmp(message + 4, client->name, nameLength) ||
+            message[4 + nameLength] != ':') {
+        return;
+    }
+    char* text = message + 5 + nameLength;
+
+    take_lock(replay->pendingAccess);
+
+    // Find the matching pending message, as anything before it was dropped
+    PendingMessage* match = replay->pendingHead;
+    while (match != NULL && strcmp(match->text, text)) {
+        match = match->next;
+    }
+
+    if (match != NULL) {
+        while (replay->pendingHead != match) {
+            PendingMessage* skipped = replay->pendingHead;
+            replay->pendingHead = skipped->next;
+            replay->lost++;
+            free(skipped->text);
+            free(skipped);
+        }
+        replay->pendingHead = match->next;
+        if (replay->pendingHead == NULL) {
+            replay->pendingTail = NULL;
+        }
+
+        if (replay->numSamples == replay->maxSamples) {
+            replay->maxSamples *= 2;
+            replay->samples = realloc(replay->samples,
+                    sizeof(long long) * replay->maxSamples);
+        }
+        replay->samples[replay->numSamples++] = now - match->sentAt;
+        replay->lastProgress = now;
+        free(match->text);
+        free(match);
+    }
+
+    release_lock(replay->pendingAccess);
+}
+
+/* Comparison function used to sort round trip times in ascending order.
+ */
+static int compare_samples(const void* a, const void* b) {
+    long long first = *(const long long*) a;
+    long long second = *(const long long*) b;
+    return (first > second) - (first < second);
+}
+
+void print_replay_summary(Replay* replay) {
+
+    take_lock(replay->pendingAccess);
+
+    // Anything still pending at exit was never echoed
+    int lost = replay->lost;
+    for (PendingMessage* pending = replay->pendingHead; pending != NULL;
+            pending = pending->next) {
+        lost++;
+    }
+
+    fprintf(stderr, "@REPLAY@\n");
+    fprintf(stderr, "replay:SENT:%d:ECHOED:%d:LOST:%d\n",
+            replay->sent, replay->numSamples, lost);
+
+    int count = replay->numSamples;
+    if (count > 0) {
+        long long* samples = replay->samples;
+        qsort(samples, count, sizeof(long long), compare_samples);
+        long long total = 0;
+        for (int i = 0; i < count; i++) {
+            total += samples[i];
+        }
+        fprintf(stderr, "rtt_us:MIN:%lld:AVG:%lld:P50:%lld:P90:%lld:"
+                "P99:%lld:MAX:%lld\n", samples[0], total / count,
+                samples[count * 50 / 100], samples[count * 90 / 100],
+                samples[count * 99 / 100], samples[count - 1]);
+    }
+
+    release_lock(replay->pendingAccess);
+}
+
+int setup_output(void) {
+    if (isatty(STDOUT_FILENO)) {
+        return 0;
+    }
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    return 1;
+}
+
+void flush_output(Client* client, long long* pendingSince) {
+    if (*pendingSince != 0 && (!is_message_waiting(client) ||
+            current_time_us() - *pendingSince >= OUTPUT_DEADLINE_US)) {
+        fflush(stdout);
+        *pendingSince = 0;
+    }
+}
+
+Reconnect* setup_reconnect(char* port, int compressLevel, int isFastJoin,
+        int isSharedMemory, int backlogLimit) {
+    Reconnect* reconnect = malloc(sizeof(Reconnect));
+    reconnect->port = port;
+    reconnect->compressLevel = compressLevel;
+    reconnect->isFastJoin = isFastJoin;
+    reconnect->isSharedMemory = isSharedMemory;
+
+    reconnect->backlogAccess = create_lock(malloc(sizeof(sem_t)));
+    reconnect->backlogHead = NULL;
+    reconnect->backlogTail = NULL;
+    reconnect->backlogLength = 0;
+    reconnect->backlogLimit = backlogLimit;
+    reconnect->isConnected = 1;
+
+    reconnect->sessionToken = 0;
+    reconnect->lastSequence = 0;
+    // Clients started in the same instant must still pick different delays
+    reconnect->seed = (unsigned int) (current_time_us() ^ 
+            ((long long) getpid() << 16));
+    return reconnect;
+}
+
+Assembler* setup_assembler(size_t maxMessage) {
+    Assembler* assembler = malloc(sizeof(Assembler));
+    assembler->assemblies = NULL;
+    assembler->maxMessage = maxMessage;
+    assembler->assembled = NULL;
+    return assembler;
+}
+
+char* assemble_message(Assembler* assembler, char* message) {
+    int isPart = !strncmp(message, "MSGPART:", strlen("MSGPART:"));
+    if (!isPart && strncmp(message, "MSG:", strlen("MSG:"))) {
+        return message;
+    }
+    char* name = message + (isPart ? strlen("MSGPART:") : strlen("MSG:"));
+    char* piece = strchr(name, ':');
+    if (piece == NULL) {
+        return message;
+    }
+    size_t nameLength = piece - name;
+    piece++;
+
+    Assembly** link = &assembler->assemblies;
+    while (*link != NULL && (strlen((*link)->name) != nameLength ||
+            strncmp((*link)->name, name, nameLength))) {
+        link = &(*link)->next;
+    }
+    Assembly* assembly = *link;
+    if (assembly == NULL && !isPart) {
+        return message;
+    } else if (assembly == NULL) {
+        assembly = malloc(sizeof(Assembly));
+        assembly->name = strndup(name, nameLength);
+        assembly->text = strdup("");
+        assembly->length = 0;
+        assembly->next = NULL;
+        *link = assembly;
+    }
+
+    size_t pieceLength = strlen(piece);
+    if (pieceLength > assembler->maxMessage - assembly->length) {
+        pieceLength = assembler->maxMessage - assembly->length;
+    }
+    assembly->text = realloc(assembly->text,
+            assembly->length + pieceLength + 1);
+    memcpy(assembly->text + assembly->length, piece, pieceLength);
+    assembly->length += pieceLength;
+    assembly->text[assembly->length] = '\0';
+    if (isPart) {
+        return NULL;
+    }
+
+    // The message is whole, so hand it over in place of its last piece
+    *link = assembly->next;
+    free(assembler->assembled);
+    assembler->assembled = malloc(strlen("MSG::") + nameLength +
+            assembly->length + 1);
+    sprintf(assembler->assembled, "MSG:%s:%s", assembly->name, assembly->text);
+    free(assembly->name);
+    free(assembly->text);
+    free(assembly);
+    return assembler->assembled;
+}
+
+void forget_assemblies(Assembler* assembler) {
+    while (assembler->assemblies != NULL) {
+        Assembly* assembly = assembler->assemblies;
+        assembler->assemblies = assembly->next;
+        free(assembly->name);
+        free(assembly->text);
+        free(assembly);
+    }
+}
+
+char* read_user_line(FILE* input, size_t maxMessage) {
+    char chunk[MAX_BUF];
+    char* line = NULL;
+    size_t length = 0;
+    while (fgets(chunk, MAX_BUF, input)) {
+        size_t chunkLength = strlen(chunk);
+        int isEnd = chunkLength > 0 && chunk[chunkLength - 1] == '\n';
+        chunkLength -= isEnd;
+        if (chunkLength > maxMessage - length) {
+            chunkLength = maxMessage - length;
+        }
+        line = realloc(line, length + chunkLength + strlen("SAY:\n") + 1);
+        memcpy(line + length, chunk, chunkLength);
+        length += chunkLength;
+        if (isEnd) {
+            break;
+        }
+    }
+
+    if (line != NULL) {
+        strcpy(line + length, "\n");
+    }
+    return line;
+}
+
+/* Sends a line of user input to the server. A chat message which a server
+ * that did not agree to CAPS:CHUNKED could not echo in a single frame is cut
+ * into several chat messages which it can.
+ */
+static void send_chat_message(Client* client, char* message) {
+    size_t nameLength = strlen(client->name) < MAX_NAME ?
+            strlen(client->name) : MAX_NAME;
+    size_t pieceSize = MAX_FRAME - strlen("MSG::") - nameLength;
+    char* text = message + strlen("SAY:");
+    if ((client->capabilities & CAP_CHUNKED) ||
+            strncmp(message, "SAY:", strlen("SAY:")) ||
+            strlen(text) <= pieceSize) {
+        send_message(client, message);
+        return;
+    }
+
+    char piece[MAX_FRAME + 1];
+    size_t length = strlen(text);
+    for (size_t offset = 0; offset < length; offset += pieceSize) {
+        sprintf(piece, "SAY:%.*s", (int) pieceSize, text + offset);
+        send_message(client, piece);
+    }
+}
+
+void send_user_message(Client* client, char* message) {
+    Reconnect* reconnect = client->reconnect;
+    if (reconnect == NULL) {
+        send_chat_message(client, message);
+        return;
+    }
+
+    take_lock(reconnect->backlogAccess);
+    if (reconnect->isConnected) {
+        send_chat_message(client, message);
+    } else if (reconnect->backlogLength < reconnect->backlogLimit) {
+        BacklogMessage* backlogged = malloc(sizeof(BacklogMessage));
+        backlogged->text = strcpy(malloc(strlen(message) + 1), message);
+        backlogged->next = NULL;
+        if (reconnect->backlogTail == NULL) {
+            reconnect->backlogHead = backlogged;
+        } else {
+            reconnect->backlogTail->next = backlogged;
+        }
+        reconnect->backlogTail = backlogged;
+        reconnect->backlogLength++;
+    } else {
+        fprintf(stderr, "(not connected, message dropped)\n");
+    }
+    release_lock(reconnect->backlogAccess);
+}
+
+void drop_connection(Client* client) {
+    Reconnect* reconnect = client->reconnect;
+    shutdown(client->socket, SHUT_RDWR);
+    take_lock(reconnect->backlogAccess);
+    reconnect->isConnected = 0;
+    release_lock(reconnect->backlogAccess);
+}
+
+void wait_to_reconnect(Reconnect* reconnect, int attempt) {
+    long long window = RECONNECT_BASE_MS;
+    while (attempt-- > 0 && window < RECONNECT_MAX_MS) {
+        window *= 2;
+    }
+    if (window > RECONNECT_MAX_MS) {
+        window = RECONNECT_MAX_MS;
+    }
+    long long delay = rand_r(&reconnect->seed) % (window + 1);
+    usleep((useconds_t) (delay * 1000));
+}
+
+void send_backlog(Client* client) {
+    Reconnect* reconnect = client->reconnect;
+    take_lock(reconnect->backlogAccess);
+    while (reconnect->backlogHead != NULL) {
+        BacklogMessage* backlogged = reconnect->backlogHead;
+        reconnect->backlogHead = backlogged->next;
+        send_chat_message(client, backlogged->text);
+        free(backlogged->text);
+        free(backlogged);
+    }
+    reconnect->backlogTail = NULL;
+    reconnect->backlogLength = 0;
+    reconnect->isConnected = 1;
+    release_lock(reconnect->backlogAccess);
+}
+
+int track_session(Reconnect* reconnect, char* message) {
+    if (!strncmp(message, "SESSION:", strlen("SESSION:"))) {
+        reconnect->sessionToken = strtoull(message + strlen("SESSION:"), 
+                NULL, 16);
+        return 0;
+    }
+
+    if (!strncmp(message, "SEQ:", strlen("SEQ:"))) {
+        char* end;
+        unsigned long long sequence = strtoull(message + strlen("SEQ:"),
+                &end, 10);
+        if (*end == ':') {
+            reconnect->lastSequence = sequence;
+            memmove(message, end + 1, strlen(end + 1) + 1);
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,382 @@
+#ifndef CLIENTUTIL_H
+#define CLIENTUTIL_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#define REPLAY_POLL_US 10000
+#define REPLAY_DRAIN_US 5000000
+#define RECONNECT_BASE_MS 250
+#define RECONNECT_MAX_MS 30000
+#define DEFAULT_BACKLOG 256
+#define OUTPUT_BUFFER_SIZE 65536
+#define OUTPUT_DEADLINE_US 50000
+
+/* The PendingMessage datastructure records a chat message which has been sent
+ * by a replaying client, but which has not yet been echoed back to it by the
+ * server.
+ *
+ * text: The sanitised text of the message, exactly as the server will echo it
+ *  back in its MSG command.
+ *
+ * sentAt: The monotonic time (in microseconds) at which the message was sent.
+ *
+ * next: A pointer to the next (more recently sent) pending message.
+ */
+typedef struct PendingMessage {
+    char* text;
+    long long sentAt;
+    struct PendingMessage* next;
+} PendingMessage;
+
+/* The Replay datastructure holds the state of a scripted replay session on the
+ * clientside. A replay script is made up of timed lines, each of the form
+ * "<delay in ms> <input>", where the input is handled exactly as if the user
+ * had typed it on stdin. Blank lines and lines beginning with '#' are ignored.
+ *
+ * script: A stdio file pointer to the open replay script.
+ *
+ * speed: A multiplier applied to the delays in the script. A speed of 2 plays
+ *  the script back twice as fast, and a speed of 0 plays it back as fast as
+ *  possible.
+ *
+ * pendingAccess: A lock that should be used when accessing the pending
+ *  message queue or the samples, as they are shared between the replay thread
+ *  and the thread which listens to the server.
+ *
+ * pendingHead/pendingTail: The oldest and newest messages which have been sent
+ *  but not yet echoed. The server always echoes a client's messages in the
+ *  order they were sent, so echoes are matched against the head of the queue.
+ *
+ * samples: The round trip times (in microseconds) of every matched echo.
+ *
+ * numSamples/maxSamples: The number of samples stored, and the number of
+ *  samples that can be stored before the samples array must grow.
+ *
+ * sent: The number of chat messages sent from the script.
+ *
+ * lost: The number of chat messages which were never echoed (the server
+ *  echoed a later message first).
+ *
+ * lastProgress: The monotonic time (in microseconds) at which a message was
+ *  last sent or echoed, used to decide when to stop waiting for echoes.
+ */
+typedef struct Replay {
+    FILE* script;
+    double speed;
+
+    sem_t* pendingAccess;
+    PendingMessage* pendingHead;
+    PendingMessage* pendingTail;
+
+    long long* samples;
+    int numSamples;
+    int maxSamples;
+
+    int sent;
+    int lost;
+    volatile long long lastProgress;
+} Replay;
+
+/* The BacklogMessage datastructure holds a single line of user input which
+ * was entered while the client was disconnected, and which will be sent once
+ * the client has rejoined the server.
+ *
+ * text: The input, already handled by handle_user_message.
+ *
+ * next: A pointer to the next (more recently entered) message.
+ */
+typedef struct BacklogMessage {
+    char* text;
+    struct BacklogMessage* next;
+} BacklogMessage;
+
+/* The Reconnect datastructure holds the state a client needs to rejoin the
+ * server whenever its connection drops (clientside only). Rather than
+ * exiting, the client waits for a random delay of up to RECONNECT_BASE_MS,
+ * doubled after every failed attempt up to RECONNECT_MAX_MS (exponential
+ * backoff with full jitter), so that a crowd of clients dropped at the same
+ * moment spread their reconnects out rather than all arriving at once. The
+ * client then runs its handshake again, resuming its session if it can.
+ *
+ * port: The port number (or socket path) the server is listening on.
+ *
+ * compressLevel/isFastJoin/isSharedMemory: How the client joins the server,
+ *  as given on startup.
+ *
+ * backlogAccess: A lock that should be used when sending user input or
+ *  accessing the backlog, so that input is never sent on a connection which
+ *  is being replaced, and is never sent ahead of older input in the backlog.
+ *
+ * backlogHead/backlogTail: The oldest and newest messages waiting to be sent.
+ *
+ * backlogLength/backlogLimit: The number of messages waiting, and the most
+ *  which can wait. Any input entered once the backlog is full is dropped.
+ *
+ * isConnected: Cleared while the client is disconnected, and set once it has
+ *  rejoined the server and sent its backlog.
+ *
+ * sessionToken: The token of the session the server gave the client with
+ *  SESSION:<token>, or 0 if it has none (see CAP_RESUME).
+ *
+ * lastSequence: The sequence number of the last broadcast received, which is
+ *  given when resuming the session so that only missed broadcasts are sent.
+ *
+ * seed: The state of the random number generator used for the jitter.
+ */
+typedef struct Reconnect {
+    char* port;
+    int compressLevel;
+    int isFastJoin;
+    int isSharedMemory;
+
+    sem_t* backlogAccess;
+    BacklogMessage* backlogHead;
+    BacklogMessage* backlogTail;
+    int backlogLength;
+    int backlogLimit;
+    volatile int isConnected;
+
+    unsigned long long sessionToken;
+    unsigned long long lastSequence;
+    unsigned int seed;
+} Reconnect;
+
+/* The setup_replay function opens a replay script and initialises all the
+ * necessary variables used in a Replay struct datastructure.
+ *
+ * Parameters:
+ *      scriptPath - The path to the replay script given on startup
+ *      speed - The multiplier applied to the delays in the script
+ *
+ * Returns:
+ *      (Replay*) - A pointer to the newly initialised replay state
+ *      NULL - if the script could not be opened
+ */
+Replay* setup_replay(char* scriptPath, double speed);
+
+/* The replay_script function is the main routine for the thread which plays
+ * back a replay script (which is created in main instead of the thread which
+ * listens to the user). Each line of the script is delayed, handled as user
+ * input, and sent to the server, with any chat messages recorded as pending.
+ *
+ * Once the script is exhausted (or it asks to leave), the thread waits for the
+ * outstanding echoes to arrive, giving up once no progress has been made for
+ * REPLAY_DRAIN_US, before exiting the client.
+ *
+ * Parameters:
+ *      args - The main instance of the client datastructure
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* replay_script(void* args);
+
+/* The record_replay_echo function checks whether a message from the server is
+ * the echo of one of this client's own chat messages, and if so, records the
+ * round trip time of that message. Any older pending messages which were
+ * skipped over by the echo are counted as lost.
+ *
+ * Parameters:
+ *      client - The main instance of the client datastructure
+ *      message - An unparsed message received from the server
+ */
+void record_replay_echo(Client* client, char* message);
+
+/* The print_replay_summary function outputs the number of messages sent and
+ * echoed, and a summary of the round trip times measured, to stderr.
+ *
+ * Parameters:
+ *      replay - The replay state of the client
+ */
+void print_replay_summary(Replay* replay);
+
+/* The Assembly datastructure holds a chat message which is being put back
+ * together from the pieces the server streams it in (see CAP_CHUNKED).
+ *
+ * name: The name of the client which sent the message.
+ *
+ * text: The pieces of the message received so far, null terminated.
+ *
+ * length: The number of bytes in text.
+ *
+ * next: A pointer to the next message being put back together.
+ */
+typedef struct Assembly {
+    char* name;
+    char* text;
+    size_t length;
+    struct Assembly* next;
+} Assembly;
+
+/* The Assembler datastructure holds every chat message a client is part way
+ * through receiving. A message is only ever being sent by one client at a
+ * time, so there is at most one assembly for each other client in the room.
+ *
+ * assemblies: The messages being put back together, in no particular order.
+ *
+ * maxMessage: The largest chat message (in bytes) the client sends or puts
+ *  back together. Anything past it is left out, so that a sender can never
+ *  make the client hold more than this for it.
+ *
+ * assembled: The last message put back together, which is kept until the
+ *  next one is.
+ */
+typedef struct Assembler {
+    Assembly* assemblies;
+    size_t maxMessage;
+    char* assembled;
+} Assembler;
+
+/* The setup_assembler function initialises an Assembler with no messages
+ * being put back together.
+ *
+ * Parameters:
+ *      maxMessage - The largest chat message to send or put back together
+ *
+ * Returns:
+ *      (Assembler*) - A pointer to the newly initialised assembler
+ */
+Assembler* setup_assembler(size_t maxMessage);
+
+/* The assemble_message function puts the pieces of long chat messages sent
+ * by the server back together. Each MSGPART:<name>:<piece> is kept until the
+ * MSG:<name>:<piece> which ends it arrives, which is then returned as a
+ * single MSG:<name>:<text>. Any other message is returned as it is.
+ *
+ * Parameters:
+ *      assembler - The client's assembler
+ *      message - An unparsed message received from the server
+ *
+ * Returns:
+ *      (char*) - The message to handle, which is either message itself, or a
+ *          message owned by the assembler and only valid until the next call
+ *      (char*) NULL - if the message was a piece which has been kept
+ */
+char* assemble_message(Assembler* assembler, char* message);
+
+/* The forget_assemblies function throws away every message part way through
+ * being put back together, e.g. once the client has joined the server again
+ * without resuming its session, and will never be sent their rest.
+ *
+ * Parameters:
+ *      assembler - The client's assembler
+ */
+void forget_assemblies(Assembler* assembler);
+
+/* The read_user_line function reads a whole line of user input, however long
+ * it is. Anything past maxMessage bytes is read but left out.
+ *
+ * Parameters:
+ *      input - The stream to read from
+ *      maxMessage - The most bytes of the line to keep
+ *
+ * Returns:
+ *      (char*) - A newly allocated buffer holding the line and its newline,
+ *          with room left for handle_user_message to add "SAY:" to it
+ *      (char*) NULL - if there was nothing left to read
+ */
+char* read_user_line(FILE* input, size_t maxMessage);
+
+/* The setup_output function sets up how messages are shown to the user. If
+ * stdout is a terminal, then each message is shown as soon as it arrives.
+ * Otherwise (e.g. stdout is piped into another program), stdout is given an
+ * OUTPUT_BUFFER_SIZE buffer, so that many messages are written at once. It
+ * must be called before anything is written to stdout.
+ *
+ * Returns:
+ *      (int) 0 - if each message should be flushed as it is shown
+ *      (int) 1 - if messages are batched up in stdout's buffer
+ */
+int setup_output(void);
+
+/* The flush_output function decides whether messages batched up in stdout's
+ * buffer should be written now, before the next message is received. They
+ * are written once nothing more has arrived from the server, or once the
+ * oldest has waited OUTPUT_DEADLINE_US, and otherwise whenever the buffer
+ * fills.
+ *
+ * Parameters:
+ *      client - The main instance of the client datastructure
+ *      pendingSince - The monotonic time (in microseconds) at which the oldest
+ *          unwritten message was shown, or 0 if there is none. Reset to 0 if
+ *          the messages are written.
+ */
+void flush_output(Client* client, long long* pendingSince);
+
+/* The setup_reconnect function initialises all the necessary variables used in
+ * a Reconnect struct datastructure, for a client which is connected.
+ *
+ * Parameters:
+ *      port - The port number (or socket path) the server is listening on
+ *      compressLevel - The zlib compression level to ask for, or 0
+ *      isFastJoin - Whether the client joins with fast_join_client
+ *      isSharedMemory - Whether the client offers shared memory rings
+ *      backlogLimit - The most lines of input to keep while disconnected
+ *
+ * Returns:
+ *      (Reconnect*) - A pointer to the newly initialised reconnect state
+ */
+Reconnect* setup_reconnect(char* port, int compressLevel, int isFastJoin,
+        int isSharedMemory, int backlogLimit);
+
+/* The send_user_message function sends a line of user input (already handled
+ * by handle_user_message) to the server. If the client is reconnecting and
+ * is currently disconnected, then the line is added to the backlog instead,
+ * or dropped with a warning on stderr if the backlog is full. A chat message
+ * too long for a server which did not agree to CAPS:CHUNKED to echo in a
+ * single line is sent as several chat messages.
+ *
+ * Parameters:
+ *      client - The main instance of the client datastructure
+ *      message - The line to send
+ */
+void send_user_message(Client* client, char* message);
+
+/* The drop_connection function marks a reconnecting client as disconnected,
+ * so that user input is kept in the backlog from then on. The socket is shut
+ * down first, so that a thread blocked sending to a server which has stopped
+ * reading gives up, rather than holding up the reconnect.
+ *
+ * Parameters:
+ *      client - A reconnecting client whose connection has dropped
+ */
+void drop_connection(Client* client);
+
+/* The wait_to_reconnect function sleeps for a random delay between 0 and
+ * RECONNECT_BASE_MS * 2^attempt milliseconds, capped at RECONNECT_MAX_MS.
+ *
+ * Parameters:
+ *      reconnect - The reconnect state of the client
+ *      attempt - The number of attempts which have failed since the
+ *          connection dropped
+ */
+void wait_to_reconnect(Reconnect* reconnect, int attempt);
+
+/* The send_backlog function sends every line of input kept while a client
+ * was disconnected, in the order it was entered, once the client has
+ * rejoined the server, and marks the client as connected again.
+ *
+ * Parameters:
+ *      client - A reconnecting client which has just rejoined the server
+ */
+void send_backlog(Client* client);
+
+/* The track_session function follows the session of a reconnecting client in
+ * the messages the server sends it. SESSION:<token> is taken as the client's
+ * new session token, and SEQ:<sequence>:<message> updates the last sequence
+ * number seen, and is stripped down to the message in place.
+ *
+ * Parameters:
+ *      reconnect - The reconnect state of the client
+ *      message - An unparsed message received from the server
+ *
+ * Returns:
+ *      (int) 0 - if the message was only meant for the client, and should
+ *          not be shown to the user
+ *      (int) 1 - if the message should be handled as normal
+ */
+int track_session(Reconnect* reconnect, char* message);
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "sharedutil.h"
+#include "dispatch.h"
+
+Dispatch* create_dispatch(Server* server, int numWorkers) {
+    Dispatch* dispatch = malloc(sizeof(Dispatch));
+    dispatch->workers = calloc(numWorkers, sizeof(Worker));
+    dispatch->numWorkers = numWorkers;
+    dispatch->outstanding = 0;
+
+    for (int i = 0; i < numWorkers; i++) {
+        Worker* worker = &dispatch->workers[i];
+        CommandQueue* queue = &worker->queue;
+        worker->server = server;
+        queue->stub.next = NULL;
+        queue->head = &queue->stub;
+        queue->tail = &queue->stub;
+        sem_init(&queue->ready, 0, 0);
+
+        pthread_create(&worker->thread, 0, run_dispatch_worker, worker);
+        pthread_detach(worker->thread);
+    }
+    return dispatch;
+}
+
+/* Pushes a command onto a queue. Swapping the head is the only step which
+ * other client threads can see, so any number of them may push at once.
+ */
+static void push_command(CommandQueue* queue, Command* command) {
+    command->next = NULL;
+    Command* previous = __atomic_exchange_n(&queue->head, command,
+            __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->next, command, __ATOMIC_RELEASE);
+}
+
+/* Pops the oldest command from a queue, which must only be done by its
+ * worker. This returns NULL if the queue is empty, or if the oldest command
+ * is still part way through being pushed.
+ */
+static Command* pop_command(CommandQueue* queue) {
+    Command* tail = queue->tail;
+    Command* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // The tail is the last command, so put the stub back behind it before
+    // taking it, unless another command is being pushed behind it already
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    push_command(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+void dispatch_command(Server* server, Client* client, int command,
+        char* argument, int isCut) {
+    Dispatch* dispatch = server->dispatch;
+    Command* newCommand = malloc(sizeof(Command));
+    newCommand->client = client;
+    newCommand->command = command;
+    newCommand->argument = argument != NULL ? strdup(argument) : NULL;
+    newCommand->isCut = isCut;
+#ifdef TRACE
+    newCommand->span = command == SAY ? trace_begin() : NULL;
+#endif
+
+    // Always pick the same worker for a client, so its commands stay in order
+    Worker* worker = &dispatch->workers[
+            ((uintptr_t) client / sizeof(Client)) % dispatch->numWorkers];
+    __atomic_add_fetch(&client->pendingCommands, 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&dispatch->outstanding, 1, __ATOMIC_ACQ_REL);
+    push_command(&worker->queue, newCommand);
+    sem_post(&worker->queue.ready);
+}
+
+void drain_client_commands(Client* client) {
+    while (__atomic_load_n(&client->pendingCommands, __ATOMIC_ACQUIRE) > 0) {
+        usleep(DISPATCH_DRAIN_US);
+    }
+}
+
+int is_dispatch_idle(Server* server) {
+    return __atomic_load_n(&server->dispatch->outstanding,
+            __ATOMIC_ACQUIRE) == 0;
+}
+
+void* run_dispatch_worker(void* args) {
+    Worker* worker = (Worker*) args;
+    Server* server = worker->server;
+    CommandQueue* queue = &worker->queue;
+
+    while (1) {
+        take_lock(&queue->ready);
+
+        // A command is ready, but the push ahead of it may not have quite
+        // finished linking, which only takes a moment
+        Command* command;
+        while ((command = pop_command(queue)) == NULL) {
+            sched_yield();
+        }
+
+        Client* client = command->client;
+#ifdef TRACE
+        trace_dispatched(command->span);
+#endif
+        execute_client_command(server, client, command->command,
+                command->argument, command->isCut);
+#ifdef TRACE
+        trace_enqueued(command->span);
+#endif
+        free(command->argument);
+        free(command);
+        __atomic_sub_fetch(&client->pendingCommands, 1, __ATOMIC_ACQ_REL);
+        __atomic_sub_fetch(&server->dispatch->outstanding, 1,
+                __ATOMIC_ACQ_REL);
+    }
+    return NULL;
+}
@@ -0,0 +1,153 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+#include "trace.h"
+#define DISPATCH_DRAIN_US 1000
+
+/* The Command datastructure holds a single command which a client's thread
+ * has read and parsed, waiting to be run by a worker.
+ *
+ * client: The client which sent the command.
+ *
+ * command: The hash of the command (see HashedCommands in sharedutil.h).
+ *
+ * argument: The command's argument, or NULL.
+ *
+ * isCut: Whether the argument is only the start of a line which was too long
+ *  to read at once, whose rest follows in the client's next command.
+ *
+ * span: The command's latency trace, or NULL if it is not sampled (only when
+ *  built with TRACE).
+ *
+ * next: A pointer to the next command in the worker's queue.
+ */
+typedef struct Command {
+    Client* client;
+    int command;
+    char* argument;
+    int isCut;
+#ifdef TRACE
+    TraceSpan* span;
+#endif
+    struct Command* volatile next;
+} Command;
+
+/* The CommandQueue datastructure is a lock-free queue of commands, which any
+ * number of client threads push onto and a single worker pops from. Pushing
+ * is a single atomic exchange, so a client thread never waits for a worker or
+ * for another client thread.
+ *
+ * head: The command most recently pushed. Client threads swap themselves in
+ *  here.
+ *
+ * tail: The next command to pop, which only the worker touches.
+ *
+ * stub: A placeholder which keeps the queue from ever being truly empty, so
+ *  that pushing never has to look at tail.
+ *
+ * ready: Posted once for every command pushed, so an idle worker can sleep.
+ */
+typedef struct CommandQueue {
+    Command* volatile head;
+    Command* tail;
+    Command stub;
+    sem_t ready;
+} CommandQueue;
+
+/* The Worker datastructure holds a single thread of the dispatch pool.
+ *
+ * server: The server whose commands the worker runs.
+ *
+ * queue: The commands waiting for this worker.
+ *
+ * thread: The worker's thread.
+ */
+typedef struct Worker {
+    Server* server;
+    CommandQueue queue;
+    pthread_t thread;
+} Worker;
+
+/* The Dispatch datastructure holds the pool of workers which run client
+ * commands, so that a client's thread can go straight back to reading while
+ * its last command is still being broadcast. Every command a client sends is
+ * run by the same worker, in the order it was sent.
+ *
+ * workers: The workers in the pool.
+ *
+ * numWorkers: The number of workers in the pool.
+ *
+ * outstanding: The number of commands which have been pushed but not yet
+ *  run, across every worker.
+ */
+typedef struct Dispatch {
+    Worker* workers;
+    int numWorkers;
+    volatile int outstanding;
+} Dispatch;
+
+/* The create_dispatch function initialises a pool of workers, and starts each
+ * of their threads.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      numWorkers - The number of workers to start
+ *
+ * Returns:
+ *      (Dispatch*) - The newly started pool
+ */
+Dispatch* create_dispatch(Server* server, int numWorkers);
+
+/* The dispatch_command function hands a parsed command to the worker which
+ * runs every command from its client. It never blocks.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - The client which sent the command
+ *      command - The hash of the command
+ *      argument - The command's argument, which is copied, or NULL
+ *      isCut - Whether the argument carries on in the client's next command
+ */
+void dispatch_command(Server* server, Client* client, int command,
+        char* argument, int isCut);
+
+/* The drain_client_commands function waits until every command a client has
+ * sent has been run. A client's thread must call this before the client is
+ * removed from the server, so that no worker is left holding it, and so that
+ * its last messages reach the room before it leaves.
+ *
+ * Parameters:
+ *      client - The client whose commands are waited for
+ */
+void drain_client_commands(Client* client);
+
+/* The is_dispatch_idle function checks whether every command which has been
+ * dispatched has been run.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *
+ * Returns:
+ *      (int) 1 - if no commands are waiting or running
+ *      (int) 0 - otherwise
+ */
+int is_dispatch_idle(Server* server);
+
+/* The run_dispatch_worker function is the main routine for the threads of the
+ * dispatch pool. It sleeps until a command is pushed onto its queue, and then
+ * runs it with execute_client_command.
+ *
+ * Parameters:
+ *      args - The worker
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* run_dispatch_worker(void* args);
+#endif
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "sharedutil.h"
+#include "outqueue.h"
+#include "clienttable.h"
+#include "fanout.h"
+
+FanOut* create_fan_out(int numHelpers) {
+    FanOut* fanOut = malloc(sizeof(FanOut));
+    fanOut->numHelpers = numHelpers;
+    fanOut->helpers = malloc(sizeof(pthread_t) * (numHelpers + 1));
+    fanOut->start = malloc(sizeof(sem_t));
+    sem_init(fanOut->start, 0, 0);
+    fanOut->finished = malloc(sizeof(sem_t));
+    sem_init(fanOut->finished, 0, 0);
+    fanOut->renditions = NULL;
+    fanOut->queues = NULL;
+    fanOut->ranges = calloc(numHelpers + 1, sizeof(FanOutRange));
+    for (int i = 0; i <= numHelpers; i++) {
+        fanOut->ranges[i].rangeAccess = create_lock(malloc(sizeof(sem_t)));
+    }
+
+    fanOut->nextHelper = 1;
+    for (int i = 0; i < numHelpers; i++) {
+        pthread_create(&fanOut->helpers[i], 0, help_fan_out, fanOut);
+        pthread_detach(fanOut->helpers[i]);
+    }
+    return fanOut;
+}
+
+int rendition_for(OutQueue* queue) {
+    return (queue->isSequenced ? RENDER_SEQUENCED : RENDER_PLAIN) |
+            (queue->isChunked ? 0 : RENDER_UNCHUNKED) |
+            (queue->isBatched ? 0 : RENDER_UNBATCHED);
+}
+
+/* Queues the copy of a broadcast meant for the client in a slot, passing over
+ * free slots and evicted clients. A client whose queue turns out to have been
+ * evicted since it was last sent anything is marked as such in its slot.
+ */
+static void queue_for_slot(OutQueue** queues, unsigned char* flags, int slot,
+        char** renditions) {
+    if (flags[slot] & SLOT_EVICTED) {
+        return;
+    }
+    OutQueue* queue = queues[slot];
+    if (!enqueue_message(queue, renditions[flags[slot] & SLOT_RENDITION]) &&
+            queue->isEvicted) {
+        flags[slot] |= SLOT_EVICTED;
+    }
+}
+
+/* Takes the next chunk of a participant's own range, returning the number of
+ * slots taken and setting first to the first of them.
+ */
+static int take_chunk(FanOutRange* range, int* first) {
+    take_lock(range->rangeAccess);
+    int size = range->end - range->next;
+    if (size > FANOUT_CHUNK) {
+        size = FANOUT_CHUNK;
+    }
+    *first = range->next;
+    range->next += size;
+    release_lock(range->rangeAccess);
+    return size;
+}
+
+/* Moves the back half of the fullest other range into a participant's own
+ * range, returning 0 if there is nothing left anywhere to steal.
+ */
+static int steal_range(FanOut* fanOut, int participant) {
+    while (1) {
+        int victim = -1;
+        int mostLeft = 0;
+        for (int i = 0; i <= fanOut->numHelpers; i++) {
+            FanOutRange* range = &fanOut->ranges[i];
+            int left = range->end - range->next;
+            if (i != participant && left > mostLeft) {
+                victim = i;
+                mostLeft = left;
+            }
+        }
+        if (victim < 0) {
+            return 0;
+        }
+
+        // The victim may have moved on since it was looked at, so only take
+        // what it still has
+        FanOutRange* range = &fanOut->ranges[victim];
+        take_lock(range->rangeAccess);
+        int left = range->end - range->next;
+        int middle = range->next + (left + 1) / 2;
+        int end = range->end;
+        if (left > 0) {
+            range->end = middle;
+        }
+        release_lock(range->rangeAccess);
+
+        if (left > 0) {
+            FanOutRange* own = &fanOut->ranges[participant];
+            take_lock(own->rangeAccess);
+            own->next = middle;
+            own->end = end;
+            release_lock(own->rangeAccess);
+            return 1;
+        }
+    }
+}
+
+/* Queues the message on each slot's queue until there are no slots left to
+ * take or steal.
+ */
+static void fan_out_chunks(FanOut* fanOut, int participant) {
+    FanOutRange* own = &fanOut->ranges[participant];
+    while (1) {
+        int first;
+        int size = take_chunk(own, &first);
+        if (size == 0) {
+            if (!steal_range(fanOut, participant)) {
+                return;
+            }
+            continue;
+        }
+        for (int i = first; i < first + size; i++) {
+            queue_for_slot(fanOut->queues, fanOut->flags, i,
+                    fanOut->renditions);
+        }
+    }
+}
+
+void fan_out_message(Server* server, char** renditions) {
+    FanOut* fanOut = server->fanOut;
+    ClientTable* table = server->clientTable;
+
+    // Small rooms, or servers without helpers, are quicker to queue for than
+    // to hand out
+    if (fanOut == NULL || fanOut->numHelpers == 0 ||
+            table->numClients < FANOUT_THRESHOLD) {
+        for (int i = 0; i < table->numSlots; i++) {
+            queue_for_slot(table->queues, table->flags, i, renditions);
+        }
+        return;
+    }
+
+    // Split the slots evenly, and wait for everyone to finish before
+    // returning so that the next broadcast cannot overtake this one
+    int numParticipants = fanOut->numHelpers + 1;
+    for (int i = 0; i < numParticipants; i++) {
+        fanOut->ranges[i].next =
+                (long long) table->numSlots * i / numParticipants;
+        fanOut->ranges[i].end =
+                (long long) table->numSlots * (i + 1) / numParticipants;
+    }
+    fanOut->renditions = renditions;
+    fanOut->queues = table->queues;
+    fanOut->flags = table->flags;
+#ifdef TRACE
+    fanOut->span = trace_current();
+#endif
+    for (int i = 0; i < fanOut->numHelpers; i++) {
+        sem_post(fanOut->start);
+    }
+    fan_out_chunks(fanOut, 0);
+    for (int i = 0; i < fanOut->numHelpers; i++) {
+        take_lock(fanOut->finished);
+    }
+}
+
+void* help_fan_out(void* args) {
+    FanOut* fanOut = (FanOut*) args;
+    int participant = __atomic_fetch_add(&fanOut->nextHelper, 1,
+            __ATOMIC_ACQ_REL);
+
+    while (1) {
+        take_lock(fanOut->start);
+#ifdef TRACE
+        trace_adopt(fanOut->span);
+#endif
+        fan_out_chunks(fanOut, participant);
+#ifdef TRACE
+        trace_adopt(NULL);
+#endif
+        sem_post(fanOut->finished);
+    }
+    return NULL;
+}
@@ -0,0 +1,142 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+#include "trace.h"
+#define FANOUT_THRESHOLD 512
+#define FANOUT_CHUNK 64
+
+/* The Renditions enum indexes the copies of a broadcast made for different
+ * kinds of recipient, where each kind of difference is a flag which is set
+ * in the index. Clients holding a resumable session are sent a copy prefixed
+ * with its sequence number (see session.h), clients which did not ask for
+ * CAPS:CHUNKED are sent every piece of a long chat message as a message of
+ * its own, and clients which did not ask for CAPS:PRESENCE are sent a line
+ * for every event in a batch of ENTER or LEAVE events (see presence.h).
+ */
+enum Renditions {
+    RENDER_PLAIN = 0, RENDER_SEQUENCED = 1, RENDER_UNCHUNKED = 2,
+    RENDER_UNBATCHED = 4, NUM_RENDITIONS = 8
+};
+
+/* The FanOutRange datastructure holds the slots of the server's client table
+ * which one participant in a fan-out has still to queue a message for.
+ *
+ * rangeAccess: A lock that should be used when accessing next or end. It is
+ *  only taken once per chunk, or when another participant steals.
+ *
+ * next: The next slot to queue the message for.
+ *
+ * end: The slot after the last one in the range.
+ */
+typedef struct FanOutRange {
+    sem_t* rangeAccess;
+    volatile int next;
+    volatile int end;
+} FanOutRange;
+
+/* The FanOut datastructure holds the pool of threads which help to queue a
+ * broadcast for every member of a large room. The slots of the client table
+ * are split evenly between the broadcasting thread and the helpers, each of
+ * which works through its own range a chunk at a time. A participant which
+ * runs out steals the back half of whichever range has the most left, so that
+ * everyone finishes together even if some recipients are slower to queue for
+ * than others.
+ *
+ * numHelpers: The number of helper threads, which may be 0.
+ *
+ * helpers: The helper threads.
+ *
+ * start: Posted once for each helper when a broadcast is ready to fan out.
+ *
+ * finished: Posted by each helper once there is nothing left to steal.
+ *
+ * renditions: The copies of the message being broadcast, indexed by the
+ *  Renditions enum.
+ *
+ * queues: The outbound queues of the client table's slots, which the message
+ *  is being queued on.
+ *
+ * flags: The flags of the client table's slots, which say which copy each
+ *  client is sent, and which clients to pass over.
+ *
+ * ranges: The range of slots left to each participant, where the
+ *  broadcasting thread is participant 0.
+ *
+ * nextHelper: The participant number given to the next helper to start up.
+ *
+ * span: The latency trace of the message being broadcast, which the helpers
+ *  attach their copies to (only when built with TRACE).
+ */
+typedef struct FanOut {
+    int numHelpers;
+    pthread_t* helpers;
+    sem_t* start;
+    sem_t* finished;
+    char** renditions;
+    struct OutQueue** queues;
+    unsigned char* flags;
+    FanOutRange* ranges;
+    volatile int nextHelper;
+#ifdef TRACE
+    TraceSpan* span;
+#endif
+} FanOut;
+
+/* The create_fan_out function initialises a fan-out pool, and starts each of
+ * its helper threads.
+ *
+ * Parameters:
+ *      numHelpers - The number of helper threads to start
+ *
+ * Returns:
+ *      (FanOut*) - The newly started pool
+ */
+FanOut* create_fan_out(int numHelpers);
+
+/* The fan_out_message function queues a message for every client in the
+ * server's client table, by walking its arrays of slot flags and outbound
+ * queues. Each client is given the rendition of the message made for it,
+ * which its slot's flags hold (see clienttable.h), so a client's queue is
+ * only read to queue the message. Evicted clients are passed over. Rooms
+ * with fewer than FANOUT_THRESHOLD members, and servers without helpers,
+ * queue it on the calling thread alone. Otherwise the work is spread across
+ * the pool, and this returns once the message has been queued for everyone,
+ * so every client still receives broadcasts in the order they were made. The
+ * caller must hold clientAccess.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      renditions - The copies of the message, indexed by the Renditions
+ *          enum, where a sequenced copy is NULL if no client holds a session
+ */
+void fan_out_message(Server* server, char** renditions);
+
+/* The rendition_for function picks which copy of a broadcast a client should
+ * be sent, from how its outbound queue has been set up.
+ *
+ * Parameters:
+ *      queue - The client's outbound queue
+ *
+ * Returns:
+ *      (int) - An index into the Renditions enum
+ */
+int rendition_for(struct OutQueue* queue);
+
+/* The help_fan_out function is the main routine for the helper threads of a
+ * fan-out pool. It waits for a broadcast to start, and then queues it for as
+ * many recipients as it can, first from its own range and then by stealing.
+ *
+ * Parameters:
+ *      args - The fan-out pool
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* help_fan_out(void* args);
+#endif
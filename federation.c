@@ -0,0 +1,694 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "serverutil.h"
+#include "sharedutil.h"
+#include "outqueue.h"
+#include "federation.h"
+
+/* Opens a socket for a peer address, which is either a Unix domain socket
+ * path (containing a '/') or a port on the loopback interface. The socket is
+ * either listening on the address or connected to it. Returns -1 on failure.
+ */
+static int open_peer_socket(char* address, int isListening) {
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un unixAddress;
+        memset(&unixAddress, 0, sizeof(struct sockaddr_un));
+        unixAddress.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(unixAddress.sun_path)) {
+            return -1;
+        }
+        strcpy(unixAddress.sun_path, address);
+
+        int peerSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (isListening) {
+            // Replace any stale path left by a previous server
+            unlink(address);
+            if (peerSocket >= 0 && !bind(peerSocket,
+                    (struct sockaddr*) &unixAddress,
+                    sizeof(struct sockaddr_un)) && !listen(peerSocket, INF)) {
+                return peerSocket;
+            }
+        } else if (peerSocket >= 0 && !connect(peerSocket,
+                (struct sockaddr*) &unixAddress, sizeof(struct sockaddr_un))) {
+            return peerSocket;
+        }
+        if (peerSocket >= 0) {
+            close(peerSocket);
+        }
+        return -1;
+    }
+
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo("localhost", address, &hints, &ai)) {
+        return -1;
+    }
+
+    int peerSocket = socket(AF_INET, SOCK_STREAM, 0);
+    int isOpen = 0;
+    if (peerSocket >= 0 && isListening) {
+        int reuse = 1;
+        setsockopt(peerSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
+        isOpen = !bind(peerSocket, ai->ai_addr, ai->ai_addrlen) &&
+                !listen(peerSocket, INF);
+    } else if (peerSocket >= 0) {
+        isOpen = !connect(peerSocket, ai->ai_addr, ai->ai_addrlen);
+    }
+    freeaddrinfo(ai);
+
+    if (!isOpen && peerSocket >= 0) {
+        close(peerSocket);
+        return -1;
+    }
+    return peerSocket;
+}
+
+int initialise_federation(Server* server) {
+    ServerOptions* options = server->options;
+    if (options->federationAddress == NULL && options->numPeers == 0) {
+        return 1;
+    }
+
+    // The id only needs to be unique among the linked processes
+    Federation* federation = malloc(sizeof(Federation));
+    federation->id = (long long) getpid() * 1000000 +
+            current_time_us() % 1000000;
+    federation->nextSeq = 0;
+    federation->topologySeq = 0;
+    federation->listener = -1;
+    federation->federationAccess = create_lock(malloc(sizeof(sem_t)));
+    federation->links = NULL;
+    federation->members = NULL;
+    federation->seen = NULL;
+    federation->topology = NULL;
+    federation->relayedIn = 0;
+    federation->relayedOut = 0;
+    federation->duplicates = 0;
+
+    if (options->federationAddress != NULL) {
+        federation->listener = open_peer_socket(options->federationAddress, 1);
+        if (federation->listener < 0) {
+            return 0;
+        }
+    }
+    server->federation = federation;
+
+    pthread_t tid;
+    if (federation->listener >= 0) {
+        pthread_create(&tid, 0, accept_peer_links, server);
+        pthread_detach(tid);
+    }
+    for (int i = 0; i < options->numPeers; i++) {
+        PeerLink* link = malloc(sizeof(PeerLink));
+        link->server = server;
+        link->address = options->peerAddresses[i];
+        link->socket = -1;
+        pthread_create(&tid, 0, maintain_peer_link, link);
+        pthread_detach(tid);
+    }
+    return 1;
+}
+
+void* accept_peer_links(void* args) {
+    Server* server = (Server*) args;
+
+    int peerSocket;
+    while ((peerSocket = accept(server->federation->listener, 0, 0)) >= 0 ||
+            errno == EINTR) {
+        if (peerSocket >= 0) {
+            PeerLink* link = malloc(sizeof(PeerLink));
+            link->server = server;
+            link->address = NULL;
+            link->socket = peerSocket;
+
+            pthread_t tid;
+            pthread_create(&tid, 0, maintain_peer_link, link);
+            pthread_detach(tid);
+        }
+    }
+    return NULL;
+}
+
+void* maintain_peer_link(void* args) {
+    PeerLink* link = (PeerLink*) args;
+
+    // Links which were accepted are reconnected by the other end
+    if (link->address == NULL) {
+        serve_peer_link(link->server, link->socket);
+        free(link);
+        return NULL;
+    }
+
+    while (1) {
+        int peerSocket = open_peer_socket(link->address, 0);
+        if (peerSocket >= 0) {
+            serve_peer_link(link->server, peerSocket);
+        }
+        usleep(PEER_RETRY_US);
+    }
+    return NULL;
+}
+
+/* Sends a line to a peer link, evicting the peer instead if it has fallen
+ * more than PEER_QUEUE_LIMIT bytes behind.
+ */
+static void send_to_link(Client* link, char* line) {
+    if (link->outQueue->queuedBytes + strlen(line) > PEER_QUEUE_LIMIT) {
+        evict_client(link, "SLOW");
+        return;
+    }
+    queue_control_message(link, line);
+}
+
+/* Sends a line to every peer link except the one given (which may be NULL).
+ * The federation lock must be held by the caller.
+ */
+static void send_to_links(Federation* federation, Client* except,
+        char* line) {
+    for (Client* link = federation->links; link != NULL; link = link->next) {
+        if (link != except) {
+            send_to_link(link, line);
+        }
+    }
+}
+
+/* Adds a remote member to the federation's member list in alphabetical order,
+ * returning 0 if the member was already known. The federation lock must be
+ * held by the caller.
+ */
+static int add_remote_member(Federation* federation, char* name,
+        long long origin) {
+    RemoteMember** position = &federation->members;
+    while (*position != NULL && strcasecmp(name, (*position)->name) > 0) {
+        position = &(*position)->next;
+    }
+    for (RemoteMember* member = *position; member != NULL &&
+            !strcasecmp(name, member->name); member = member->next) {
+        if (!strcmp(name, member->name) && member->origin == origin) {
+            return 0;
+        }
+    }
+
+    RemoteMember* member = malloc(sizeof(RemoteMember));
+    member->name = strcpy(malloc(strlen(name) + 1), name);
+    member->origin = origin;
+    member->next = *position;
+    *position = member;
+    return 1;
+}
+
+/* Removes a remote member from the federation's member list, returning 0 if
+ * the member was not known. The federation lock must be held by the caller.
+ */
+static int remove_remote_member(Federation* federation, char* name,
+        long long origin) {
+    for (RemoteMember** position = &federation->members; *position != NULL;
+            position = &(*position)->next) {
+        RemoteMember* member = *position;
+        if (!strcmp(name, member->name) && member->origin == origin) {
+            *position = member->next;
+            free(member->name);
+            free(member);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Records an event from an origin server, returning 0 if it has already been
+ * seen. The federation lock must be held by the caller.
+ */
+static int is_new_event(Federation* federation, long long origin,
+        long long seq) {
+    OriginSequence* seen = federation->seen;
+    while (seen != NULL && seen->origin != origin) {
+        seen = seen->next;
+    }
+    if (seen == NULL) {
+        seen = malloc(sizeof(OriginSequence));
+        seen->origin = origin;
+        seen->lastSeq = 0;
+        seen->next = federation->seen;
+        federation->seen = seen;
+    }
+    if (seq <= seen->lastSeq) {
+        return 0;
+    }
+    seen->lastSeq = seq;
+    return 1;
+}
+
+/* Handles a room event relayed by a peer. The first time an event is seen,
+ * remote membership is updated, the event is broadcast to the local clients,
+ * and it is passed on to every other peer. Events which have already been
+ * seen (having reached this server over more than one path) are discarded.
+ */
+static void relay_event(Server* server, Client* link, long long origin,
+        long long seq, char* line) {
+    Federation* federation = server->federation;
+    take_lock(server->clientAccess);
+    take_lock(federation->federationAccess);
+
+    if (origin == federation->id || !is_new_event(federation, origin, seq)) {
+        federation->duplicates++;
+        release_lock(federation->federationAccess);
+        release_lock(server->clientAccess);
+        return;
+    }
+    federation->relayedIn++;
+
+    // Only tell local clients about members they have not already been told
+    // about when the link was established
+    char lineCopy[MAX_BUF];
+    strcpy(lineCopy, line);
+    char* command = strtok(lineCopy, ":");
+    char* name = strtok(NULL, ":");
+    int isNews = 0;
+    if (command != NULL && name != NULL) {
+        switch (hash_input(command)) {
+            case ENTER:
+                isNews = add_remote_member(federation, name, origin);
+                break;
+            case LEAVE:
+                isNews = remove_remote_member(federation, name, origin);
+                break;
+            case MSG:
+            case MSGPART:
+                isNews = 1;
+                break;
+        }
+    }
+    if (isNews) {
+        broadcast_to_clients(server, line);
+    }
+
+    char buffer[MAX_BUF];
+    snprintf(buffer, MAX_BUF - 1, "FED:%lld:%lld:%s", origin, seq, line);
+    send_to_links(federation, link, buffer);
+
+    release_lock(federation->federationAccess);
+    release_lock(server->clientAccess);
+}
+
+/* Handles a member sent by a peer when a link is established. Members which
+ * were not already known are broadcast to the local clients and passed on to
+ * every other peer.
+ */
+static void relay_member(Server* server, Client* link, long long origin,
+        char* name) {
+    Federation* federation = server->federation;
+    take_lock(server->clientAccess);
+    take_lock(federation->federationAccess);
+
+    char buffer[MAX_BUF];
+    if (origin != federation->id &&
+            add_remote_member(federation, name, origin)) {
+        snprintf(buffer, MAX_BUF - 1, "ENTER:%s", name);
+        broadcast_to_clients(server, buffer);
+        snprintf(buffer, MAX_BUF - 1, "SYNC:%lld:%s", origin, name);
+        send_to_links(federation, link, buffer);
+    }
+
+    release_lock(federation->federationAccess);
+    release_lock(server->clientAccess);
+}
+
+/* Finds the latest announced peers of an origin server, or NULL if it has
+ * never announced any. The federation lock must be held by the caller.
+ */
+static OriginPeers* find_origin_peers(Federation* federation,
+        long long origin) {
+    OriginPeers* peers = federation->topology;
+    while (peers != NULL && peers->origin != origin) {
+        peers = peers->next;
+    }
+    return peers;
+}
+
+/* Checks whether one server has said that it is linked to another. This
+ * server's own links are known for certain. The federation lock must be held
+ * by the caller.
+ */
+static int has_announced_peer(Federation* federation, long long origin,
+        long long peer) {
+    if (origin == federation->id) {
+        for (Client* link = federation->links; link != NULL;
+                link = link->next) {
+            if (strtoll(link->name, NULL, 10) == peer) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    OriginPeers* peers = find_origin_peers(federation, origin);
+    for (int i = 0; peers != NULL && i < peers->numPeers; i++) {
+        if (peers->peers[i] == peer) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Checks whether an id is among the first count in a list of ids.
+ */
+static int is_listed(long long* ids, int count, long long id) {
+    for (int i = 0; i < count; i++) {
+        if (ids[i] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Removes every member whose origin server can no longer be reached through
+ * any chain of links, telling the local clients that each has left. A link
+ * between two other servers only counts while both have announced it, and a
+ * link to this server only while it is up. Both locks must be held by the
+ * caller.
+ */
+static void drop_unreachable_members(Server* server) {
+    Federation* federation = server->federation;
+    int numOrigins = 1;
+    for (OriginPeers* peers = federation->topology; peers != NULL;
+            peers = peers->next) {
+        numOrigins++;
+    }
+    for (Client* link = federation->links; link != NULL; link = link->next) {
+        numOrigins++;
+    }
+
+    // Spread out from this server until no more origins can be reached
+    long long* reached = malloc(sizeof(long long) * numOrigins);
+    int numReached = 0;
+    reached[numReached++] = federation->id;
+    for (int i = 0; i < numReached; i++) {
+        long long origin = reached[i];
+        if (origin == federation->id) {
+            for (Client* link = federation->links; link != NULL;
+                    link = link->next) {
+                long long peer = strtoll(link->name, NULL, 10);
+                if (!is_listed(reached, numReached, peer)) {
+                    reached[numReached++] = peer;
+                }
+            }
+            continue;
+        }
+        OriginPeers* peers = find_origin_peers(federation, origin);
+        for (int j = 0; peers != NULL && j < peers->numPeers; j++) {
+            long long peer = peers->peers[j];
+            if (peer != federation->id &&
+                    !is_listed(reached, numReached, peer) &&
+                    has_announced_peer(federation, peer, origin)) {
+                reached[numReached++] = peer;
+            }
+        }
+    }
+
+    char buffer[MAX_BUF];
+    RemoteMember** position = &federation->members;
+    while (*position != NULL) {
+        RemoteMember* member = *position;
+        if (is_listed(reached, numReached, member->origin)) {
+            position = &member->next;
+            continue;
+        }
+        *position = member->next;
+        snprintf(buffer, MAX_BUF - 1, "LEAVE:%s", member->name);
+        broadcast_to_clients(server, buffer);
+        free(member->name);
+        free(member);
+    }
+    free(reached);
+}
+
+/* Formats an origin's peers as a TOPO line, leaving out any which would not
+ * fit into one message.
+ */
+static void format_topology(char* buffer, long long origin, long long seq,
+        long long* peers, int numPeers) {
+    size_t length = sprintf(buffer, "TOPO:%lld:%lld:", origin, seq);
+    for (int i = 0; i < numPeers; i++) {
+        char id[24];
+        int idLength = sprintf(id, "%s%lld", i > 0 ? "," : "", peers[i]);
+        if (length + idLength >= MAX_BUF - 1) {
+            break;
+        }
+        length += sprintf(buffer + length, "%s", id);
+    }
+}
+
+/* Tells every peer which servers this one is now linked to. The federation
+ * lock must be held by the caller.
+ */
+static void announce_topology(Federation* federation) {
+    int numPeers = 0;
+    for (Client* link = federation->links; link != NULL; link = link->next) {
+        numPeers++;
+    }
+    long long peers[numPeers + 1];
+    numPeers = 0;
+    for (Client* link = federation->links; link != NULL; link = link->next) {
+        peers[numPeers++] = strtoll(link->name, NULL, 10);
+    }
+
+    char buffer[MAX_BUF];
+    format_topology(buffer, federation->id, ++federation->topologySeq, peers,
+            numPeers);
+    send_to_links(federation, NULL, buffer);
+}
+
+/* Handles an origin's peers announced by a peer. Announcements which are
+ * newer than any seen before are recorded and passed on to every other peer,
+ * and if the origin has dropped a link, any members which can no longer be
+ * reached are removed.
+ */
+static void relay_topology(Server* server, Client* link, long long origin,
+        long long seq, char* list) {
+    Federation* federation = server->federation;
+    take_lock(server->clientAccess);
+    take_lock(federation->federationAccess);
+
+    OriginPeers* peers = find_origin_peers(federation, origin);
+    if (origin == federation->id || (peers != NULL && seq <= peers->seq)) {
+        release_lock(federation->federationAccess);
+        release_lock(server->clientAccess);
+        return;
+    }
+    if (peers == NULL) {
+        peers = malloc(sizeof(OriginPeers));
+        peers->origin = origin;
+        peers->peers = NULL;
+        peers->numPeers = 0;
+        peers->next = federation->topology;
+        federation->topology = peers;
+    }
+
+    int numPeers = 0;
+    long long newPeers[MAX_BUF / 2];
+    for (char* id = list != NULL ? strtok(list, ",") : NULL; id != NULL;
+            id = strtok(NULL, ",")) {
+        newPeers[numPeers++] = strtoll(id, NULL, 10);
+    }
+    int hasDropped = 0;
+    for (int i = 0; i < peers->numPeers; i++) {
+        hasDropped |= !is_listed(newPeers, numPeers, peers->peers[i]);
+    }
+    peers->seq = seq;
+    peers->numPeers = numPeers;
+    peers->peers = realloc(peers->peers, sizeof(long long) * (numPeers + 1));
+    memcpy(peers->peers, newPeers, sizeof(long long) * numPeers);
+
+    char buffer[MAX_BUF];
+    format_topology(buffer, origin, seq, newPeers, numPeers);
+    send_to_links(federation, link, buffer);
+    if (hasDropped) {
+        drop_unreachable_members(server);
+    }
+
+    release_lock(federation->federationAccess);
+    release_lock(server->clientAccess);
+}
+
+/* Parses and handles a single message received over a peer link. Anything
+ * other than FED, SYNC or TOPO is ignored.
+ */
+static void handle_peer_message(Server* server, Client* link, char* message) {
+    char* command = strtok(message, ":");
+    char* origin = strtok(NULL, ":");
+    if (command == NULL || origin == NULL) {
+        return;
+    }
+
+    char* seq;
+    char* rest;
+    switch (hash_input(command)) {
+        case FED:
+            seq = strtok(NULL, ":");
+            rest = strtok(NULL, "\n");
+            if (seq != NULL && rest != NULL) {
+                relay_event(server, link, strtoll(origin, NULL, 10),
+                        strtoll(seq, NULL, 10), rest);
+            }
+            break;
+        case SYNC:
+            rest = strtok(NULL, "\n");
+            if (rest != NULL) {
+                relay_member(server, link, strtoll(origin, NULL, 10), rest);
+            }
+            break;
+        case TOPO:
+            // A server with no links announces an empty list
+            seq = strtok(NULL, ":");
+            rest = strtok(NULL, "\n");
+            if (seq != NULL) {
+                relay_topology(server, link, strtoll(origin, NULL, 10),
+                        strtoll(seq, NULL, 10), rest);
+            }
+            break;
+    }
+}
+
+void serve_peer_link(Server* server, int socket) {
+    Federation* federation = server->federation;
+    Client* link = setup_client(socket, NULL, "");
+    create_out_queue(server, link);
+    link->reader = pthread_self();
+
+    // Both ends introduce themselves first. A server which has linked to
+    // itself drops the link.
+    char buffer[MAX_BUF];
+    sprintf(buffer, "PEER:%lld", federation->id);
+    queue_control_message(link, buffer);
+    char* command = receive_message(link, buffer) ? strtok(buffer, ":") : NULL;
+    char* peerId = strtok(NULL, "\n");
+    if (command == NULL || peerId == NULL || hash_input(command) != PEER ||
+            strtoll(peerId, NULL, 10) == federation->id) {
+        close_client(link);
+        return;
+    }
+    strcpy(link->name, peerId);
+
+    // Send the whole room as soon as the link joins the list, so that the
+    // peer receives every later event after the members it refers to. Every
+    // origin's links go first, so that the peer knows how to reach each
+    // member's origin before it hears of the member.
+    take_lock(server->clientAccess);
+    take_lock(federation->federationAccess);
+    link->next = federation->links;
+    federation->links = link;
+    announce_topology(federation);
+    for (OriginPeers* peers = federation->topology; peers != NULL;
+            peers = peers->next) {
+        format_topology(buffer, peers->origin, peers->seq, peers->peers,
+                peers->numPeers);
+        queue_control_message(link, buffer);
+    }
+    for (Client* client = server->clientList; client != NULL;
+            client = client->next) {
+        snprintf(buffer, MAX_BUF - 1, "SYNC:%lld:%s", federation->id,
+                client->name);
+        queue_control_message(link, buffer);
+    }
+    for (RemoteMember* member = federation->members; member != NULL;
+            member = member->next) {
+        snprintf(buffer, MAX_BUF - 1, "SYNC:%lld:%s", member->origin,
+                member->name);
+        queue_control_message(link, buffer);
+    }
+    release_lock(federation->federationAccess);
+    release_lock(server->clientAccess);
+
+    while (receive_message(link, buffer)) {
+        handle_peer_message(server, link, buffer);
+    }
+
+    // Once the link drops, only the members of origins which can still be
+    // reached another way are kept
+    take_lock(server->clientAccess);
+    take_lock(federation->federationAccess);
+    for (Client** position = &federation->links; *position != NULL;
+            position = &(*position)->next) {
+        if (*position == link) {
+            *position = link->next;
+            break;
+        }
+    }
+    announce_topology(federation);
+    drop_unreachable_members(server);
+    release_lock(federation->federationAccess);
+    release_lock(server->clientAccess);
+    close_client(link);
+}
+
+void federate_event(Server* server, char* line) {
+    Federation* federation = server->federation;
+    if (federation == NULL) {
+        return;
+    }
+
+    take_lock(federation->federationAccess);
+    char buffer[MAX_BUF];
+    snprintf(buffer, MAX_BUF - 1, "FED:%lld:%lld:%s", federation->id,
+            ++federation->nextSeq, line);
+    for (Client* link = federation->links; link != NULL; link = link->next) {
+        send_to_link(link, buffer);
+        federation->relayedOut++;
+    }
+    release_lock(federation->federationAccess);
+}
+
+int is_remote_name(Server* server, char* name) {
+    Federation* federation = server->federation;
+    if (federation == NULL) {
+        return 0;
+    }
+
+    take_lock(federation->federationAccess);
+    RemoteMember* member = federation->members;
+    while (member != NULL && strcmp(name, member->name)) {
+        member = member->next;
+    }
+    release_lock(federation->federationAccess);
+    return member != NULL;
+}
+
+void print_federation_stats(Server* server) {
+    Federation* federation = server->federation;
+    if (federation == NULL) {
+        return;
+    }
+
+    take_lock(federation->federationAccess);
+    int numLinks = 0;
+    int numMembers = 0;
+    fprintf(stderr, "@FEDERATION@\n");
+    for (Client* link = federation->links; link != NULL; link = link->next) {
+        fprintf(stderr, "peer:%s:QUEUED:%zu:DROPPED:%lld\n", link->name,
+                link->outQueue->queuedBytes, link->metrics->dropped);
+        numLinks++;
+    }
+    for (RemoteMember* member = federation->members; member != NULL;
+            member = member->next) {
+        numMembers++;
+    }
+    fprintf(stderr, "server:LINKS:%d:REMOTE:%d:RELAYED_IN:%d:RELAYED_OUT:%d:"
+            "DUPLICATES:%d\n", numLinks, numMembers, federation->relayedIn,
+            federation->relayedOut, federation->duplicates);
+    release_lock(federation->federationAccess);
+}
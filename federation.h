@@ -0,0 +1,238 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+#define PEER_RETRY_US 1000000
+#define PEER_QUEUE_LIMIT (16 * 1024 * 1024)
+
+/* The HashedPeerCommands enum holds the integer hashes (see hash_input) of the
+ * messages sent between federated servers over their peer links.
+ *
+ * PEER:<id> - sent by both ends when a link is established.
+ * FED:<origin>:<seq>:<line> - a room event (an ENTER, LEAVE or MSG line) which
+ *  happened on the origin server, flooded to every server exactly once.
+ * SYNC:<origin>:<name> - a member of the room, sent for every known member
+ *  when a link is established.
+ * TOPO:<origin>:<seq>:<id>,<id>,... - the peers which the origin server is
+ *  linked to, sent by the origin whenever its links change, and flooded to
+ *  every server. Each server sends every origin's latest list when a link is
+ *  established, before any SYNC.
+ */
+enum HashedPeerCommands {
+    PEER = 3070, FED = 905, SYNC = 3343, TOPO = 3298
+};
+
+/* The RemoteMember datastructure holds a member of the room which is
+ * connected to another server in the federation.
+ *
+ * name: The member's name.
+ *
+ * origin: The id of the server which the member is connected to. The member
+ *  stays in the room for as long as the origin can be reached through any
+ *  chain of links, whichever link it was learned through.
+ *
+ * next: A pointer to the next member, in alphabetical order.
+ */
+typedef struct RemoteMember {
+    char* name;
+    long long origin;
+    struct RemoteMember* next;
+} RemoteMember;
+
+/* The OriginSequence datastructure records the highest event sequence number
+ * seen from a single origin server. Every server sends its events down each
+ * link in order, so any event at or below this number has already been seen.
+ *
+ * origin: The id of the origin server.
+ *
+ * lastSeq: The highest sequence number seen from the origin server.
+ *
+ * next: A pointer to the next origin.
+ */
+typedef struct OriginSequence {
+    long long origin;
+    long long lastSeq;
+    struct OriginSequence* next;
+} OriginSequence;
+
+/* The OriginPeers datastructure records the peers which an origin server
+ * last announced that it is linked to (see TOPO). Two servers are only taken
+ * to be linked while both of them say so, so an origin which has gone away
+ * is cut off once its peers announce that their links to it have dropped,
+ * however out of date its own list is.
+ *
+ * origin: The id of the origin server.
+ *
+ * seq: The number of the origin's latest announcement, so that older ones
+ *  arriving over slower paths are ignored.
+ *
+ * peers: The ids of the origin's peers.
+ *
+ * numPeers: The number of ids in peers.
+ *
+ * next: A pointer to the next origin.
+ */
+typedef struct OriginPeers {
+    long long origin;
+    long long seq;
+    long long* peers;
+    int numPeers;
+    struct OriginPeers* next;
+} OriginPeers;
+
+/* The Federation datastructure holds the state of a server which is linked
+ * to other server processes, so that users on any of them see one room.
+ *
+ * id: A unique id for this server process.
+ *
+ * nextSeq: The sequence number of the next event which happens on this server.
+ *
+ * topologySeq: The number of this server's latest TOPO announcement.
+ *
+ * listener: The socket which the server accepts peer links on, if it has a
+ *  federation address.
+ *
+ * federationAccess: A lock that should be used when accessing any of the
+ *  lists below. If the client list lock is needed too, it must be taken first.
+ *
+ * links: The head of a linked list of Client instances, one for each peer link
+ *  which has been established.
+ *
+ * members: The head of the list of remote members, in alphabetical order.
+ *
+ * seen: The head of the list of origin sequence numbers seen.
+ *
+ * topology: The head of the list of other servers' latest announced peers.
+ *
+ * relayedIn/relayedOut: The number of events received from and sent to peers.
+ *
+ * duplicates: The number of events received more than once and discarded.
+ */
+typedef struct Federation {
+    long long id;
+    long long nextSeq;
+    long long topologySeq;
+    int listener;
+
+    sem_t* federationAccess;
+    Client* links;
+    RemoteMember* members;
+    OriginSequence* seen;
+    OriginPeers* topology;
+
+    volatile int relayedIn;
+    volatile int relayedOut;
+    volatile int duplicates;
+} Federation;
+
+/* The PeerLink datastructure is given to the thread which establishes and
+ * serves a single peer link.
+ *
+ * server: An instance of the main server datastructure.
+ *
+ * address: The address of the peer to connect to (for outgoing links), or
+ *  NULL for links which were accepted.
+ *
+ * socket: The connected socket (for accepted links).
+ */
+typedef struct PeerLink {
+    Server* server;
+    char* address;
+    int socket;
+} PeerLink;
+
+/* The initialise_federation function sets up the server's federation state,
+ * listens for peer links on the server's federation address (if it has one),
+ * and starts a thread for every peer it has been told to link to. Peer
+ * addresses are either a Unix domain socket path (containing a '/') or a port
+ * number on the loopback interface.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *
+ * Returns:
+ *      (int) 0 - if the federation address could not be listened on
+ *      (int) 1 - if the federation was set up
+ */
+int initialise_federation(Server* server);
+
+/* The accept_peer_links function is the main routine for the thread which
+ * accepts peer links on the server's federation address.
+ *
+ * Parameters:
+ *      args - An instance of the main server datastructure
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* accept_peer_links(void* args);
+
+/* The maintain_peer_link function is the main routine for the thread serving
+ * a single peer link. Outgoing links are connected (and reconnected every
+ * PEER_RETRY_US after they drop), while accepted links are served once.
+ *
+ * Parameters:
+ *      args - A PeerLink datastructure describing the link
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* maintain_peer_link(void* args);
+
+/* The serve_peer_link function exchanges ids with a newly connected peer,
+ * announces this server's new set of links, sends the peer every origin's
+ * links and every member of the room, and then handles messages from it
+ * until the link drops. The change is then announced again, and the members
+ * of any origin which can no longer be reached through the remaining links
+ * are removed.
+ * Everything sent to the peer goes in the control lane of its outbound queue,
+ * as a dropped ENTER or LEAVE would leave the peer's member list wrong for
+ * good, so a peer which falls behind is never subject to the slow consumer
+ * policy. Instead, a peer with more than PEER_QUEUE_LIMIT bytes waiting is
+ * evicted, so that the link drops and (once reconnected) the room is sent
+ * to it again from scratch.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      socket - A connected socket to the peer
+ */
+void serve_peer_link(Server* server, int socket);
+
+/* The federate_event function sends an ENTER, LEAVE or MSG line which
+ * happened on this server to every peer link, tagged with this server's id
+ * and the next sequence number. It does nothing if the server is not
+ * federated. The client list lock must be held by the caller.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      line - The line which was broadcast to the local clients
+ */
+void federate_event(Server* server, char* line);
+
+/* The is_remote_name function checks whether a name is taken by a member of
+ * the room on another server. The client list lock must be held by the
+ * caller.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      name - The name to check
+ *
+ * Returns:
+ *      (int) 1 - if the name is taken remotely, otherwise 0
+ */
+int is_remote_name(Server* server, char* name);
+
+/* The print_federation_stats function outputs a @FEDERATION@ section with the
+ * number of links and remote members, and the number of events relayed and
+ * discarded as duplicates. It does nothing if the server is not federated.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ */
+void print_federation_stats(Server* server);
+#endif
@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "serverutil.h"
+#include "sharedutil.h"
+#include "outqueue.h"
+#include "dispatch.h"
+#include "handoff.h"
+#include "session.h"
+#include "presence.h"
+
+/* Fills in a Unix domain socket address for the given path, returning 0 if
+ * the path is too long to fit.
+ */
+static int make_handoff_address(struct sockaddr_un* address, char* path) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        return 0;
+    }
+    strcpy(address->sun_path, path);
+    return 1;
+}
+
+int initialise_handoff_listener(Server* server) {
+    struct sockaddr_un address;
+    if (!make_handoff_address(&address, server->options->handoffPath)) {
+        return 0;
+    }
+
+    // Replace any stale path left by a previous server
+    unlink(address.sun_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*) &address,
+            sizeof(struct sockaddr_un)) || listen(listener, 1)) {
+        return 0;
+    }
+
+    server->handoffSocket = listener;
+    pthread_t tid;
+    pthread_create(&tid, 0, listen_for_handoff, server);
+    pthread_detach(tid);
+    return 1;
+}
+
+void* listen_for_handoff(void* args) {
+    Server* server = (Server*) args;
+
+    int channel;
+    while ((channel = accept(server->handoffSocket, 0, 0)) >= 0 ||
+            errno == EINTR) {
+        if (channel >= 0) {
+            hand_off_server(server, channel);
+            close(channel);
+        }
+    }
+    return NULL;
+}
+
+/* Writes all of the given bytes to a channel, returning 0 on failure.
+ */
+static int write_fully(int channel, void* data, size_t length) {
+    char* bytes = (char*) data;
+    while (length > 0) {
+        ssize_t written = send(channel, bytes, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written <= 0) {
+            return 0;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 1;
+}
+
+/* Reads exactly the given number of bytes from a channel, returning 0 on
+ * failure.
+ */
+static int read_fully(int channel, void* data, size_t length) {
+    char* bytes = (char*) data;
+    while (length > 0) {
+        ssize_t bytesRead = read(channel, bytes, length);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        } else if (bytesRead <= 0) {
+            return 0;
+        }
+        bytes += bytesRead;
+        length -= bytesRead;
+    }
+    return 1;
+}
+
+/* Sends a fixed size datastructure to a channel with a file descriptor
+ * attached to it, returning 0 on failure.
+ */
+static int send_with_fd(int channel, void* data, size_t length, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec vector = {.iov_base = data, .iov_len = length};
+    struct msghdr header = {
+        .msg_iov = &vector, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr* attached = CMSG_FIRSTHDR(&header);
+    attached->cmsg_level = SOL_SOCKET;
+    attached->cmsg_type = SCM_RIGHTS;
+    attached->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(attached), &fd, sizeof(int));
+
+    ssize_t sent = sendmsg(channel, &header, MSG_NOSIGNAL);
+    if (sent <= 0) {
+        return 0;
+    }
+    // The file descriptor went with the first byte, so send any remainder
+    return write_fully(channel, (char*) data + sent, length - sent);
+}
+
+/* Receives a fixed size datastructure from a channel along with the file
+ * descriptor attached to it, returning 0 on failure.
+ */
+static int receive_with_fd(int channel, void* data, size_t length, int* fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec vector = {.iov_base = data, .iov_len = length};
+    struct msghdr header = {
+        .msg_iov = &vector, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+
+    ssize_t received = recvmsg(channel, &header, MSG_CMSG_CLOEXEC);
+    struct cmsghdr* attached = CMSG_FIRSTHDR(&header);
+    if (received <= 0 || attached == NULL ||
+            attached->cmsg_type != SCM_RIGHTS) {
+        return 0;
+    }
+    memcpy(fd, CMSG_DATA(attached), sizeof(int));
+    return read_fully(channel, (char*) data + received, length - received);
+}
+
+/* Lets every thread parked by park_for_handoff carry on, after a handoff has
+ * failed.
+ */
+static void resume_after_handoff(Server* server) {
+    server->isHandingOff = 0;
+
+    take_lock(server->clientAccess);
+    int parked = server->isAcceptParked;
+    for (Client* client = server->clientList; client != NULL;
+            client = client->next) {
+        parked += client->isParked;
+    }
+    release_lock(server->clientAccess);
+
+    for (int i = 0; i < parked; i++) {
+        sem_post(server->handoffResume);
+    }
+}
+
+/* Sends the header, and then a record for every client in the client list, to
+ * the new server process. The client list lock must be held, every client
+ * thread must be parked, and every writer paused. The unsent bytes taken from
+ * each client's queue are returned through unsent, so that they can be
+ * restored if the handoff fails.
+ */
+static int send_server_state(Server* server, int channel, char** unsent,
+        size_t* unsentLength) {
+    HandoffHeader header;
+    memset(&header, 0, sizeof(HandoffHeader));
+    header.version = HANDOFF_VERSION;
+    header.numClients = 0;
+    for (Client* client = server->clientList; client != NULL;
+            client = client->next) {
+        header.numClients++;
+    }
+    take_lock(server->statsAccess);
+    for (int i = 0; i < NUM_SERVER_STATS; i++) {
+        header.stats[i] = server->stats[i];
+    }
+    release_lock(server->statsAccess);
+
+    header.lastSequence = server->sessions->lastSequence;
+    header.hasUnixSocket = server->unixSocket != 0;
+    char marker = 1;
+    if (!send_with_fd(channel, &header, sizeof(HandoffHeader),
+            server->serverSocket) || (header.hasUnixSocket && 
+            !send_with_fd(channel, &marker, 1, server->unixSocket))) {
+        return 0;
+    }
+
+    int i = 0;
+    for (Client* client = server->clientList; client != NULL;
+            client = client->next, i++) {
+        unsent[i] = take_unsent_messages(client, &unsentLength[i]);
+
+        HandoffRecord record;
+        memset(&record, 0, sizeof(HandoffRecord));
+        record.isCommunicating = client->isCommunicating;
+        for (int j = 0; j < NUM_CLIENT_STATS; j++) {
+            record.stats[j] = client->stats[j];
+        }
+        record.dropped = client->metrics->dropped;
+        record.nameLength = strlen(client->name);
+        record.unreadLength = client->readEnd - client->readStart;
+        record.unsentLength = unsentLength[i];
+        record.sessionToken = client->session != NULL ?
+                client->session->token : 0;
+        record.isChunked = client->outQueue->isChunked;
+        record.isBatched = client->outQueue->isBatched;
+        record.cutCommand = client->cutCommand;
+        record.streamedLength = client->streamedLength;
+        record.isStreaming = client->isStreaming;
+
+        if (!send_with_fd(channel, &record, sizeof(HandoffRecord),
+                client->socket) ||
+                !write_fully(channel, client->name, record.nameLength) ||
+                !write_fully(channel, client->readBuffer + client->readStart,
+                    record.unreadLength) ||
+                !write_fully(channel, unsent[i], record.unsentLength)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int hand_off_server(Server* server, int channel) {
+
+    // Stop accepting new clients first
+    server->isHandingOff = 1;
+    long long deadline = current_time_us() + HANDOFF_TIMEOUT_US;
+    while (!server->isAcceptParked) {
+        if (current_time_us() > deadline) {
+            resume_after_handoff(server);
+            return 0;
+        }
+        usleep(HANDOFF_RETRY_US);
+    }
+
+    // Then interrupt every client thread until they have all parked, and
+    // wait out any handshake or dispatched command which is still in
+    // progress.
+    while (1) {
+        take_lock(server->clientAccess);
+        int unparked = 0;
+        for (Client* client = server->clientList; client != NULL;
+                client = client->next) {
+            if (!client->isParked) {
+                pthread_kill(client->reader, SIGUSR2);
+                unparked++;
+            }
+        }
+        if (unparked == 0 && server->numHandshaking == 0 &&
+                is_dispatch_idle(server)) {
+            break;
+        }
+        release_lock(server->clientAccess);
+
+        if (current_time_us() > deadline) {
+            resume_after_handoff(server);
+            return 0;
+        }
+        usleep(HANDOFF_RETRY_US);
+    }
+
+    // With the client list lock still held, nothing else can change. A
+    // compression stream cannot be handed over part way through, and nor can
+    // a pair of shared memory rings, so give up if any client is using
+    // either.
+    for (Client* client = server->clientList; client != NULL;
+            client = client->next) {
+        if (client->compression != NULL) {
+            fprintf(stderr, "Cannot hand over compressed connections\n");
+            release_lock(server->clientAccess);
+            resume_after_handoff(server);
+            return 0;
+        } else if (client->rings != NULL) {
+            fprintf(stderr, "Cannot hand over shared memory connections\n");
+            release_lock(server->clientAccess);
+            resume_after_handoff(server);
+            return 0;
+        }
+    }
+
+    // Only connected clients are handed over, so the room is told that the
+    // clients of any detached sessions have left before the queues are taken,
+    // along with any presence events still being held back
+    end_detached_sessions(server);
+    flush_presence(server);
+    int numClients = 0;
+    for (Client* client = server->clientList; client != NULL;
+            client = client->next) {
+        pause_out_queue(client);
+        numClients++;
+    }
+
+    char** unsent = calloc(numClients + 1, sizeof(char*));
+    size_t* unsentLength = calloc(numClients + 1, sizeof(size_t));
+    char acknowledgement;
+    if (send_server_state(server, channel, unsent, unsentLength) &&
+            read_fully(channel, &acknowledgement, 1)) {
+        // The new process now serves every client, so leave without closing
+        // any of the sockets
+        fflush(stdout);
+        fprintf(stderr, "Handed over to new server\n");
+        _exit(NORMAL);
+    }
+
+    // Otherwise, put everything back and carry on
+    int i = 0;
+    for (Client* client = server->clientList; client != NULL;
+            client = client->next, i++) {
+        if (unsent[i] != NULL) {
+            restore_unsent_messages(client, unsent[i], unsentLength[i], 1);
+            free(unsent[i]);
+        }
+        resume_out_queue(client);
+    }
+    free(unsent);
+    free(unsentLength);
+    release_lock(server->clientAccess);
+    resume_after_handoff(server);
+    return 0;
+}
+
+/* Receives a single client's record from a running server, and sets up a new
+ * client instance from it, returning NULL on failure. The client's unwritten
+ * messages are returned through unsent rather than queued, so that nothing is
+ * written to the client until the running server has let go of it.
+ */
+static Client* receive_client(Server* server, int channel, char** unsent,
+        size_t* unsentLength) {
+    HandoffRecord record;
+    int socket;
+    if (!receive_with_fd(channel, &record, sizeof(HandoffRecord), &socket)) {
+        return NULL;
+    }
+    if (record.nameLength <= 0 || record.nameLength >= MAX_BUF ||
+            record.unreadLength < 0 ||
+            record.unreadLength > READ_BUFFER_SIZE ||
+            record.unsentLength < 0) {
+        close(socket);
+        return NULL;
+    }
+
+    char name[MAX_BUF];
+    if (!read_fully(channel, name, record.nameLength)) {
+        close(socket);
+        return NULL;
+    }
+    name[record.nameLength] = '\0';
+    Client* client = setup_client(socket, name, "");
+
+    *unsent = malloc(record.unsentLength + 1);
+    *unsentLength = record.unsentLength;
+    if (!read_fully(channel, client->readBuffer, record.unreadLength) ||
+            !read_fully(channel, *unsent, record.unsentLength)) {
+        free_client(client);
+        free(*unsent);
+        *unsent = NULL;
+        return NULL;
+    }
+
+    client->readEnd = record.unreadLength;
+    client->isCommunicating = record.isCommunicating;
+    for (int i = 0; i < NUM_CLIENT_STATS; i++) {
+        client->stats[i] = record.stats[i];
+    }
+    client->cutCommand = record.cutCommand;
+    client->streamedLength = record.streamedLength;
+    client->isStreaming = record.isStreaming;
+    create_out_queue(server, client);
+    set_metric(&client->metrics->dropped, record.dropped);
+    if (record.isChunked) {
+        client->capabilities |= CAP_CHUNKED;
+        client->outQueue->isChunked = 1;
+    }
+    if (record.isBatched) {
+        client->capabilities |= CAP_PRESENCE;
+        client->outQueue->isBatched = 1;
+    }
+    if (record.sessionToken != 0) {
+        restore_session(server, client, record.sessionToken);
+    }
+    return client;
+}
+
+int take_over_server(Server* server, char* path) {
+    struct sockaddr_un address;
+    int channel = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (!make_handoff_address(&address, path) || channel < 0 ||
+            connect(channel, (struct sockaddr*) &address,
+                sizeof(struct sockaddr_un))) {
+        return 0;
+    }
+
+    HandoffHeader header;
+    int serverSocket;
+    if (!receive_with_fd(channel, &header, sizeof(HandoffHeader),
+            &serverSocket)) {
+        return 0;
+    }
+    if (header.version != HANDOFF_VERSION || header.numClients < 0) {
+        return 0;
+    }
+    char marker;
+    if (header.hasUnixSocket && 
+            !receive_with_fd(channel, &marker, 1, &server->unixSocket)) {
+        return 0;
+    }
+    for (int i = 0; i < NUM_SERVER_STATS; i++) {
+        server->stats[i] = header.stats[i];
+    }
+    server->sessions->lastSequence = header.lastSequence;
+
+    // Receive every client before serving any of them, as the running server
+    // keeps serving them itself until it has been acknowledged. On failure,
+    // the caller exits, which closes every socket without shutting it down.
+    int numClients = header.numClients;
+    Client** clients = calloc(numClients + 1, sizeof(Client*));
+    char** unsent = calloc(numClients + 1, sizeof(char*));
+    size_t* unsentLength = calloc(numClients + 1, sizeof(size_t));
+    for (int i = 0; i < numClients; i++) {
+        clients[i] = receive_client(server, channel, &unsent[i], 
+                &unsentLength[i]);
+        if (clients[i] == NULL) {
+            return 0;
+        }
+    }
+
+    char acknowledgement = 1;
+    if (!write_fully(channel, &acknowledgement, 1)) {
+        return 0;
+    }
+    close(channel);
+
+    // Output the addresses being served, just as a freshly started server
+    // does
+    print_listener_address(serverSocket);
+    if (server->unixSocket) {
+        print_listener_address(server->unixSocket);
+    }
+
+    for (int i = 0; i < numClients; i++) {
+        restore_unsent_messages(clients[i], unsent[i], unsentLength[i], 0);
+        resume_client(server, clients[i]);
+        free(unsent[i]);
+    }
+    free(clients);
+    free(unsent);
+    free(unsentLength);
+    return serverSocket;
+}
+
+void park_for_handoff(Server* server, volatile int* isParked) {
+    *isParked = 1;
+    while (server->isHandingOff) {
+        sem_wait(server->handoffResume);
+    }
+    *isParked = 0;
+}
+
+void handoff_signal_handler(int code) {
+    ;
+}
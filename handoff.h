@@ -0,0 +1,162 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+#include "serverutil.h"
+#define HANDOFF_VERSION 7
+#define HANDOFF_POLL_MS 100
+#define HANDOFF_RETRY_US 10000
+#define HANDOFF_TIMEOUT_US 5000000
+
+/* The HandoffHeader datastructure is the first thing sent by a running server
+ * to the process taking over from it. It is sent along with the server's
+ * listening socket.
+ *
+ * version: HANDOFF_VERSION, so that incompatible servers refuse to take over.
+ *
+ * numClients: The number of HandoffRecords which follow.
+ *
+ * hasUnixSocket: Whether the server's Unix domain socket follows the header,
+ *  attached to a single byte, before the records.
+ *
+ * stats: The cumulative server stats, indexed by the Stats enumeration.
+ *
+ * lastSequence: The sequence number of the server's most recent broadcast,
+ *  which the new process carries on from. The history of broadcasts is not
+ *  handed over, so a client which resumes its session afterwards is only
+ *  sent what was broadcast since.
+ */
+typedef struct HandoffHeader {
+    int version;
+    int numClients;
+    int hasUnixSocket;
+    int stats[NUM_SERVER_STATS];
+    unsigned long long lastSequence;
+} HandoffHeader;
+
+/* The HandoffRecord datastructure describes a single connected client being
+ * handed over to a new server process. It is sent along with the client's
+ * socket, and is followed by the client's name, then any bytes the client
+ * has sent which have not yet been handled, then any bytes queued for the
+ * client which have not yet been written to it.
+ *
+ * isCommunicating: Whether the client is still allowed to communicate (i.e.
+ *  it has not been kicked).
+ *
+ * stats: The client's stats, indexed by the Stats enumeration.
+ *
+ * dropped: The number of messages the client has had dropped.
+ *
+ * nameLength/unreadLength/unsentLength: The number of bytes which follow.
+ *
+ * sessionToken: The token of the client's resumable session, or 0.
+ *
+ * isChunked: Whether the client asked for CAPS:CHUNKED.
+ *
+ * isBatched: Whether the client asked for CAPS:PRESENCE.
+ *
+ * cutCommand/streamedLength/isStreaming: The state of a long line the client
+ *  is part way through sending (see sharedutil.h).
+ */
+typedef struct HandoffRecord {
+    int isCommunicating;
+    int stats[NUM_CLIENT_STATS];
+    int dropped;
+    int nameLength;
+    int unreadLength;
+    int unsentLength;
+    unsigned long long sessionToken;
+    int isChunked;
+    int isBatched;
+    int cutCommand;
+    size_t streamedLength;
+    int isStreaming;
+} HandoffRecord;
+
+/* The initialise_handoff_listener function listens for new server processes
+ * on a Unix domain socket at the server's handoff path, and creates a
+ * detached thread which hands the server over to any process that connects.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *
+ * Returns:
+ *      (int) 0 - if the handoff path could not be listened on
+ *      (int) 1 - if the handoff listener was started
+ */
+int initialise_handoff_listener(Server* server);
+
+/* The listen_for_handoff function is the main routine for the handoff
+ * listening thread. It accepts connections on the handoff path one at a time,
+ * and attempts to hand the server over to each of them.
+ *
+ * Parameters:
+ *      args - An instance of the main server datastructure
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* listen_for_handoff(void* args);
+
+/* The hand_off_server function hands a running server over to a new process.
+ * The server first stops accepting connections, waits for any handshake in
+ * progress, and interrupts every client thread so that they stop reading. Each
+ * writer thread is then paused, and the listening socket, every client socket,
+ * and a snapshot of all names, stats and unhandled bytes are sent to the new
+ * process. Once the new process acknowledges the snapshot, this process exits
+ * without closing any connections.
+ *
+ * If anything goes wrong before the acknowledgement, or any client has
+ * negotiated compression or shared memory, the server carries on serving all
+ * of its clients as if nothing happened.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      channel - A connected Unix domain socket to the new process
+ *
+ * Returns:
+ *      (int) 0 - if the handoff failed, and the server has resumed
+ */
+int hand_off_server(Server* server, int channel);
+
+/* The take_over_server function takes over from a running server listening
+ * on the given handoff path. Every client in the snapshot sent by the running
+ * server is added to this server's client list, with its stats, unhandled
+ * bytes and unwritten messages restored, before a thread is started for it.
+ * None of the clients need to authenticate or negotiate their name again, and
+ * no ENTER messages are broadcast.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      path - The handoff path of the running server
+ *
+ * Returns:
+ *      (int) - The listening socket taken over from the running server
+ *      (int) 0 - if the running server could not be taken over
+ */
+int take_over_server(Server* server, char* path);
+
+/* The park_for_handoff function blocks the calling thread while the server is
+ * being handed over, so that it does not touch any sockets in the meantime.
+ * If the handoff fails, the thread returns and carries on.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      isParked - A flag which is set while the calling thread is parked
+ */
+void park_for_handoff(Server* server, volatile int* isParked);
+
+/* Empty function used to interrupt client threads blocked reading from their
+ * sockets when the server is being handed over. It is installed without
+ * SA_RESTART, so the interrupted read fails with EINTR.
+ *
+ * Parameters:
+ *      code - The code for the signal sent to the client thread
+ */
+void handoff_signal_handler(int code);
+#endif
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "sharedutil.h"
+#include "metrics.h"
+
+ClientMetrics* create_client_metrics(void) {
+    void* metrics = NULL;
+    if (posix_memalign(&metrics, CACHE_LINE, sizeof(ClientMetrics))) {
+        return NULL;
+    }
+    memset(metrics, 0, sizeof(ClientMetrics));
+    return (ClientMetrics*) metrics;
+}
+
+void record_pong(Client* client) {
+    ClientMetrics* metrics = client->metrics;
+    long long sentAt = __atomic_exchange_n(&metrics->pingSentAt, 0, 
+            __ATOMIC_RELAXED);
+    if (sentAt != 0) {
+        set_metric(&metrics->rttUs, current_time_us() - sentAt);
+    }
+}
+
+void snapshot_client_metrics(Client* client, ClientMetrics* snapshot) {
+    ClientMetrics* metrics = client->metrics;
+    memset(snapshot, 0, sizeof(ClientMetrics));
+    if (metrics == NULL) {
+        return;
+    }
+
+    volatile long long* from[] = {&metrics->bytesIn, &metrics->messagesIn,
+            &metrics->rttUs, &metrics->queueDepth, &metrics->peakQueueDepth,
+            &metrics->dropped, &metrics->pingSentAt, &metrics->bytesOut,
+            &metrics->delivered, &metrics->writes, &metrics->blockedUs};
+    volatile long long* to[] = {&snapshot->bytesIn, &snapshot->messagesIn,
+            &snapshot->rttUs, &snapshot->queueDepth, &snapshot->peakQueueDepth,
+            &snapshot->dropped, &snapshot->pingSentAt, &snapshot->bytesOut,
+            &snapshot->delivered, &snapshot->writes, &snapshot->blockedUs};
+    for (size_t i = 0; i < sizeof(from) / sizeof(from[0]); i++) {
+        *to[i] = __atomic_load_n(from[i], __ATOMIC_RELAXED);
+    }
+}
+
+void print_client_metrics(Server* server) {
+    take_lock(server->clientAccess);
+    fprintf(stderr, "@METRICS@\n");
+    for (Client* client = server->clientList; client != NULL;
+            client = client->next) {
+        ClientMetrics snapshot;
+        snapshot_client_metrics(client, &snapshot);
+        fprintf(stderr, "%s:BYTES_IN:%lld:MESSAGES_IN:%lld:BYTES_OUT:%lld:"
+                "DELIVERED:%lld:DEPTH:%lld:PEAK_DEPTH:%lld:DROPPED:%lld:"
+                "BLOCKED_US:%lld:RTT_US:%lld\n", client->name,
+                snapshot.bytesIn, snapshot.messagesIn, snapshot.bytesOut,
+                snapshot.delivered, snapshot.queueDepth,
+                snapshot.peakQueueDepth, snapshot.dropped,
+                snapshot.blockedUs, snapshot.rttUs);
+    }
+    release_lock(server->clientAccess);
+}
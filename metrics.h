@@ -0,0 +1,131 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "sharedutil.h"
+#include "server.h"
+#define CACHE_LINE 64
+
+/* The ClientMetrics datastructure holds the running totals which show how a
+ * single connection is behaving serverside. Every field is updated with
+ * atomic operations rather than under a lock, and the fields are grouped by
+ * the thread which mostly updates them, with each group on its own cache
+ * line, so that a client's reader and writer threads do not contend over the
+ * same line for every message. Two fields have a second writer: the writer
+ * thread lowers queueDepth as it takes each message (under the queue's lock,
+ * which the queueing threads hold as well), and the timer thread sets
+ * pingSentAt, at most once per ping interval.
+ *
+ * bytesIn/messagesIn: The bytes and messages read from the client.
+ *
+ * rttUs: How long (in microseconds) the client took to answer its last PING.
+ *
+ * pingSentAt: When the client was last sent PING which it has not yet
+ *  answered, or 0.
+ *
+ * queueDepth/peakQueueDepth: The number of messages waiting in the client's
+ *  outbound queue now, and the most there have ever been.
+ *
+ * dropped: The number of messages this client has had dropped.
+ *
+ * bytesOut: The bytes written to the client's socket.
+ *
+ * delivered: The number of messages written to this client.
+ *
+ * writes: The number of writes made to this client, each of which carries a
+ *  batch of one or more messages.
+ *
+ * blockedUs: The time (in microseconds) the writer has spent waiting for the
+ *  client's socket to have room.
+ */
+typedef struct ClientMetrics {
+    // Updated by the client's own thread (and pingSentAt by the timer)
+    volatile long long bytesIn __attribute__((aligned(CACHE_LINE)));
+    volatile long long messagesIn;
+    volatile long long rttUs;
+    volatile long long pingSentAt;
+
+    // Updated by any thread which queues a message for the client (and
+    // queueDepth by the writer), under the queue's lock
+    volatile long long queueDepth __attribute__((aligned(CACHE_LINE)));
+    volatile long long peakQueueDepth;
+    volatile long long dropped;
+
+    // Updated by the client's writer thread
+    volatile long long bytesOut __attribute__((aligned(CACHE_LINE)));
+    volatile long long delivered;
+    volatile long long writes;
+    volatile long long blockedUs;
+} ClientMetrics;
+
+/* The add_metric function adds to a metric without taking a lock.
+ *
+ * Parameters:
+ *      metric - The metric to add to
+ *      amount - The amount to add, which may be negative
+ */
+static inline void add_metric(volatile long long* metric, long long amount) {
+    __atomic_add_fetch(metric, amount, __ATOMIC_RELAXED);
+}
+
+/* The set_metric function sets a metric without taking a lock.
+ *
+ * Parameters:
+ *      metric - The metric to set
+ *      value - The metric's new value
+ */
+static inline void set_metric(volatile long long* metric, long long value) {
+    __atomic_store_n(metric, value, __ATOMIC_RELAXED);
+}
+
+/* The raise_metric function raises a metric to a value, if the value is
+ * higher, without taking a lock.
+ *
+ * Parameters:
+ *      metric - The metric to raise
+ *      value - The value to raise it to
+ */
+static inline void raise_metric(volatile long long* metric, long long value) {
+    long long current = __atomic_load_n(metric, __ATOMIC_RELAXED);
+    while (value > current && !__atomic_compare_exchange_n(metric, &current,
+            value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+/* The create_client_metrics function allocates a new, cache line aligned set
+ * of metrics with every metric at 0.
+ *
+ * Returns:
+ *      (ClientMetrics*) - The new metrics, which are freed with free
+ */
+ClientMetrics* create_client_metrics(void);
+
+/* The record_pong function records a client's round trip time when it
+ * answers PING, measured from the first PING it left unanswered.
+ *
+ * Parameters:
+ *      client - The client which sent PONG
+ */
+void record_pong(Client* client);
+
+/* The snapshot_client_metrics function copies a client's metrics, so that they
+ * can be read at leisure while the client carries on updating its own. Each
+ * metric is copied atomically, but they are not copied all at the same
+ * instant.
+ *
+ * Parameters:
+ *      client - The client whose metrics are copied
+ *      snapshot - Where the metrics are copied to
+ */
+void snapshot_client_metrics(Client* client, ClientMetrics* snapshot);
+
+/* The print_client_metrics function prints the metrics of every client in
+ * the server's client list under a @METRICS@ heading.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ */
+void print_client_metrics(Server* server);
+#endif
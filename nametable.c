@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/random.h>
+#include "server.h"
+#include "sharedutil.h"
+#include "federation.h"
+#include "nametable.h"
+
+/* Finds the entry for the first length bytes of a name, or NULL if that name
+ * is not in use.
+ */
+static NameEntry* find_name(NameTable* table, char* name, size_t length) {
+    unsigned long long hash = hash_seeded(table->seed, name, length);
+    NameEntry* entry = table->buckets[hash & (table->numBuckets - 1)];
+    while (entry != NULL && (entry->hash != hash ||
+            strncmp(entry->name, name, length) ||
+            entry->name[length] != '\0')) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+NameTable* create_name_table(void) {
+    NameTable* table = malloc(sizeof(NameTable));
+    if (getrandom(&table->seed, sizeof(table->seed), 0) !=
+            sizeof(table->seed)) {
+        table->seed = (unsigned long long) current_time_us();
+    }
+    table->numBuckets = NAME_TABLE_INITIAL;
+    table->buckets = calloc(table->numBuckets, sizeof(NameEntry*));
+    table->numNames = 0;
+    return table;
+}
+
+/* Doubles the number of buckets in the table, moving every entry into its
+ * new bucket.
+ */
+static void grow_name_table(NameTable* table) {
+    int numBuckets = table->numBuckets * 2;
+    NameEntry** buckets = calloc(numBuckets, sizeof(NameEntry*));
+    for (int i = 0; i < table->numBuckets; i++) {
+        NameEntry* entry = table->buckets[i];
+        while (entry != NULL) {
+            NameEntry* next = entry->next;
+            NameEntry** bucket = &buckets[entry->hash & (numBuckets - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->numBuckets = numBuckets;
+}
+
+void add_client_name(NameTable* table, char* name) {
+    if (table->numNames >= table->numBuckets) {
+        grow_name_table(table);
+    }
+
+    NameEntry* entry = malloc(sizeof(NameEntry));
+    entry->name = strdup(name);
+    entry->hash = hash_seeded(table->seed, name, strlen(name));
+    entry->nextSuffix = 0;
+    NameEntry** bucket =
+            &table->buckets[entry->hash & (table->numBuckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    table->numNames++;
+}
+
+void remove_client_name(NameTable* table, char* name) {
+    size_t length = strlen(name);
+    unsigned long long hash = hash_seeded(table->seed, name, length);
+    NameEntry** link = &table->buckets[hash & (table->numBuckets - 1)];
+    while (*link != NULL &&
+            ((*link)->hash != hash || strcmp((*link)->name, name))) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return;
+    }
+    NameEntry* entry = *link;
+    *link = entry->next;
+    free(entry->name);
+    free(entry);
+    table->numNames--;
+
+    // Split off the suffix, which must be written the way assign_client_name
+    // writes it, and offer it again if it is below its base name's next
+    size_t digits = length;
+    while (digits > 0 && isdigit((unsigned char) name[digits - 1])) {
+        digits--;
+    }
+    if (digits == 0 || digits == length || length - digits > 9 ||
+            (name[digits] == '0' && length - digits > 1)) {
+        return;
+    }
+    int suffix = atoi(name + digits);
+    NameEntry* base = find_name(table, name, digits);
+    if (base != NULL && suffix < base->nextSuffix) {
+        base->nextSuffix = suffix;
+    }
+}
+
+int is_name_taken(Server* server, char* name) {
+    return find_name(server->nameTable, name, strlen(name)) != NULL ||
+            is_remote_name(server, name);
+}
+
+char* assign_client_name(Server* server, char* name) {
+    if (!is_name_taken(server, name)) {
+        return strdup(name);
+    }
+
+    // The name may only be taken in a linked server, in which case there is
+    // nowhere to remember the search from
+    NameEntry* base = find_name(server->nameTable, name, strlen(name));
+    char* candidate = malloc(strlen(name) + 12);
+    for (int suffix = base != NULL ? base->nextSuffix : 0; suffix < INT_MAX;
+            suffix++) {
+        sprintf(candidate, "%s%d", name, suffix);
+        if (!is_name_taken(server, candidate)) {
+            if (base != NULL) {
+                base->nextSuffix = suffix + 1;
+            }
+            break;
+        }
+    }
+    return candidate;
+}
@@ -0,0 +1,108 @@
+#ifndef NAMETABLE_H
+#define NAMETABLE_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "sharedutil.h"
+#include "server.h"
+#define NAME_TABLE_INITIAL 256
+
+/* The NameEntry datastructure holds one name in use by a client in the
+ * server's client list.
+ *
+ * name: The client's name.
+ *
+ * hash: The hash of name, kept so that the table can grow without hashing
+ *  every name again.
+ *
+ * nextSuffix: The lowest suffix which may still be free for names built on
+ *  this one, e.g. 3 if bot0, bot1 and bot2 have been handed out after bot.
+ *  Every suffix below it was in use when it was last looked at.
+ *
+ * next: A pointer to the next entry in the same bucket.
+ */
+typedef struct NameEntry {
+    char* name;
+    unsigned long long hash;
+    int nextSuffix;
+    struct NameEntry* next;
+} NameEntry;
+
+/* The NameTable datastructure holds the names of every client in the
+ * server's client list in a hash table, so that a name is checked without
+ * walking the list, and so that a client asking for a taken name can be
+ * given the next free one straight away. The table is only changed or read
+ * while holding the server's clientAccess.
+ *
+ * seed: A random seed mixed into every hash, so that clients cannot choose
+ *  names which all land in the same bucket.
+ *
+ * buckets: The hash buckets, each a linked list of NameEntries.
+ *
+ * numBuckets: The number of buckets, which is always a power of 2.
+ *
+ * numNames: The number of names in the table. The table doubles its buckets
+ *  once there are more names than buckets.
+ */
+typedef struct NameTable {
+    unsigned long long seed;
+    NameEntry** buckets;
+    int numBuckets;
+    int numNames;
+} NameTable;
+
+/* The create_name_table function initialises an empty name table with
+ * NAME_TABLE_INITIAL buckets.
+ *
+ * Returns:
+ *      (NameTable*) - The newly allocated table
+ */
+NameTable* create_name_table(void);
+
+/* The add_client_name function records a name as in use by a client.
+ *
+ * Parameters:
+ *      table - The server's name table
+ *      name - The name, which is copied
+ */
+void add_client_name(NameTable* table, char* name);
+
+/* The remove_client_name function records that a name is no longer in use.
+ * If the name is a suffixed name (such as bot7) whose base name is still in
+ * use, then the suffix is offered again by the next assign_client_name.
+ *
+ * Parameters:
+ *      table - The server's name table
+ *      name - The name to remove
+ */
+void remove_client_name(NameTable* table, char* name);
+
+/* The is_name_taken function checks whether a name is in use by a client in
+ * this server, or in any server it is federated with.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      name - The name to check
+ *
+ * Returns:
+ *      (int) 0 - if the name is free
+ *      (int) 1 - if the name is taken
+ */
+int is_name_taken(Server* server, char* name);
+
+/* The assign_client_name function finds the name a client asking for a name
+ * would end up with under the NAME_TAKEN loop: the name itself if it is free,
+ * and otherwise the first of name0, name1, name2... which is free. Names
+ * are picked up from where the last search on the same name left off, so
+ * the hundredth client asking for the same name does not try the first 99
+ * names again.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      name - The name the client asked for
+ *
+ * Returns:
+ *      (char*) - A newly allocated copy of the free name
+ */
+char* assign_client_name(Server* server, char* name);
+#endif
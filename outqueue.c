@@ -0,0 +1,636 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "serverutil.h"
+#include "sharedutil.h"
+#include "outqueue.h"
+#include "sharedring.h"
+
+void create_out_queue(Server* server, Client* client) {
+    OutQueue* queue = malloc(sizeof(OutQueue));
+    queue->server = server;
+    queue->client = client;
+    queue->socket = client->socket;
+
+    queue->queueAccess = create_lock(malloc(sizeof(sem_t)));
+    queue->messagesReady = malloc(sizeof(sem_t));
+    sem_init(queue->messagesReady, 0, 0);
+    queue->writerIdle = malloc(sizeof(sem_t));
+    sem_init(queue->writerIdle, 0, 0);
+    queue->writerResume = malloc(sizeof(sem_t));
+    sem_init(queue->writerResume, 0, 0);
+    for (int i = 0; i < NUM_LANES; i++) {
+        queue->lanes[i].head = NULL;
+        queue->lanes[i].tail = NULL;
+        queue->lanes[i].queuedBytes = 0;
+    }
+    queue->queuedBytes = 0;
+
+    queue->isLagging = 0;
+    queue->isEvicted = 0;
+    queue->isClosed = 0;
+    queue->isPaused = 0;
+    queue->isCompressing = 0;
+    queue->isSharing = 0;
+    queue->isSequenced = 0;
+    queue->isChunked = 0;
+    queue->isBatched = 0;
+    queue->metrics = create_client_metrics();
+
+    client->metrics = queue->metrics;
+    client->outQueue = queue;
+    pthread_create(&queue->writer, 0, drain_out_queue, client);
+}
+
+/* Frees a message which has been written or thrown away.
+ */
+static void free_message(QueuedMessage* message) {
+#ifdef TRACE
+    trace_release(message->span);
+#endif
+    free(message->text);
+    free(message);
+}
+
+/* Removes the oldest message from one of a queue's lanes and returns it, or
+ * returns NULL if the lane is empty. The queue's lock must be held by the
+ * caller.
+ */
+static QueuedMessage* pop_message(OutQueue* queue, int lane) {
+    Lane* from = &queue->lanes[lane];
+    QueuedMessage* message = from->head;
+    if (message != NULL) {
+        from->head = message->next;
+        if (from->head == NULL) {
+            from->tail = NULL;
+        }
+        from->queuedBytes -= message->length;
+        queue->queuedBytes -= message->length;
+        set_metric(&queue->metrics->queueDepth,
+                queue->metrics->queueDepth - 1);
+    }
+    return message;
+}
+
+/* Appends a message to the end of one of a queue's lanes, to be compressed
+ * (or written to the client's rings) if the client has negotiated compression
+ * (or shared memory). The queue's lock must be held by the caller.
+ */
+static void push_message(OutQueue* queue, QueuedMessage* message, int lane) {
+    Lane* to = &queue->lanes[lane];
+    message->next = NULL;
+    message->isCompressed = queue->isCompressing;
+    message->isShared = queue->isSharing;
+    if (to->tail == NULL) {
+        to->head = message;
+    } else {
+        to->tail->next = message;
+    }
+    to->tail = message;
+    to->queuedBytes += message->length;
+    queue->queuedBytes += message->length;
+
+    long long depth = queue->metrics->queueDepth + 1;
+    set_metric(&queue->metrics->queueDepth, depth);
+    raise_metric(&queue->metrics->peakQueueDepth, depth);
+}
+
+/* Returns whether every lane of a queue is empty. The queue's lock must be
+ * held by the caller.
+ */
+static int is_queue_empty(OutQueue* queue) {
+    for (int i = 0; i < NUM_LANES; i++) {
+        if (queue->lanes[i].head != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Frees every message in a queue, returning the number of messages freed.
+ * The queue's lock must be held by the caller.
+ */
+static int discard_messages(OutQueue* queue) {
+    int discarded = 0;
+    QueuedMessage* message;
+    for (int i = 0; i < NUM_LANES; i++) {
+        while ((message = pop_message(queue, i)) != NULL) {
+            free_message(message);
+            discarded++;
+        }
+    }
+    return discarded;
+}
+
+/* Copies a message into a newly allocated QueuedMessage, with its trailing
+ * newline, and sanitises it.
+ */
+static QueuedMessage* create_message(char* message) {
+    QueuedMessage* queued = malloc(sizeof(QueuedMessage));
+    queued->length = strlen(message) + 1;
+    queued->text = malloc(queued->length + 1);
+    sprintf(queued->text, "%s\n", message);
+    sanitise_message(queued->text);
+    queued->queuedAt = current_time_us();
+#ifdef TRACE
+    queued->span = trace_attach();
+#endif
+    return queued;
+}
+
+int queue_message(Client* client, char* message) {
+    return enqueue_message(client->outQueue, message);
+}
+
+int enqueue_message(OutQueue* queue, char* message) {
+
+    if (message == NULL || queue->isEvicted || queue->isClosed) {
+        return 0;
+    }
+
+    ServerOptions* options = queue->server->options;
+
+    // Copy and sanitise the message before taking the lock
+    QueuedMessage* queued = create_message(message);
+
+    int dropped = 0;
+    take_lock(queue->queueAccess);
+
+    if (queue->isEvicted || queue->isClosed) {
+        release_lock(queue->queueAccess);
+        free_message(queued);
+        return 0;
+    }
+
+    // Only the bulk lane counts towards the water marks, so control messages
+    // can neither be dropped nor cause bulk ones to be
+    Lane* bulk = &queue->lanes[LANE_BULK];
+    if (bulk->queuedBytes + queued->length > options->highWater) {
+        queue->isLagging = 1;
+        if (options->slowPolicy == DISCONNECT) {
+            release_lock(queue->queueAccess);
+            free_message(queued);
+            evict_client(queue->client, "SLOW");
+            return 0;
+        }
+    }
+
+    if (queue->isLagging && options->slowPolicy == DROP_NEW) {
+        // Drop this message, the writer will clear the lag once it catches up
+        free_message(queued);
+        queued = NULL;
+        dropped++;
+
+    } else if (queue->isLagging && options->slowPolicy == DROP_OLDEST) {
+        // Make room by dropping the oldest messages down to the low water mark
+        QueuedMessage* oldest;
+        while (bulk->queuedBytes + queued->length > options->lowWater &&
+                (oldest = pop_message(queue, LANE_BULK)) != NULL) {
+            free_message(oldest);
+            dropped++;
+        }
+        queue->isLagging = 0;
+    }
+
+    // The writer only needs waking when the queue was empty, otherwise it is
+    // still working through the queue and will pick this message up
+    int wasEmpty = is_queue_empty(queue);
+    if (queued != NULL) {
+        push_message(queue, queued, LANE_BULK);
+    }
+    add_metric(&queue->metrics->dropped, dropped);
+    release_lock(queue->queueAccess);
+
+    for (int i = 0; i < dropped; i++) {
+        add_to_server_stats(queue->server, STAT_DROP);
+    }
+    if (queued != NULL && wasEmpty) {
+        sem_post(queue->messagesReady);
+    }
+    return queued != NULL;
+}
+
+int queue_control_message(Client* client, char* message) {
+    OutQueue* queue = client->outQueue;
+    if (message == NULL || queue->isEvicted || queue->isClosed) {
+        return 0;
+    }
+
+    QueuedMessage* queued = create_message(message);
+    take_lock(queue->queueAccess);
+    if (queue->isEvicted || queue->isClosed) {
+        release_lock(queue->queueAccess);
+        free_message(queued);
+        return 0;
+    }
+    int wasEmpty = is_queue_empty(queue);
+    push_message(queue, queued, LANE_CONTROL);
+    release_lock(queue->queueAccess);
+
+    if (wasEmpty) {
+        sem_post(queue->messagesReady);
+    }
+    return 1;
+}
+
+void evict_client(Client* client, char* reason) {
+    char notice[strlen(reason) + 5];
+    sprintf(notice, "ERR:%s", reason);
+    if (disconnect_client(client, notice)) {
+        add_to_server_stats(client->outQueue->server, STAT_EVICT);
+    }
+}
+
+int disconnect_client(Client* client, char* notice) {
+    OutQueue* queue = client->outQueue;
+
+    take_lock(queue->queueAccess);
+    if (queue->isEvicted || queue->isClosed) {
+        release_lock(queue->queueAccess);
+        return 0;
+    }
+
+    // Nothing else will be sent to this client, other than the notice
+    int discarded = discard_messages(queue);
+    QueuedMessage* queued = malloc(sizeof(QueuedMessage));
+    queued->text = malloc(strlen(notice) + 2);
+    queued->length = sprintf(queued->text, "%s\n", notice);
+    queued->queuedAt = current_time_us();
+#ifdef TRACE
+    queued->span = NULL;
+#endif
+    push_message(queue, queued, LANE_CONTROL);
+
+    add_metric(&queue->metrics->dropped, discarded);
+    queue->isEvicted = 1;
+    client->isCommunicating = 0;
+    release_lock(queue->queueAccess);
+
+    for (int i = 0; i < discarded; i++) {
+        add_to_server_stats(queue->server, STAT_DROP);
+    }
+    sem_post(queue->messagesReady);
+    return 1;
+}
+
+/* Writes a batch of messages to a queue's socket (or to the client's rings,
+ * if the batch is shared) without ever blocking indefinitely. Whenever either
+ * is full, the writer waits for at most WRITER_POLL_MS before checking
+ * whether the client has been evicted, closed or paused in the meantime, in
+ * which case the rest of the batch is abandoned. The number of bytes left
+ * unwritten is returned through length.
+ *
+ * Returns 1 if the whole batch was written, 0 if it was abandoned, or -1 if
+ * the connection has failed.
+ */
+static int write_batch(OutQueue* queue, char* batch, size_t* length,
+        int isShared) {
+    SharedRings* rings = queue->client->rings;
+    struct pollfd pollSocket = {.fd = queue->socket, .events = POLLOUT};
+
+    while (*length > 0) {
+        ssize_t written = isShared ? ring_send(rings, batch, *length) :
+                send(queue->socket, batch, *length,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written >= 0) {
+            batch += written;
+            *length -= written;
+            add_metric(&queue->metrics->bytesOut, written);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (queue->isEvicted || queue->isClosed || queue->isPaused) {
+                return 0;
+            }
+            long long blockedAt = current_time_us();
+            int isGone = 0;
+            if (isShared) {
+                isGone = wait_for_ring(rings, queue->socket, POLLOUT,
+                        WRITER_POLL_MS) < 0 && errno == EPIPE;
+            } else {
+                poll(&pollSocket, 1, WRITER_POLL_MS);
+            }
+            add_metric(&queue->metrics->blockedUs,
+                    current_time_us() - blockedAt);
+            if (isGone) {
+                return -1;
+            }
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* Sleeps until the oldest bulk message in a queue has been waiting for the
+ * server's coalescing window, so that any messages queued in the meantime are
+ * flushed in the same batch. Control messages are written straight away.
+ */
+static void wait_for_window(OutQueue* queue, long long window) {
+    take_lock(queue->queueAccess);
+    QueuedMessage* oldest = queue->lanes[LANE_BULK].head;
+    long long deadline = oldest == NULL ||
+            queue->lanes[LANE_CONTROL].head != NULL ? 0 :
+            oldest->queuedAt + window;
+    release_lock(queue->queueAccess);
+
+    long long now = current_time_us();
+    if (deadline > now) {
+        usleep((useconds_t) (deadline - now));
+    }
+}
+
+/* Picks the lane the writer takes its next batch from. Control messages go
+ * ahead of bulk ones, unless the oldest bulk message was queued before the
+ * connection moved onto compression (or shared memory) and the oldest control
+ * message after, as every byte sent the old way must reach the client first.
+ * The queue's lock must be held by the caller.
+ */
+static int next_lane(OutQueue* queue) {
+    QueuedMessage* control = queue->lanes[LANE_CONTROL].head;
+    QueuedMessage* bulk = queue->lanes[LANE_BULK].head;
+    if (control == NULL || (bulk != NULL &&
+            (bulk->isCompressed < control->isCompressed ||
+            bulk->isShared < control->isShared))) {
+        return LANE_BULK;
+    }
+    return LANE_CONTROL;
+}
+
+void* drain_out_queue(void* args) {
+    Client* client = (Client*) args;
+    OutQueue* queue = client->outQueue;
+    ServerOptions* options = queue->server->options;
+    char batch[MAX_BATCH];
+    int isPending = 0;
+    int isConnected = 1;
+    int isShutdown = 0;
+#ifdef TRACE
+    // The traced messages in the current batch, which are only finished with
+    // once the batch has been written
+    int numSpans = 0;
+    int spanCapacity = 0;
+    TraceSpan** spans = NULL;
+#endif
+
+    while (1) {
+        // Only wait if the last batch emptied the queue
+        if (!isPending) {
+            sem_wait(queue->messagesReady);
+        }
+
+        // A paused writer stays idle until it is resumed (or closed)
+        if (queue->isPaused && !queue->isClosed) {
+            sem_post(queue->writerIdle);
+            sem_wait(queue->writerResume);
+            isPending = 1;
+            continue;
+        }
+
+        if (options->coalesceWindow > 0) {
+            wait_for_window(queue, options->coalesceWindow);
+        }
+
+        take_lock(queue->queueAccess);
+        if (queue->isClosed) {
+            release_lock(queue->queueAccess);
+            break;
+        }
+
+        // Take as many messages from one lane as fit into a single batch,
+        // never mixing messages sent before and after compression (or shared
+        // memory) was negotiated
+        int lane = next_lane(queue);
+        Lane* from = &queue->lanes[lane];
+        size_t batchLength = 0;
+        int batchCount = 0;
+        int isCompressed = from->head != NULL && from->head->isCompressed;
+        int isShared = from->head != NULL && from->head->isShared;
+        while (from->head != NULL && 
+                batchLength + from->head->length <= MAX_BATCH &&
+                from->head->isCompressed == isCompressed &&
+                from->head->isShared == isShared) {
+            QueuedMessage* message = pop_message(queue, lane);
+            memcpy(batch + batchLength, message->text, message->length);
+            batchLength += message->length;
+            batchCount++;
+#ifdef TRACE
+            if (message->span != NULL) {
+                if (numSpans == spanCapacity) {
+                    spanCapacity = spanCapacity * 2 + 1;
+                    spans = realloc(spans, sizeof(TraceSpan*) * spanCapacity);
+                }
+                spans[numSpans++] = message->span;
+                message->span = NULL;
+            }
+#endif
+            free_message(message);
+        }
+        if (queue->isLagging &&
+                queue->lanes[LANE_BULK].queuedBytes <= options->lowWater) {
+            queue->isLagging = 0;
+        }
+        isPending = !is_queue_empty(queue);
+        int isEvicted = queue->isEvicted;
+        release_lock(queue->queueAccess);
+
+        // Once the socket fails, messages are simply discarded until the
+        // client's own thread notices and closes the queue
+        if (batchLength > 0 && isConnected) {
+            char* compressed = NULL;
+            size_t remaining = batchLength;
+            if (isCompressed) {
+                compressed = compress_bytes(client->compression, batch, 
+                        batchLength, &remaining);
+            }
+            int result = write_batch(queue, 
+                    isCompressed ? compressed : batch, &remaining, isShared);
+            free(compressed);
+            if (result > 0) {
+                add_metric(&queue->metrics->writes, 1);
+                add_metric(&queue->metrics->delivered, batchCount);
+            } else if (result < 0) {
+                isConnected = 0;
+            } else if (queue->isPaused && !isEvicted && !isCompressed &&
+                    !isShared) {
+                // Keep whatever was not written at the front of the queue, so
+                // that nothing else can be written part way through it
+                restore_unsent_messages(client, 
+                        batch + batchLength - remaining, remaining, 1);
+            }
+        }
+
+#ifdef TRACE
+        for (int i = 0; i < numSpans; i++) {
+            trace_release(spans[i]);
+        }
+        numSpans = 0;
+#endif
+
+        // An evicted client has been sent its reason, so disconnect it. Its
+        // thread will then read EOF and leave as normal.
+        if (isEvicted && !isShutdown) {
+            shutdown(queue->socket, SHUT_RDWR);
+            isShutdown = 1;
+        }
+    }
+
+#ifdef TRACE
+    free(spans);
+#endif
+    return NULL;
+}
+
+void pause_out_queue(Client* client) {
+    OutQueue* queue = client->outQueue;
+
+    take_lock(queue->queueAccess);
+    queue->isPaused = 1;
+    release_lock(queue->queueAccess);
+
+    sem_post(queue->messagesReady);
+    sem_wait(queue->writerIdle);
+}
+
+void resume_out_queue(Client* client) {
+    OutQueue* queue = client->outQueue;
+
+    take_lock(queue->queueAccess);
+    queue->isPaused = 0;
+    release_lock(queue->queueAccess);
+
+    sem_post(queue->writerResume);
+}
+
+char* take_unsent_messages(Client* client, size_t* length) {
+    OutQueue* queue = client->outQueue;
+
+    take_lock(queue->queueAccess);
+    char* unsent = malloc(queue->queuedBytes + 1);
+    *length = 0;
+    QueuedMessage* message;
+    for (int i = 0; i < NUM_LANES; i++) {
+        while ((message = pop_message(queue, i)) != NULL) {
+            memcpy(unsent + *length, message->text, message->length);
+            *length += message->length;
+            free_message(message);
+        }
+    }
+    release_lock(queue->queueAccess);
+
+    return unsent;
+}
+
+void compress_out_queue(Client* client) {
+    OutQueue* queue = client->outQueue;
+
+    take_lock(queue->queueAccess);
+    queue->isCompressing = 1;
+    release_lock(queue->queueAccess);
+}
+
+void share_out_queue(Client* client) {
+    OutQueue* queue = client->outQueue;
+
+    take_lock(queue->queueAccess);
+    queue->isSharing = 1;
+    release_lock(queue->queueAccess);
+}
+
+void restore_unsent_messages(Client* client, char* unsent, size_t length,
+        int atFront) {
+    OutQueue* queue = client->outQueue;
+
+    // Split the bytes into chunks which each fit into a single batch
+    QueuedMessage* first = NULL;
+    QueuedMessage* last = NULL;
+    size_t restoredBytes = 0;
+    int numChunks = 0;
+    while (restoredBytes < length) {
+        size_t chunkLength = length - restoredBytes < MAX_BATCH ?
+                length - restoredBytes : MAX_BATCH;
+        QueuedMessage* chunk = malloc(sizeof(QueuedMessage));
+        chunk->text = malloc(chunkLength + 1);
+        memcpy(chunk->text, unsent + restoredBytes, chunkLength);
+        chunk->text[chunkLength] = '\0';
+        chunk->length = chunkLength;
+        chunk->queuedAt = current_time_us();
+        chunk->isCompressed = 0;
+        chunk->isShared = 0;
+#ifdef TRACE
+        chunk->span = NULL;
+#endif
+        chunk->next = NULL;
+        if (last == NULL) {
+            first = chunk;
+        } else {
+            last->next = chunk;
+        }
+        last = chunk;
+        restoredBytes += chunkLength;
+        numChunks++;
+    }
+    if (first == NULL) {
+        return;
+    }
+
+    take_lock(queue->queueAccess);
+    Lane* control = &queue->lanes[LANE_CONTROL];
+    int wasEmpty = is_queue_empty(queue);
+    if (atFront || control->tail == NULL) {
+        last->next = control->head;
+        control->head = first;
+        if (control->tail == NULL) {
+            control->tail = last;
+        }
+    } else {
+        control->tail->next = first;
+        control->tail = last;
+    }
+    control->queuedBytes += length;
+    queue->queuedBytes += length;
+    long long depth = queue->metrics->queueDepth + numChunks;
+    set_metric(&queue->metrics->queueDepth, depth);
+    raise_metric(&queue->metrics->peakQueueDepth, depth);
+    release_lock(queue->queueAccess);
+
+    if (wasEmpty) {
+        sem_post(queue->messagesReady);
+    }
+}
+
+void destroy_out_queue(Client* client) {
+    OutQueue* queue = client->outQueue;
+    if (queue == NULL) {
+        return;
+    }
+
+    take_lock(queue->queueAccess);
+    queue->isClosed = 1;
+    release_lock(queue->queueAccess);
+
+    // Shutting down the socket guarantees the writer cannot stay blocked
+    shutdown(queue->socket, SHUT_RDWR);
+    sem_post(queue->messagesReady);
+    sem_post(queue->writerResume);
+    pthread_join(queue->writer, NULL);
+
+    discard_messages(queue);
+    sem_destroy(queue->messagesReady);
+    sem_destroy(queue->writerIdle);
+    sem_destroy(queue->writerResume);
+    free(queue->messagesReady);
+    free(queue->writerIdle);
+    free(queue->writerResume);
+    free(queue->queueAccess);
+    free(queue->metrics);
+    free(queue);
+    client->outQueue = NULL;
+    client->metrics = NULL;
+}
@@ -0,0 +1,340 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+#include "trace.h"
+#include "metrics.h"
+#define WRITER_POLL_MS 100
+#define MAX_BATCH 65536
+
+/* The QueuedMessage datastructure holds a single message waiting in a
+ * client's outbound queue serverside.
+ *
+ * text: The sanitised message, including its trailing newline.
+ *
+ * length: The number of bytes in text (excluding the null terminator).
+ *
+ * queuedAt: The monotonic time (in microseconds) at which the message was
+ *  queued, used to decide when a coalesced batch is due.
+ *
+ * isCompressed: Whether the message was queued after the client negotiated
+ *  compression, in which case the writer compresses it.
+ *
+ * isShared: Whether the message was queued after the client moved onto shared
+ *  memory rings, in which case the writer writes it to the rings.
+ *
+ * span: The latency trace of the broadcast this message is a copy of, or
+ *  NULL (only when built with TRACE).
+ *
+ * next: A pointer to the next (more recently queued) message.
+ */
+typedef struct QueuedMessage {
+    char* text;
+    size_t length;
+    long long queuedAt;
+    int isCompressed;
+    int isShared;
+#ifdef TRACE
+    TraceSpan* span;
+#endif
+    struct QueuedMessage* next;
+} QueuedMessage;
+
+/* The Lanes enum holds the priority lanes of an outbound queue. Control
+ * messages (handshake replies, LIST: replies, PING: and the notice sent to a
+ * disconnected client) are written ahead of any bulk chat waiting in the same
+ * queue, and are never dropped by the slow consumer policy.
+ */
+enum Lanes {
+    LANE_CONTROL, LANE_BULK, NUM_LANES
+};
+
+/* The Lane datastructure holds the messages waiting in one priority lane of
+ * a client's outbound queue, in the order in which they were queued.
+ *
+ * head/tail: The oldest and newest messages in the lane.
+ *
+ * queuedBytes: The number of bytes currently waiting in the lane.
+ */
+typedef struct Lane {
+    QueuedMessage* head;
+    QueuedMessage* tail;
+    size_t queuedBytes;
+} Lane;
+
+/* The OutQueue datastructure holds all messages waiting to be written to a
+ * client serverside, so that a client which stops reading only ever blocks
+ * its own writer thread, and never the thread sending it a message.
+ *
+ * server: The server which owns the client, used to record drops and
+ *  evictions in the server's stats.
+ *
+ * client: The client which owns the queue.
+ *
+ * socket: The client's socket, which the writer thread writes to directly.
+ *
+ * writer: The writer thread which drains this queue.
+ *
+ * queueAccess: A lock that should be used when accessing any of the queue's
+ *  messages or counters.
+ *
+ * messagesReady: A semaphore posted whenever there is something for the
+ *  writer thread to do. Messages only post when they are queued on an empty
+ *  queue, as otherwise the writer is still busy and will find them itself.
+ *
+ * writerIdle/writerResume: Semaphores used to pause the writer thread. The
+ *  writer posts writerIdle once it has stopped, and waits on writerResume.
+ *
+ * lanes: The messages waiting in each lane, indexed by the Lanes enum.
+ *
+ * queuedBytes: The number of bytes currently waiting in the queue, across
+ *  both lanes.
+ *
+ * isLagging: Set once the bulk lane passes its high water mark, and cleared
+ *  once the writer has drained it below its low water mark. New messages are
+ *  dropped while a client is lagging under the DROP_NEW policy.
+ *
+ * isEvicted: Set when the client has been disconnected, after which no more
+ *  messages are accepted.
+ *
+ * isClosed: Set when the queue is being destroyed, telling the writer to exit.
+ *
+ * isPaused: Set while the writer thread has been asked to stop writing, so
+ *  that the queue can be handed to another process.
+ *
+ * isCompressing: Set once the client has negotiated compression, after which
+ *  every message queued is compressed by the writer before it is written.
+ *
+ * isSharing: Set once the client has moved onto shared memory rings, after
+ *  which every message queued is written to the rings rather than the socket.
+ *
+ * isSequenced: Set once the client holds a resumable session, after which it
+ *  is sent every broadcast prefixed with its sequence number. It is only
+ *  changed with the server's clientAccess held (see session.h).
+ *
+ * isChunked: Set once the client has asked for CAPS:CHUNKED, after which it
+ *  is sent long chat messages as MSGPART: frames (see fanout.h).
+ *
+ * isBatched: Set once the client has asked for CAPS:PRESENCE, after which it
+ *  is sent each batch of ENTER or LEAVE events as a single line (see
+ *  presence.h).
+ *
+ * metrics: The client's metrics, which the queue and its writer keep up to
+ *  date (see metrics.h).
+ */
+typedef struct OutQueue {
+    Server* server;
+    Client* client;
+    int socket;
+    pthread_t writer;
+
+    sem_t* queueAccess;
+    sem_t* messagesReady;
+    sem_t* writerIdle;
+    sem_t* writerResume;
+    Lane lanes[NUM_LANES];
+    size_t queuedBytes;
+
+    volatile int isLagging;
+    volatile int isEvicted;
+    volatile int isClosed;
+    volatile int isPaused;
+    volatile int isCompressing;
+    volatile int isSharing;
+    volatile int isSequenced;
+    volatile int isChunked;
+    volatile int isBatched;
+    ClientMetrics* metrics;
+} OutQueue;
+
+/* The create_out_queue function initialises an outbound queue for a newly
+ * connected client, along with the client's metrics, and starts the writer
+ * thread which drains it.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - The client which will have the queue attached
+ */
+void create_out_queue(Server* server, Client* client);
+
+/* The queue_message function sanitises a message and places it in the bulk
+ * lane of a client's outbound queue, without ever blocking on the client's
+ * socket. If this would take the lane past the server's high water mark, then
+ * the server's slow consumer policy is applied:
+ *
+ *  DROP_OLDEST - the oldest bulk messages are dropped until the lane is back
+ *      below the low water mark.
+ *  DROP_NEW - new messages are dropped until the writer has drained the lane
+ *      below the low water mark.
+ *  DISCONNECT - the queue is discarded, and the client is sent ERR:SLOW and
+ *      disconnected.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue
+ *      message - The message to send to the client
+ *
+ * Returns:
+ *      (int) 0 - if the message was dropped, or not specified
+ *      (int) 1 - if the message was queued
+ */
+int queue_message(Client* client, char* message);
+
+/* The enqueue_message function places a message on an outbound queue in the
+ * same way as queue_message, for callers which hold the queue rather than
+ * the client. A queue which has been evicted or closed is passed over without
+ * copying the message.
+ *
+ * Parameters:
+ *      queue - A client's outbound queue
+ *      message - The message to send to the client
+ *
+ * Returns:
+ *      (int) 0 - if the message was dropped, or not specified
+ *      (int) 1 - if the message was queued
+ */
+int enqueue_message(OutQueue* queue, char* message);
+
+/* The queue_control_message function sanitises a message and places it in the
+ * control lane of a client's outbound queue, so that it is written ahead of
+ * any bulk messages already waiting. Control messages are never dropped, so
+ * this should only be used for replies to the client's own commands, and
+ * not for anything a busy room could flood a client with. The one exception
+ * is a peer link, which is sent everything this way (see federation.h).
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue
+ *      message - The message to send to the client
+ *
+ * Returns:
+ *      (int) 0 - if the client has been disconnected, or no message was
+ *          specified
+ *      (int) 1 - if the message was queued
+ */
+int queue_control_message(Client* client, char* message);
+
+/* The evict_client function disconnects a client serverside. Any messages
+ * still waiting in its queue are discarded, and the writer thread sends the
+ * client an ERR message with the given reason (on a best effort basis),
+ * before shutting down the client's socket. The client's own thread then
+ * reaches EOF and leaves as normal.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue
+ *      reason - A short reason code sent to the client, e.g. "SLOW"
+ */
+void evict_client(Client* client, char* reason);
+
+/* The disconnect_client function disconnects a client serverside, in the same
+ * way as evict_client, but sends the client the given notice (such as KICK:)
+ * in place of an ERR message.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue
+ *      notice - The last message sent to the client
+ *
+ * Returns:
+ *      (int) 0 - if the client had already been disconnected
+ *      (int) 1 - if the client is being disconnected
+ */
+int disconnect_client(Client* client, char* notice);
+
+/* The drain_out_queue function is the main routine for a client's writer
+ * thread. It blocks until messages are queued, and writes them to the client's
+ * socket, taking every message queued in a lane (up to MAX_BATCH bytes) in a
+ * single write. The control lane is always drained first. Once the client has
+ * been evicted, the writer disconnects the client.
+ *
+ * If the server has a coalescing window, then the writer holds each batch
+ * back until its oldest message has waited for the window, so that busy rooms
+ * trade that bounded amount of latency for far fewer writes. Control messages
+ * are never held back.
+ *
+ * Parameters:
+ *      args - The client instance which owns the queue
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* drain_out_queue(void* args);
+
+/* The pause_out_queue function stops a client's writer thread, and blocks
+ * until it has stopped. If the writer was part way through a batch which the
+ * client is not reading, then the rest of the batch is put back at the front
+ * of the control lane, so that the queue holds exactly the bytes which have
+ * not been written to the client.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue
+ */
+void pause_out_queue(Client* client);
+
+/* The resume_out_queue function restarts a client's paused writer thread.
+ *
+ * Parameters:
+ *      client - A client instance with a paused outbound queue
+ */
+void resume_out_queue(Client* client);
+
+/* The compress_out_queue function compresses every message queued for a
+ * client from now on, once the client has negotiated compression. Messages
+ * already queued are still written uncompressed, ahead of them.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue and compression state
+ */
+void compress_out_queue(Client* client);
+
+/* The share_out_queue function writes every message queued for a client from
+ * now on to the client's shared memory rings, once the connection has moved
+ * onto them. Messages already queued are still written to the socket, ahead
+ * of them.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue and enabled rings
+ */
+void share_out_queue(Client* client);
+
+/* The take_unsent_messages function empties a client's outbound queue, and
+ * returns all of the bytes that were waiting in it, in the order the writer
+ * would have written them. The writer thread should be paused first.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue
+ *      length - Updated with the number of bytes returned
+ *
+ * Returns:
+ *      (char*) - A newly allocated buffer holding the unsent bytes
+ */
+char* take_unsent_messages(Client* client, size_t* length);
+
+/* The restore_unsent_messages function places bytes which have already been
+ * formatted as messages (such as those from take_unsent_messages) onto the
+ * control lane of a client's outbound queue, split into chunks which each fit
+ * into a batch. These bytes are not subject to the slow consumer policy, and
+ * are written ahead of any bulk messages.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue
+ *      unsent - The bytes to queue
+ *      length - The number of bytes to queue
+ *      atFront - Whether the bytes are placed at the front of the control
+ *          lane (1) or at the back (0)
+ */
+void restore_unsent_messages(Client* client, char* unsent, size_t length,
+        int atFront);
+
+/* The destroy_out_queue function stops a client's writer thread, and frees
+ * all memory given to its outbound queue, including any unsent messages. The
+ * client's socket is shut down first, so that the writer can never be left
+ * blocked on a client which has stopped reading.
+ *
+ * Parameters:
+ *      client - A client instance with an outbound queue
+ */
+void destroy_out_queue(Client* client);
+#endif
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "server.h"
+#include "sharedutil.h"
+#include "session.h"
+#include "fanout.h"
+#include "presence.h"
+
+Presence* create_presence(Server* server) {
+    Presence* presence = malloc(sizeof(Presence));
+    presence->command = 0;
+    presence->names[0] = '\0';
+    presence->numNames = 0;
+    presence->firstSequence = 0;
+    presence->openedAt = 0;
+    presence->batchOpened = malloc(sizeof(sem_t));
+    sem_init(presence->batchOpened, 0, 0);
+    server->presence = presence;
+
+    pthread_create(&presence->thread, 0, send_presence_batches, server);
+    pthread_detach(presence->thread);
+    return presence;
+}
+
+int hold_presence_event(Server* server, char* message) {
+    Presence* presence = server->presence;
+    int command = !strncmp(message, "ENTER:", strlen("ENTER:")) ? ENTER :
+            !strncmp(message, "LEAVE:", strlen("LEAVE:")) ? LEAVE : 0;
+    if (presence == NULL || server->options->presenceWindow == 0 ||
+            command == 0) {
+        return 0;
+    }
+    char* name = message + strlen("ENTER:");
+    if (*name == '\0' || strchr(name, ',') != NULL) {
+        return 0;
+    }
+
+    // Both prefixes are the same length, and a batch always leaves room for
+    // its prefix within MAX_FRAME. A name which could never fit is sent on
+    // its own by the caller, once any held events have been sent.
+    if (strlen(name) + 1 >= MAX_FRAME - strlen("ENTER:")) {
+        return 0;
+    }
+    if (presence->command != command || strlen(name) + 1 >=
+            MAX_FRAME - strlen("ENTER:") - strlen(presence->names)) {
+        flush_presence(server);
+    }
+
+    // Each event still takes its own place in the history, so that a client
+    // which resumes is sent exactly the events it missed
+    char* sequenced = record_broadcast(server->sessions, message);
+    if (presence->numNames == 0) {
+        presence->command = command;
+        presence->firstSequence = sequenced != NULL ?
+                server->sessions->lastSequence : 0;
+        presence->openedAt = current_time_us();
+        sem_post(presence->batchOpened);
+    }
+    strcat(strcat(presence->names, name), ",");
+    presence->numNames++;
+    return 1;
+}
+
+void flush_presence(Server* server) {
+    Presence* presence = server->presence;
+    if (presence == NULL || presence->numNames == 0) {
+        return;
+    }
+    char* prefix = presence->command == ENTER ? "ENTER:" : "LEAVE:";
+    unsigned long long lastSequence = presence->firstSequence +
+            presence->numNames - 1;
+
+    // Clients which asked for CAPS:PRESENCE are sent the whole batch as one
+    // line, without the last name's comma
+    char batched[MAX_FRAME];
+    char batchedSequenced[MAX_FRAME + 26];
+    sprintf(batched, "%s%.*s", prefix, (int) strlen(presence->names) - 1,
+            presence->names);
+    sprintf(batchedSequenced, "SEQ:%llu:%s", lastSequence, batched);
+
+    // Any other client is sent a line for each event, as a single message
+    size_t size = presence->numNames * (strlen(prefix) + 26) +
+            strlen(presence->names) + 1;
+    char* unbatched = malloc(size);
+    char* unbatchedSequenced = malloc(size);
+    char* plainEnd = unbatched;
+    char* sequencedEnd = unbatchedSequenced;
+    unsigned long long sequence = presence->firstSequence;
+    for (char* name = strtok(presence->names, ","); name != NULL;
+            name = strtok(NULL, ","), sequence++) {
+        plainEnd += sprintf(plainEnd, "%s%s%s",
+                plainEnd == unbatched ? "" : "\n", prefix, name);
+        sequencedEnd += sprintf(sequencedEnd, "%sSEQ:%llu:%s%s",
+                sequencedEnd == unbatchedSequenced ? "" : "\n", sequence,
+                prefix, name);
+    }
+
+    int hasSequence = presence->firstSequence != 0;
+    char* renditions[NUM_RENDITIONS];
+    for (int i = 0; i < NUM_RENDITIONS; i++) {
+        if (i & RENDER_UNBATCHED) {
+            renditions[i] = !(i & RENDER_SEQUENCED) ? unbatched :
+                    hasSequence ? unbatchedSequenced : NULL;
+        } else {
+            renditions[i] = !(i & RENDER_SEQUENCED) ? batched :
+                    hasSequence ? batchedSequenced : NULL;
+        }
+    }
+    fan_out_message(server, renditions);
+
+    free(unbatched);
+    free(unbatchedSequenced);
+    presence->command = 0;
+    presence->names[0] = '\0';
+    presence->numNames = 0;
+}
+
+void* send_presence_batches(void* args) {
+    Server* server = (Server*) args;
+    Presence* presence = server->presence;
+    long long window = server->options->presenceWindow;
+
+    while (1) {
+        while (sem_wait(presence->batchOpened) && errno == EINTR) {
+            ;
+        }
+
+        // The batch may have been sent early, and another opened, while
+        // waiting for the window to pass
+        long long wait = 0;
+        do {
+            usleep((useconds_t) wait);
+            take_lock(server->clientAccess);
+            wait = presence->numNames > 0 ?
+                    presence->openedAt + window - current_time_us() : 0;
+            if (presence->numNames > 0 && wait <= 0) {
+                flush_presence(server);
+            }
+            release_lock(server->clientAccess);
+        } while (wait > 0);
+    }
+    return NULL;
+}
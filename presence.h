@@ -0,0 +1,106 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+
+/* The Presence datastructure holds the ENTER or LEAVE events which the server
+ * is holding back, so that a storm of clients joining or leaving (e.g. all
+ * reconnecting after a restart) is sent to the room as a few messages rather
+ * than one for every client. Events are held for at most the server's
+ * presence window, and are sent as soon as anything else is broadcast, so
+ * the room always sees every broadcast in the order it was made.
+ *
+ * Clients which asked for CAPS:PRESENCE are sent each batch as a single
+ * ENTER:<name>,<name>,... or LEAVE:<name>,<name>,..., which always fits
+ * within MAX_FRAME. Other clients are sent an ENTER:<name> or LEAVE:<name>
+ * line for each event, but still as a single message on their queue. Every
+ * event is kept in the history of broadcasts with a sequence number of its
+ * own, and a sequenced batch carries the sequence number of its last event.
+ * The batch is only changed or sent while holding the server's clientAccess.
+ *
+ * command: ENTER or LEAVE, whichever all of the held events are, or 0 if no
+ *  events are held.
+ *
+ * names: The names of the clients in the held events, in order, each followed
+ *  by a comma.
+ *
+ * numNames: The number of held events.
+ *
+ * firstSequence: The sequence number of the first held event, or 0 if the
+ *  server keeps no history.
+ *
+ * openedAt: The monotonic time (in microseconds) at which the first held
+ *  event was made.
+ *
+ * batchOpened: Posted whenever an event is held while none were, waking the
+ *  thread which sends batches once their window has passed.
+ *
+ * thread: The thread which sends batches once their window has passed.
+ */
+typedef struct Presence {
+    int command;
+    char names[MAX_FRAME];
+    int numNames;
+    unsigned long long firstSequence;
+    long long openedAt;
+    sem_t* batchOpened;
+    pthread_t thread;
+} Presence;
+
+/* The create_presence function initialises an empty presence batch as the
+ * server's presence, and starts the thread which sends it once the server's
+ * presence window has passed.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *
+ * Returns:
+ *      (Presence*) - The newly started presence batch
+ */
+Presence* create_presence(Server* server);
+
+/* The hold_presence_event function holds an ENTER or LEAVE broadcast back to
+ * be sent along with any others made within the server's presence window,
+ * and records it in the history of broadcasts. Any held events of the other
+ * kind, or which the new event would not fit alongside, are sent first. The
+ * caller must hold clientAccess.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      message - The message being broadcast
+ *
+ * Returns:
+ *      (int) 0 - if the message is not a presence event, the server has no
+ *          presence window, or the name cannot be batched (e.g. it holds a
+ *          comma), so it should be broadcast as normal
+ *      (int) 1 - if the event has been held
+ */
+int hold_presence_event(Server* server, char* message);
+
+/* The flush_presence function sends every held presence event to the room
+ * straight away, e.g. before anything else is broadcast, or before a client
+ * which resumes its session is sent the broadcasts it missed. The caller must
+ * hold clientAccess.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ */
+void flush_presence(Server* server);
+
+/* The send_presence_batches function is the main routine for the presence
+ * batch's thread. It waits for events to be held, and sends them once the
+ * first has waited for the server's presence window.
+ *
+ * Parameters:
+ *      args - An instance of the main server datastructure
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* send_presence_batches(void* args);
+#endif
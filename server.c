@@ -10,21 +10,44 @@
 #include <semaphore.h>
 #include <netdb.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
 #include "server.h"
 #include "serverutil.h"
 #include "sharedutil.h"
+#include "outqueue.h"
+#include "handoff.h"
+#include "federation.h"
+#include "admission.h"
+#include "authtable.h"
+#include "dispatch.h"
+#include "fanout.h"
+#include "trace.h"
+#include "metrics.h"
+#include "clienttable.h"
+#include "nametable.h"
+#include "sharedring.h"
+#include "session.h"
+#include "presence.h"
 
 int main(int argc, char* argv[]) {
 
-    // Grab Auth string
-    FILE* authFilePath = fopen(argv[1], "r");
-    if (authFilePath == NULL) {
-        fprintf(stderr, "Usage: server authfile [port]\n");
+    // Grab any options given before the authfile
+    ServerOptions* options = malloc(sizeof(ServerOptions));
+    int firstArg = parse_server_options(argc, argv, options);
+    if (firstArg < 0 || argc - firstArg < 1 || argc - firstArg > 2) {
+        fprintf(stderr, "Usage: server [options] authfile [port|path]\n");
+        exit(USAGE);
+    }
+    argv += firstArg - 1;
+
+    // Grab every auth token
+    AuthTable* authTable = load_auth_table(argv[1]);
+    if (authTable == NULL) {
+        fprintf(stderr, "Usage: server [options] authfile [port|path]\n");
         exit(USAGE);
     }
-    char authBuffer[MAX_BUF];
-    char* auth = strtok(fgets(authBuffer, MAX_BUF - 1, authFilePath), "\n");
-    fclose(authFilePath);
 
     // Ignore sigpipe signals
     struct sigaction sa;
@@ -32,21 +55,72 @@ int main(int argc, char* argv[]) {
     sa.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sa, 0);
 
-    // Setup server connection
-    char* port = argv[2] ? argv[2] : "0";
-    int serverSocket = setup_server_connection(port);
-    if (!serverSocket) {
+    // Interrupt client threads without restarting reads during a handoff
+    struct sigaction handoffAction;
+    memset(&handoffAction, 0, sizeof(struct sigaction));
+    handoffAction.sa_handler = handoff_signal_handler;
+    sigaction(SIGUSR2, &handoffAction, 0);
+
+    // SIGHUP and SIGUSR1 must be blocked before any client threads are
+    // created
+    Server* server = setup_server_instance(argv[1], authTable, options);
+    initialise_sighup_handler(server);
+    server->timers = create_timer_wheel();
+    server->dispatch = create_dispatch(server, options->numWorkers);
+    server->fanOut = create_fan_out(options->numFanOutHelpers);
+    create_presence(server);
+#ifdef TRACE
+    trace_configure(options->traceSample, options->traceFile);
+#endif
+
+    // Setup server connection, or take over the connection of a running server
+    char* port = argc - firstArg == 2 ? argv[2] : "0";
+    int serverSocket = options->takeoverPath != NULL ?
+            take_over_server(server, options->takeoverPath) :
+            setup_server_connection(port, options->backlog);
+
+    // Clients on the same host may also connect through a Unix domain socket,
+    // unless the running server's was taken over along with its port
+    if (serverSocket && options->unixPath != NULL && !server->unixSocket) {
+        server->unixSocket = 
+                setup_unix_connection(options->unixPath, options->backlog);
+    }
+    if (!serverSocket || (options->unixPath != NULL && !server->unixSocket) ||
+            (options->handoffPath != NULL && 
+            !initialise_handoff_listener(server)) ||
+            !initialise_federation(server)) {
         fprintf(stderr, "Communications error\n");
         exit(COMMS);
     }
+    server->serverSocket = serverSocket;
 
-    Server* server = setup_server_instance(auth);
-    initialise_sighup_handler(server);
+    // A socket taken over keeps the backlog of the server it came from, so
+    // set it again. New connections are accepted in batches until the
+    // listening socket runs dry, which needs it to be non-blocking.
+    struct pollfd listeners[] = {
+        {.fd = serverSocket, .events = POLLIN},
+        {.fd = server->unixSocket ? server->unixSocket : -1, .events = POLLIN}
+    };
+    for (int i = 0; i < 2; i++) {
+        if (listeners[i].fd >= 0) {
+            listen(listeners[i].fd, options->backlog);
+            fcntl(listeners[i].fd, F_SETFL, 
+                    fcntl(listeners[i].fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
 
-    // Accept new client connections
-    int clientSocket;
-    while ((clientSocket = accept(serverSocket, 0, 0))) {
-        initialise_client(server, clientSocket);
+    // Accept new client connections, stopping whenever the server is being
+    // handed over to a new process
+    while (1) {
+        if (server->isHandingOff) {
+            park_for_handoff(server, &server->isAcceptParked);
+        } else if (poll(listeners, 2, HANDOFF_POLL_MS) > 0) {
+            for (int i = 0; i < 2; i++) {
+                if (listeners[i].revents & POLLIN) {
+                    accept_clients(server, listeners[i].fd);
+                }
+            }
+        }
     }
 
     // We do not free server's fixed allocated memory in the server instance,
@@ -55,15 +129,20 @@ int main(int argc, char* argv[]) {
     return 1;
 }
 
-void initialise_client(Server* server, int socket) {
+void initialise_client(Server* server, int socket, unsigned int address) {
     
     // Main server thread never needs to join on this thread because as soon
     // as the thread is finished reading, it exits
     take_lock(server->clientAccess);
 
     // Create a new client instance for the thread to use
-    Client* newClient = setup_client(socket, NULL, server->authString);
+    Client* newClient = setup_client(socket, NULL, "");
+    newClient->sourceAddress = address;
+    newClient->isAdmitted = 1;
+    create_out_queue(server, newClient);
+    watch_handshake(server, newClient);
     server->newClient = newClient;
+    server->numHandshaking++;
         
     // Set thread in a detached state so that resources are freed on exit 
     pthread_t tid;
@@ -76,63 +155,259 @@ void* listen_to_client(void* args) {
     Server* server = (Server*) args;
     // Use the newClient pointer in server to find this thread's client
     Client* myClient = server->newClient;
+    myClient->reader = pthread_self();
+    release_lock(server->clientAccess);
     
     char buffer[MAX_BUF];
     // If auth invalid, simply exit the client thread
     if (!validate_authentication(server, myClient) || 
             !validate_client_name(server, myClient)) {
         
-        free_client(myClient);
+        take_lock(server->clientAccess);
+        server->numHandshaking--;
         release_lock(server->clientAccess);
+        release_connection(server, myClient);
+        close_client(myClient);
         return NULL;
     
     } else {
 
-        // If valid, then add the client to the server list alphabetically.
+        // If valid, then add the client to the server list alphabetically,
+        // still holding the lock the name (and the client table's room for
+        // it) was checked under. A client which has resumed its session
+        // already holds its name, and the room was never told that it had
+        // left.
+        watch_connection(server, myClient);
         server->clientList = add_client(server->clientList, myClient);
-        sprintf(buffer, "ENTER:%s", myClient->name);
-        broadcast_to_clients(server, buffer);
+        add_client_slot(server->clientTable, myClient);
+        server->numHandshaking--;
+        if (myClient->session == NULL) {
+            add_client_name(server->nameTable, myClient->name);
+            if (myClient->capabilities & CAP_RESUME) {
+                open_session(server, myClient);
+            }
+            sprintf(buffer, "ENTER:%s", myClient->name);
+            broadcast_to_clients(server, buffer);
+            federate_event(server, buffer);
+        }
         release_lock(server->clientAccess);
     }
 
-    // Main message loop
-    while (receive_message(myClient, buffer)) {
+    serve_client(server, myClient);
+    return NULL; 
+}
+
+void resume_client(Server* server, Client* client) {
+    client->sourceAddress = source_address(client->socket);
+    client->isAdmitted = admit_connection(server, client->sourceAddress, 1)
+            == NULL;
+
+    take_lock(server->clientAccess);
+    server->clientList = add_client(server->clientList, client);
+    add_client_name(server->nameTable, client->name);
+
+    // A client which cannot be given a slot is disconnected, and leaves as
+    // normal once its thread reads EOF
+    if (add_client_slot(server->clientTable, client) == NO_CLIENT_HANDLE) {
+        evict_client(client, "FULL");
+    }
+    server->newClient = client;
+    watch_connection(server, client);
+
+    pthread_t tid;
+    pthread_create(&tid, 0, listen_to_resumed_client, server);
+    pthread_detach(tid);
+}
+
+void* listen_to_resumed_client(void* args) {
+    Server* server = (Server*) args;
+    Client* myClient = server->newClient;
+    myClient->reader = pthread_self();
+    release_lock(server->clientAccess);
+
+    serve_client(server, myClient);
+    return NULL;
+}
+
+void serve_client(Server* server, Client* myClient) {
+
+    // Main message loop. If the server is being handed over, the client's
+    // read is interrupted, and the thread waits until the handoff is over.
+    char buffer[MAX_BUF];
+    int hasLeft = 0;
+    while (1) {
+        if (server->isHandingOff) {
+            park_for_handoff(server, &myClient->isParked);
+            continue;
+        }
+        if (!receive_message(myClient, buffer)) {
+            if (errno == EINTR && server->isHandingOff) {
+                continue;
+            }
+            break;
+        }
+        myClient->timers->lastActivity = current_time_us();
+        add_metric(&myClient->metrics->bytesIn, strlen(buffer));
+        add_metric(&myClient->metrics->messagesIn, 1);
+        TRACE_RECEIVED();
         int response = handle_client_message(server, myClient, buffer);
-        if (response == LEAVE) {
+        hasLeft = response == LEAVE;
+        if (hasLeft || !myClient->isCommunicating) {
             break;
         }
-        usleep(SECOND_IN_MS);
+
+        // The rest of a long line is read straight away, as it is still the
+        // same message
+        if (!myClient->isLineCut) {
+            usleep(SECOND_IN_MS);
+        }
     }
 
-    // Notify of this client's exit and remove client from the client list
+    // Let the workers finish with the client's last commands. Then notify of
+    // this client's exit and remove client from the client list, unless it
+    // was kicked or its session was taken by another connection (in which
+    // case this has already been done). A client whose connection dropped
+    // without it leaving keeps its name while its session can be resumed.
+    drain_client_commands(myClient);
+    end_chat_stream(server, myClient);
     sprintf(buffer, "LEAVE:%s", myClient->name);
     take_lock(server->clientAccess);
-    server->clientList = remove_client(server->clientList, myClient->name);
-    broadcast_to_clients(server, buffer);
+    int isDetached = 0;
+    if (find_client_slot(server->clientTable, myClient->handle) == myClient) {
+        server->clientList = detach_client(server->clientList, myClient);
+        remove_client_slot(server->clientTable, myClient);
+        isDetached = !hasLeft && detach_session(server, myClient);
+        if (!isDetached) {
+            remove_client_name(server->nameTable, myClient->name);
+            broadcast_to_clients(server, buffer);
+            federate_event(server, buffer);
+        }
+    }
+    if (!isDetached) {
+        close_session(server, myClient);
+    }
     release_lock(server->clientAccess);
+    if (isDetached) {
+        wait_for_resume(server, myClient);
+    }
+    release_connection(server, myClient);
+    close_client(myClient);
+}
 
-    return NULL; 
+/* Ends a stage of a client's handshake with OK:. If compression, shared
+ * memory, chunked messages or batched presence events have been asked for but
+ * not yet started, then the server agrees to them with CAPS: first (along
+ * with FASTJOIN, for a client joining fast), and everything after the OK is
+ * compressed, goes through the shared memory rings, has long chat messages in
+ * pieces, or has ENTER and LEAVE events in batches.
+ */
+static void accept_handshake(Server* server, Client* client) {
+    int isCompressing = (client->capabilities & CAP_DEFLATE) &&
+            client->compression == NULL;
+    int isSharing = (client->capabilities & CAP_SHM) && client->rings == NULL;
+    int isChunking = (client->capabilities & CAP_CHUNKED) &&
+            !client->outQueue->isChunked;
+    int isBatching = (client->capabilities & CAP_PRESENCE) &&
+            !client->outQueue->isBatched;
+    char agreed[MAX_BUF] = "CAPS:";
+    if (isCompressing) {
+        strcat(agreed, "DEFLATE,");
+    }
+    if (client->capabilities & CAP_FASTJOIN) {
+        strcat(agreed, "FASTJOIN,");
+    }
+    if (isChunking) {
+        strcat(agreed, "CHUNKED,");
+    }
+    if (isBatching) {
+        strcat(agreed, "PRESENCE,");
+    }
+    if (isSharing) {
+        strcat(agreed, "SHM,");
+    }
+    if (strlen(agreed) > strlen("CAPS:")) {
+        agreed[strlen(agreed) - 1] = '\0';
+        queue_control_message(client, agreed);
+    }
+    queue_control_message(client, "OK:");
+    if (isChunking) {
+        client->outQueue->isChunked = 1;
+    }
+    if (isBatching) {
+        client->outQueue->isBatched = 1;
+    }
+    if (isCompressing) {
+        enable_compression(client, server->options->compressLevel);
+        compress_out_queue(client);
+    }
+    if (isSharing) {
+        enable_shared_rings(client);
+        share_out_queue(client);
+    }
 }
 
 int validate_authentication(Server* server, Client* client) {
    
-    // Receive the authstring from the client
+    // Receive the authstring from the client, which may first ask for
+    // compression
     char buffer[MAX_BUF];
-    send_message(client, "AUTH:");
-    receive_message(client, buffer);
+    queue_control_message(client, "AUTH:");
+    if (!receive_message(client, buffer)) {
+        return 0;
+    }
     char* auth = strtok(buffer, ":");
+    if (auth != NULL && hash_input(auth) == CAPS) {
+        char* capabilities = strtok(NULL, "\n");
+        if (capabilities != NULL && strstr(capabilities, "DEFLATE") &&
+                server->options->compressLevel > 0) {
+            client->capabilities |= CAP_DEFLATE;
+        }
+        if (capabilities != NULL && strstr(capabilities, "SUFFIX")) {
+            client->capabilities |= CAP_SUFFIX;
+        }
+        if (capabilities != NULL && strstr(capabilities, "FASTJOIN")) {
+            client->capabilities |= CAP_FASTJOIN;
+        }
+        if (capabilities != NULL && strstr(capabilities, "RESUME") &&
+                server->options->resumeHistory > 0) {
+            client->capabilities |= CAP_RESUME;
+        }
+        if (capabilities != NULL && strstr(capabilities, "CHUNKED")) {
+            client->capabilities |= CAP_CHUNKED;
+        }
+        if (capabilities != NULL && strstr(capabilities, "PRESENCE") &&
+                server->options->presenceWindow > 0) {
+            client->capabilities |= CAP_PRESENCE;
+        }
+
+        // Shared memory is only agreed to if the rings arrived with the
+        // line, and there is no point compressing bytes which stay in memory
+        if (capabilities != NULL && strstr(capabilities, "SHM") &&
+                client->offeredRings != NULL) {
+            client->capabilities |= CAP_SHM;
+            client->capabilities &= ~CAP_DEFLATE;
+        }
+        if (!receive_message(client, buffer)) {
+            return 0;
+        }
+        auth = strtok(buffer, ":");
+    }
     char* clientAuthString = strtok(NULL, "\n");
    
     // If a valid AUTH command, add to server stats
-    if (hash_input(auth) == AUTH) {
+    if (auth != NULL && hash_input(auth) == AUTH) {
         add_to_server_stats(server, STAT_AUTH);
     }
 
-    // If the client has sent an AUTH string, then if the string matches,
-    // allow the client into the server
+    // If the client has sent an AUTH string, then if the string is one of the
+    // server's tokens, allow the client into the server. A client joining
+    // fast has sent its name already, and is only answered once that has
+    // been checked too
     if (clientAuthString != NULL) {
-        if (!strcmp(clientAuthString, server->authString)) {
-            send_message(client, "OK:");
+        if (check_auth_token(server, clientAuthString)) {
+            if (!(client->capabilities & CAP_FASTJOIN)) {
+                accept_handshake(server, client);
+            }
             return 1;
         } else {
             return 0;
@@ -143,40 +418,114 @@ int validate_authentication(Server* server, Client* client) {
 
 }
 
+/* Turns a client away with ERR:FULL if the client table has no slot left to
+ * give it, releasing clientAccess. The caller must hold clientAccess, and
+ * keep it until the client has been given its slot.
+ */
+static int refuse_if_full(Server* server, Client* client) {
+    if (!is_client_table_full(server->clientTable)) {
+        return 0;
+    }
+    release_lock(server->clientAccess);
+    queue_control_message(client, "ERR:FULL");
+    add_to_server_stats(server, STAT_REJECT);
+    return 1;
+}
+
+/* Hands a client the session named in its RESUME line, whose argument holds
+ * the session's token and the last sequence number the client saw, and sends
+ * it every broadcast it missed. A session which cannot be resumed is treated
+ * like a name which has been taken, and the client is asked for its name
+ * again. If some of the broadcasts it missed have left the history, then the
+ * session is ended, as the client could never be caught up. As with
+ * validate_client_name, clientAccess is kept on success.
+ */
+static int validate_resume(Server* server, Client* client, char* argument) {
+    char* end;
+    unsigned long long token = strtoull(argument, &end, 16);
+    unsigned long long lastSequence = strtoull(*end == ':' ? end + 1 : end,
+            NULL, 10);
+
+    take_lock(server->clientAccess);
+    if (refuse_if_full(server, client)) {
+        return 0;
+    }
+    int isResumable = *end == ':';
+    if (isResumable && !can_replay_from(server->sessions, lastSequence)) {
+        end_session(server, token);
+        isResumable = 0;
+    }
+    if (!isResumable || !resume_session(server, client, token)) {
+        release_lock(server->clientAccess);
+        client->capabilities &= ~CAP_FASTJOIN;
+        return validate_client_name(server, client);
+    }
+    accept_handshake(server, client);
+    flush_presence(server);
+    replay_broadcasts(server, client, lastSequence);
+    return 1;
+}
+
 int validate_client_name(Server* server, Client* client) {
     
     char buffer[MAX_BUF];
-    send_message(client, "WHO:");
-    receive_message(client, buffer);
+    if (!(client->capabilities & CAP_FASTJOIN)) {
+        queue_control_message(client, "WHO:");
+    }
+    if (!receive_message(client, buffer)) {
+        return 0;
+    }
     char* name = strtok(buffer, ":");
     char* clientName = strtok(NULL, "\n");
+    if (clientName != NULL && name != NULL && !strcmp(name, "RESUME")) {
+        return validate_resume(server, client, clientName);
+    }
     
     // If the client has sent an invalid input, reject authentication
-    if (clientName == NULL || name == NULL || strcmp(name, "NAME")) {
+    if (clientName == NULL || name == NULL || strcmp(name, "NAME") ||
+            strlen(clientName) > MAX_NAME) {
         return 0;
     }
 
     add_to_server_stats(server, STAT_NAME);
-    Client* currentClient = server->clientList;
+    take_lock(server->clientAccess);
+    if (refuse_if_full(server, client)) {
+        return 0;
+    }
    
-    // Iterate through the currently connected clients and check for matching
-    // names.
-    while (currentClient != NULL) {
-        if (!strcmp(clientName, currentClient->name)) {
-            send_message(client, "NAME_TAKEN:");
-            // Recursively call validate client to validate
-            return validate_client_name(server, client);
-        } else {
-            currentClient = currentClient->next;
-        } 
+    // Check for a client with the same name, including those connected to
+    // any linked servers. Clients which cannot take a suffix from the server
+    // have to choose another name themselves
+    if (!(client->capabilities & CAP_SUFFIX) && 
+            is_name_taken(server, clientName)) {
+        release_lock(server->clientAccess);
+        queue_control_message(client, "NAME_TAKEN:");
+        // Recursively call validate client to validate. Even a client which
+        // joined fast is asked for its next name
+        client->capabilities &= ~CAP_FASTJOIN;
+        return validate_client_name(server, client);
     }
    
-    // If reached, we have successfully iterated through the client list
-    // without finding a matching name, so we can copy down that name and allow
-    // the client into the server
+    // If reached, the name (or the next free name built on it) is not in use,
+    // so we can copy down that name and allow the client into the server
+    char* assignedName = assign_client_name(server, clientName);
+
+    // A suffix may take a name which was short enough past MAX_NAME, which
+    // is refused just like asking for such a name
+    if (strlen(assignedName) > MAX_NAME) {
+        free(assignedName);
+        release_lock(server->clientAccess);
+        return 0;
+    }
     client->name = strcpy(realloc(client->name, 
-            sizeof(char) * (strlen(clientName) + 2)), clientName);
-    send_message(client, "OK:");
+            sizeof(char) * (strlen(assignedName) + 2)), assignedName);
+    if (strcmp(assignedName, clientName)) {
+        char reply[strlen(assignedName) + 6];
+        sprintf(reply, "NAME:%s", assignedName);
+        queue_control_message(client, reply);
+    }
+    free(assignedName);
+    accept_handshake(server, client);
     return 1;
 }
 
@@ -187,38 +536,117 @@ int handle_client_message(Server* server, Client* client, char* message) {
     }
     
     // Thread safe version of strtok is not used as buffers are never shared
-    // between threads.
-    char messageBuffer[MAX_BUF];
-    char* command = strtok(message, ":");
-    char* optArg1 = strtok(NULL, "\n");
-    int hashCommand = hash_input(command);
+    // between threads. The rest of a line which was too long to be read at
+    // once carries on the command it was cut from, and only a chat message
+    // is carried on.
+    int hashCommand;
+    char* optArg1;
+    int isCarriedOn = client->cutCommand != 0;
+    if (isCarriedOn) {
+        hashCommand = client->cutCommand;
+        optArg1 = message;
+    } else {
+        char* command = strtok(message, ":");
+        optArg1 = strtok(NULL, "\n");
+        hashCommand = command != NULL ? hash_input(command) : 0;
+    }
+    client->cutCommand = client->isLineCut ? hashCommand : 0;
+    if (isCarriedOn && hashCommand != SAY) {
+        return 1;
+    }
 
+    // Everything but leaving is run by a worker, so that this thread can go
+    // straight back to reading
     switch (hashCommand) {
         case SAY:
-            add_to_client_stats(client, STAT_SAY);
-            add_to_server_stats(server, STAT_SAY);
-            sprintf(messageBuffer, "MSG:%s:%s", client->name, optArg1);
-            take_lock(server->clientAccess);
-            broadcast_to_clients(server, messageBuffer);
-            release_lock(server->clientAccess);
+        case KICK:
+        case LIST:
+            dispatch_command(server, client, hashCommand, optArg1,
+                    client->isLineCut);
+            break;
+        case PONG:
+            record_pong(client);
+            break;
+        case LEAVE:
+            add_to_server_stats(server, STAT_LEAVE);
+            return LEAVE;
+    }
+
+    return 1;
+}
+
+/* Streams a piece of a client's chat message to the room. The piece is cut
+ * into frames which each fit into MAX_FRAME along with the client's name, and
+ * every frame but the last of the message is sent as MSGPART. Anything past
+ * the server's largest message is left out.
+ */
+static void stream_chat(Server* server, Client* client, char* piece,
+        int isCut) {
+    if (!client->isStreaming) {
+        add_to_client_stats(client, STAT_SAY);
+        add_to_server_stats(server, STAT_SAY);
+        client->isStreaming = 1;
+        client->streamedLength = 0;
+    }
+    size_t length = piece != NULL ? strlen(piece) : 0;
+    size_t room = server->options->maxMessage - client->streamedLength;
+    if (length > room) {
+        length = room;
+    }
+    client->streamedLength += length;
+
+    size_t frameSize = MAX_FRAME - strlen("MSGPART::") - strlen(client->name);
+    char frame[MAX_FRAME + 1];
+    size_t offset = 0;
+    take_lock(server->clientAccess);
+    do {
+        size_t size = length - offset < frameSize ? length - offset : frameSize;
+        int isLast = !isCut && offset + size == length;
+        if (size > 0 || isLast) {
+            sprintf(frame, "%s:%s:%.*s", isLast ? "MSG" : "MSGPART",
+                    client->name, (int) size, piece + offset);
+            broadcast_to_clients(server, frame);
+            federate_event(server, frame);
+        }
+        offset += size;
+    } while (offset < length);
+    release_lock(server->clientAccess);
+
+    if (!isCut) {
+        client->isStreaming = 0;
+    }
+}
+
+void end_chat_stream(Server* server, Client* client) {
+    if (client->isStreaming) {
+        stream_chat(server, client, NULL, 0);
+    }
+}
+
+void execute_client_command(Server* server, Client* client, int command,
+        char* argument, int isCut) {
+
+    if (!client->isCommunicating) {
+        return;
+    }
+
+    char messageBuffer[MAX_BUF];
+    switch (command) {
+        case SAY:
+            stream_chat(server, client, argument, isCut);
             break;
         case KICK:
             add_to_client_stats(client, STAT_KICK);
             add_to_server_stats(server, STAT_KICK);
-            kick_client(server, optArg1);
+            kick_client(server, argument);
             break;
         case LIST:
             add_to_client_stats(client, STAT_LIST);
             add_to_server_stats(server, STAT_LIST);
             update_active_client_list(server, messageBuffer);
-            send_message(client, messageBuffer);
+            queue_control_message(client, messageBuffer);
             break;
-        case LEAVE:
-            add_to_server_stats(server, STAT_LEAVE);
-            return LEAVE;
     }
-
-    return 1;
 }
 
 void broadcast_to_clients(Server* server, char* message) {
@@ -227,15 +655,44 @@ void broadcast_to_clients(Server* server, char* message) {
     char messageCopy[strlen(message) + 1];
     strcpy(messageCopy, message);
     handle_server_message(messageCopy);
+    fflush(stdout);
 
-    // Send the same message to all other clients (to handle clientside)
-    Client* currentClient = server->clientList;
-    while (currentClient != NULL) {
-        if (currentClient->isCommunicating) {
-            send_message(currentClient, message);
+    // Presence events are held back to be sent to the room in batches, and
+    // anything else is only sent once the events before it have been
+    if (hold_presence_event(server, message)) {
+        return;
+    }
+    flush_presence(server);
+
+    // Send the same message to all other clients (to handle clientside),
+    // spreading large rooms across the fan-out pool. Clients which can
+    // resume their sessions are sent it with its sequence number, and
+    // clients which cannot put a chat message back together are sent each
+    // piece of it as a whole message.
+    char* sequenced = record_broadcast(server->sessions, message);
+    char unchunkedCopy[strlen(message) + 1];
+    char unchunkedSequencedCopy[strlen(message) + 26];
+    char* unchunked = message;
+    char* unchunkedSequenced = sequenced;
+    if (!strncmp(message, "MSGPART:", strlen("MSGPART:"))) {
+        sprintf(unchunkedCopy, "MSG:%s", message + strlen("MSGPART:"));
+        unchunked = unchunkedCopy;
+        if (sequenced != NULL) {
+            sprintf(unchunkedSequencedCopy, "SEQ:%llu:%s",
+                    server->sessions->lastSequence, unchunked);
+            unchunkedSequenced = unchunkedSequencedCopy;
         }
-        currentClient = currentClient->next;
     }
+    char* renditions[NUM_RENDITIONS];
+    for (int i = 0; i < NUM_RENDITIONS; i++) {
+        if (i & RENDER_UNCHUNKED) {
+            renditions[i] = i & RENDER_SEQUENCED ? unchunkedSequenced :
+                    unchunked;
+        } else {
+            renditions[i] = i & RENDER_SEQUENCED ? sequenced : message;
+        }
+    }
+    fan_out_message(server, renditions);
 
 }
 
@@ -245,13 +702,23 @@ void kick_client(Server* server, char* name) {
         // Grab client to kick
         take_lock(server->clientAccess);
         Client* clientToKick = get_client(server->clientList, name);
-        release_lock(server->clientAccess);
         
-        // If this client exists, kick client.
+        // If this client exists, kick client. It is taken out of the client
+        // list straight away, and its socket is shut down as soon as KICK has
+        // been sent, so its thread reclaims it without waiting for the client
         if (clientToKick != NULL) {
-            send_message(clientToKick, "KICK:");
-            clientToKick->isCommunicating = 0;
+            server->clientList = 
+                    detach_client(server->clientList, clientToKick);
+            remove_client_slot(server->clientTable, clientToKick);
+            remove_client_name(server->nameTable, clientToKick->name);
+            disconnect_client(clientToKick, "KICK:");
+
+            char buffer[MAX_BUF];
+            sprintf(buffer, "LEAVE:%s", clientToKick->name);
+            broadcast_to_clients(server, buffer);
+            federate_event(server, buffer);
         }
+        release_lock(server->clientAccess);
     }
 
 }
@@ -259,16 +726,36 @@ void kick_client(Server* server, char* name) {
 void update_active_client_list(Server* server, char* messageBuffer) {
     
     take_lock(server->clientAccess);
+    Federation* federation = server->federation;
+    RemoteMember* remoteMember = NULL;
+    if (federation != NULL) {
+        take_lock(federation->federationAccess);
+        remoteMember = federation->members;
+    }
     sprintf(messageBuffer, "LIST:");
    
-    // Grab all client's names and add to a buffer
+    // Merge local and remote names, both of which are kept in alphabetical
+    // order, leaving out any names which would not fit into one message
     Client* currentClient = server->clientList;
-    while (currentClient->next != NULL) {
-        strcat(messageBuffer, currentClient->name);
-        strcat(messageBuffer, ",");
-        currentClient = currentClient->next;
+    size_t length = strlen(messageBuffer);
+    while (currentClient != NULL || remoteMember != NULL) {
+        char* name;
+        if (remoteMember == NULL || (currentClient != NULL && 
+                strcasecmp(currentClient->name, remoteMember->name) <= 0)) {
+            name = currentClient->name;
+            currentClient = currentClient->next;
+        } else {
+            name = remoteMember->name;
+            remoteMember = remoteMember->next;
+        }
+        if (length + strlen(name) + 1 < MAX_BUF - 2) {
+            length += sprintf(messageBuffer + length, "%s%s", 
+                    length > strlen("LIST:") ? "," : "", name);
+        }
+    }
+
+    if (federation != NULL) {
+        release_lock(federation->federationAccess);
     }
-    // Add final client name without comma
-    strcat(messageBuffer, currentClient->name);
     release_lock(server->clientAccess);
 }
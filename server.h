@@ -6,31 +6,179 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include "sharedutil.h"
+#include "timerwheel.h"
 #define INF 1000000000
 #define SECOND_IN_MS 100000
+#define DEFAULT_HIGH_WATER 65536
+#define DEFAULT_LOW_WATER 16384
+#define DEFAULT_COMPRESS_LEVEL 6
+#define DEFAULT_HANDSHAKE_TIMEOUT 10000
+#define DEFAULT_MAX_CLIENTS 1024
+#define DEFAULT_WORKERS 4
+#define DEFAULT_RESUME_HISTORY 1024
+#define DEFAULT_RESUME_GRACE 10000
+#define DEFAULT_PRESENCE_WINDOW 50
 
 /* The Stats enum serves as an easy to read index for the statistics held
  * in the server. 
  */
 enum Stats {
-    STAT_SAY, STAT_KICK, STAT_LIST, STAT_AUTH, STAT_NAME, STAT_LEAVE
+    STAT_SAY, STAT_KICK, STAT_LIST, STAT_AUTH, STAT_NAME, STAT_LEAVE,
+    STAT_DROP, STAT_EVICT, STAT_TIMEOUT, STAT_REJECT
 };
 
+/* The SlowPolicies enum holds the ways the server can deal with a client
+ * which has fallen behind, i.e. whose outbound queue has passed the high water
+ * mark. See queue_message in outqueue.h for a description of each policy.
+ */
+enum SlowPolicies {
+    DROP_OLDEST, DROP_NEW, DISCONNECT
+};
+
+/* The ServerOptions datastructure holds all of the tunable settings given to
+ * the server on the command line.
+ *
+ * highWater: The number of bytes which may be waiting to be sent to a client
+ *  before it is considered to have fallen behind.
+ *
+ * lowWater: The number of bytes a client which has fallen behind must get back
+ *  down to before it is considered to have caught up.
+ *
+ * slowPolicy: What happens to a client which has fallen behind, as one of the
+ *  SlowPolicies enum values above.
+ *
+ * coalesceWindow: How long (in microseconds) a message may be held back to be
+ *  written to a client in the same batch as the messages that follow it. A
+ *  window of 0 writes every message as soon as possible.
+ *
+ * handoffPath: The path of a Unix domain socket on which the server waits for
+ *  a new server process to hand itself over to, or NULL.
+ *
+ * takeoverPath: The handoff path of a running server which this server should
+ *  take over from on startup, instead of listening on a port, or NULL.
+ *
+ * federationAddress: The address (a Unix domain socket path, or a port on the
+ *  loopback interface) on which the server accepts links from other server
+ *  processes in its federation, or NULL.
+ *
+ * peerAddresses/numPeers: The addresses of the other server processes which
+ *  this server links to on startup.
+ *
+ * compressLevel: The zlib compression level (1-9) used for clients which ask
+ *  for compression, or 0 if compression is never agreed to.
+ *
+ * handshakeTimeout: How long (in milliseconds) a new connection has to
+ *  authenticate and negotiate its name before it is disconnected, or 0.
+ *
+ * idleTimeout: How long (in milliseconds) a client may go without sending
+ *  anything before it is disconnected, or 0.
+ *
+ * pingInterval: How long (in milliseconds) a client may go without sending
+ *  anything before it is sent PING, which clients answer with PONG, or 0.
+ *
+ * maxClients: How many client connections (including those still in their
+ *  handshake) the server holds at once before turning new ones away, or 0.
+ *
+ * maxPerAddress: How many of those connections may come from a single source
+ *  address, or 0.
+ *
+ * backlog: How many connections the kernel queues on the listening socket
+ *  before they are accepted.
+ *
+ * numWorkers: How many threads run the commands which clients send.
+ *
+ * numFanOutHelpers: How many threads help to queue each broadcast for the
+ *  members of a large room.
+ *
+ * unixPath: The path of a Unix domain socket which the server listens on for
+ *  clients on the same host, as well as its port, or NULL.
+ *
+ * resumeHistory: How many recent broadcasts are kept to be sent again to
+ *  clients which resume their sessions, or 0 if sessions are never given out.
+ *
+ * resumeGrace: How long (in milliseconds) a client whose connection drops
+ *  has to resume its session before the room is told that it has left, or 0
+ *  to tell the room straight away.
+ *
+ * maxMessage: The most bytes of a single chat message which are streamed to
+ *  the room. Anything a client sends past this in the same line is left out.
+ *
+ * presenceWindow: How long (in microseconds) an ENTER or LEAVE event may be
+ *  held back to be sent to the room in the same batch as the events that
+ *  follow it (see presence.h). A window of 0 sends every event on its own.
+ *
+ * traceSample/traceFile: How often SAY messages are traced, and the file the
+ *  Chrome trace is written to, or NULL (only when built with TRACE).
+ */
+typedef struct ServerOptions {
+    size_t highWater;
+    size_t lowWater;
+    int slowPolicy;
+    long long coalesceWindow;
+    char* handoffPath;
+    char* takeoverPath;
+    char* federationAddress;
+    char** peerAddresses;
+    int numPeers;
+    int compressLevel;
+    long long handshakeTimeout;
+    long long idleTimeout;
+    long long pingInterval;
+    int maxClients;
+    int maxPerAddress;
+    int backlog;
+    int numWorkers;
+    int numFanOutHelpers;
+    char* unixPath;
+    int resumeHistory;
+    long long resumeGrace;
+    size_t maxMessage;
+    long long presenceWindow;
+#ifdef TRACE
+    int traceSample;
+    char* traceFile;
+#endif
+} ServerOptions;
+
 /* The Server datastructure is the overarching struct which holds all variables
  * that are necessary to run the server process.  
  *
- * serverSocket: A socket given to the server after connection (improve)
+ * serverSocket: The socket which the server accepts new clients on.
+ *
+ * unixSocket: A second socket which the server accepts new clients on, which
+ *  is a Unix domain socket for clients on the same host, or 0.
+ *
+ * handoffSocket: The Unix domain socket which the server accepts new server
+ *  processes on, if it has a handoff path.
  * 
- * authString: A unique one line string that is required from all clients to
- *  enter the server.
+ * authPath: The path of the authfile, which is read again whenever the server
+ *  is sent SIGUSR1.
+ *
+ * authTable: The tokens which clients may enter the server with (see
+ *  authtable.h). It is only ever replaced as a whole, with an atomic store.
  * 
  * clientAccess: A lock that should be used when accessing clientList,
  *  to ensures mutual exclusion between threads.
  * 
  * newClient: A pointer to the newest Client struct instance
  *  created by the server whenever a new client joins.
+ *
+ * numHandshaking: The number of clients which are still authenticating and
+ *  negotiating their name, and so are not yet in clientList. Handshakes are
+ *  run without clientAccess, so that a slow client never holds up the rest.
  * 
- * clientList: The head pointer to a linked list of Client struct instances
+ * clientList: The head pointer to a linked list of Client struct instances,
+ *  in name order.
+ *
+ * clientTable: The same clients as clientList, held in a dense table of slots
+ *  which broadcasts are queued from (see clienttable.h).
+ *
+ * nameTable: The names of the clients in clientList, hashed so that names
+ *  can be checked and handed out without walking the list (see nametable.h).
+ *  The names of clients whose sessions are detached are kept here too.
+ *
+ * sessions: The sessions which clients can resume after their connection
+ *  drops, and the history of recent broadcasts (see session.h).
  *
  * statsAccess: A lock that should be used when accessing the server's stats,
  *  again to ensure mutual exclusion.
@@ -38,19 +186,99 @@ enum Stats {
  * stats: Stores the statistics of the server's received messages. stats can be
  *  iterated through to access all statistics required, and can be indexed 
  *  using the Stats enumeration above.
+ *
+ * options: The settings given to the server on the command line.
+ *
+ * isHandingOff: Set while the server is being handed over to a new process.
+ *  Every thread which reads from a socket parks itself while this is set.
+ *
+ * isAcceptParked: Set while the thread accepting new clients is parked.
+ *
+ * handoffResume: A semaphore which parked threads wait on, and which is posted
+ *  for each of them if a handoff fails.
+ *
+ * federation: The state shared with other server processes which this server
+ *  is linked to (see federation.h), or NULL if it is not federated.
+ *
+ * timers: The timer wheel which drives every client's handshake deadline,
+ *  idle timeout and keepalive.
+ *
+ * admission: The number of connections the server currently holds, which new
+ *  connections are admitted against (see admission.h).
+ *
+ * dispatch: The pool of workers which run the commands that clients send (see
+ *  dispatch.h).
+ *
+ * fanOut: The pool of threads which share out large broadcasts (see fanout.h).
+ *
+ * presence: The ENTER and LEAVE events being held back to be sent to the
+ *  room in a batch (see presence.h).
  */
 typedef struct Server {
     int serverSocket; 
-    char* authString; 
+    int unixSocket;
+    int handoffSocket;
+    char* authPath;
+    struct AuthTable* authTable;
     
     sem_t* clientAccess;
     struct Client* newClient;
+    int numHandshaking;
     struct Client* clientList;
+    struct ClientTable* clientTable;
+    struct NameTable* nameTable;
+    struct SessionTable* sessions;
 
     sem_t* statsAccess;
     volatile int* stats;
+
+    ServerOptions* options;
+
+    volatile int isHandingOff;
+    volatile int isAcceptParked;
+    sem_t* handoffResume;
+
+    struct Federation* federation;
+
+    TimerWheel* timers;
+
+    struct Admission* admission;
+
+    struct Dispatch* dispatch;
+    struct FanOut* fanOut;
+    struct Presence* presence;
 } Server;
 
+/* The ClientTimers datastructure holds the timers which watch a single
+ * client serverside, so that connections which stop responding are
+ * reclaimed without a thread of their own.
+ *
+ * server: The server which owns the client.
+ *
+ * client: The client being watched.
+ *
+ * handshake: Disconnects the client if it has not finished authenticating and
+ *  negotiating its name by the server's handshake timeout.
+ *
+ * idle: Disconnects the client once it has sent nothing for the server's idle
+ *  timeout. Rather than being rearmed for every message, it checks the time
+ *  of the last message when it fires, and fires again if that was recent.
+ *
+ * ping: Sends the client PING whenever it has sent nothing for the server's
+ *  ping interval.
+ *
+ * lastActivity: The monotonic time (in microseconds) at which the client last
+ *  sent anything.
+ */
+typedef struct ClientTimers {
+    Server* server;
+    Client* client;
+    Timer handshake;
+    Timer idle;
+    Timer ping;
+    volatile long long lastActivity;
+} ClientTimers;
+
 /* The SignalHandler datastructure allows access for a signal handling thread
  * to appropriately access server statistics. On a SIGHUP to the process,
  * a dedicated signal handling thread accesses the server and client statistics
@@ -67,8 +295,10 @@ typedef struct SignalHandler {
     Server* server;
 } SignalHandler;
 
-/* The initialise_client function allocates a new client instance, 
- * and updates the newest client in the server with this new instance.
+/* The initialise_client function allocates a new client instance for an
+ * admitted connection, and updates the newest client in the server with this
+ * new instance. The client counts as handshaking until its thread either adds
+ * it to the client list or gives up on it.
  *
  * Then, a thread is created which calls the listen_to_client routine with an
  * instance of the server.
@@ -81,22 +311,18 @@ typedef struct SignalHandler {
  *      server - An instance of the main server datastructure.
  *      socket - A newly retrieved socket allowing connection between
  *          the client and the server
+ *      address - The source address the connection was admitted for (see
+ *          admit_connection in admission.h)
  */
-void initialise_client(Server* server, int socket);
+void initialise_client(Server* server, int socket, unsigned int address);
 
 /* The listen_to_client function is the main routine for the client handling 
  * threads serverside. This routine first grabs the newest client it has been
  * allocated from the server, before immediately validating authentication and
  * name negotiation. 
  * 
- * If the client is authenticated, then this function will
- * listen to messages from the client, and appropriately handle them.
- * 
- * There is a delay of 100ms between parsing messages to rate limit client and
- * reduce spam.
- *
- * When the client leaves, other clients are notified of this, and the client
- * is removed from the server.
+ * If the client is authenticated, then this function will serve the client
+ * with serve_client.
  *
  * Parameters:
  *      args - An instance of the main server datastructure
@@ -106,10 +332,65 @@ void initialise_client(Server* server, int socket);
  */
 void* listen_to_client(void* args);
 
+/* The resume_client function adds a client which has been handed over from
+ * another server process to the client list, and creates a thread which calls
+ * the listen_to_resumed_client routine with an instance of the server. The
+ * client has already authenticated and negotiated its name, and is admitted
+ * even if it takes the server over its connection limits. Only if the client
+ * table has no slot left for it is it disconnected, with ERR:FULL.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure.
+ *      client - A client instance restored from the other server process
+ */
+void resume_client(Server* server, Client* client);
+
+/* The listen_to_resumed_client function is the main routine for the threads of
+ * clients which have been handed over from another server process. It grabs
+ * the newest client from the server, and serves the client with serve_client.
+ *
+ * Parameters:
+ *      args - An instance of the main server datastructure
+ *
+ * Returns:
+ *      NULL
+ */
+void* listen_to_resumed_client(void* args);
+
+/* The serve_client function listens to messages from a connected client, and 
+ * appropriately handles them.
+ * 
+ * There is a delay of 100ms between parsing messages to rate limit client and
+ * reduce spam.
+ *
+ * While the server is being handed over to a new process, the client's thread
+ * parks without reading anything further. When the client leaves, its thread
+ * waits for its last commands to be run, other clients are notified of this,
+ * and the client is removed from the server. If the client's connection
+ * dropped without it leaving, and it holds a session, then the room is only
+ * told once the session has not been resumed in time (see session.h).
+ * The thread stops reading as soon as the client is kicked or disconnected,
+ * and reclaims all of the client's memory before returning.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      myClient - The client instance served by the calling thread
+ */
+void serve_client(Server* server, Client* myClient);
+
 /* The validate_authentication function validates a client's authentication
  * string, by asking for the client's auth string and checking it against
  * the server's auth string. 
  *
+ * A client may send CAPS:DEFLATE before its auth string to ask for its
+ * connection to be compressed. If the server allows compression, it agrees by
+ * sending CAPS:DEFLATE before OK, after which everything sent either way is
+ * compressed. The same CAPS line may also ask for SUFFIX or FASTJOIN, which
+ * are recorded in the client's capabilities for validate_client_name. A
+ * client joining fast is not sent OK here, as its name has been sent already
+ * and it is answered once, after validate_client_name, instead. Compression
+ * starts after that OK.
+ *
  * If the client's authentication does not match, or the client does not send
  * an auth string in the correct format (AUTH:<auth_string>), then the client
  * is kicked. Otherwise, the client passes authentication.
@@ -128,10 +409,24 @@ int validate_authentication(Server* server, Client* client);
  * name that it would like to be called is valid in the server. 
  * 
  * This functions first asks for the client's name, before checking it against
- * the names of any other clients already in the server. If there is a match, 
- * the client is told that name has already been taken, and the function is 
- * called again. Otherwise, the client's given name is saved to the client
- * instance.
+ * the names of any other clients already in the server, or in any server it
+ * is federated with. If there is a match, a client which asked for CAPS:SUFFIX
+ * is given the next free name (see assign_client_name) with NAME:<name>.
+ * Other clients are told that name has already been taken, and the function
+ * is called again. Otherwise, the client's given name is saved to the client
+ * instance. Clients which asked for CAPS:FASTJOIN are not asked with WHO:
+ * for the name they have already sent. A client may instead answer with
+ * RESUME:<token>:<sequence> to take back a session it held before its
+ * connection dropped, along with that session's name (see session.h). Names
+ * longer than MAX_NAME are refused, along with names which a suffix would take
+ * past MAX_NAME, so that every chat message frame naming the client fits into
+ * a single line. A client is sent ERR:FULL and refused
+ * if the client table has no slot left for it (see clienttable.h).
+ *
+ * The names are checked with the server's clientAccess lock held, and on
+ * success the lock is kept, so that the caller can add the client to the
+ * client list before any other client can take the same name. The caller
+ * must release it.
  *
  * Parameters:
  *      server - An instance of the main server datastructure
@@ -139,7 +434,7 @@ int validate_authentication(Server* server, Client* client);
  *
  * Returns:
  *      (int) 0 - if the client fails name negotiation
- *      (int) 1 - if the client passes name negotiation
+ *      (int) 1 - if the client passes name negotiation, with clientAccess held
  */
 int validate_client_name(Server* server, Client* client);
 
@@ -147,9 +442,15 @@ int validate_client_name(Server* server, Client* client);
  * valid, connected client, and parses this message. 
  *
  * If the client wants to say
- * something to the chat, is requesting a list of all connected users, would
- * like to kick a user, or would like to leave, then the server handles this
- * appropriately. Otherwise, the input is ignored.
+ * something to the chat, is requesting a list of all connected users, or
+ * would like to kick a user, then the command is dispatched to a worker to
+ * run (see dispatch.h). If the client would like to leave, this is returned
+ * straight away. Otherwise, the input is ignored.
+ *
+ * A line too long to be read at once is handled a piece at a time, each
+ * piece carrying on the command the line started with. The pieces of a SAY
+ * are each dispatched as soon as they are read, and the rest of any other
+ * command is ignored.
  *
  * Parameters:
  *      server - An instance of the main server datastructure
@@ -164,9 +465,41 @@ int validate_client_name(Server* server, Client* client);
  */
 int handle_client_message(Server* server, Client* client, char* message);
 
+/* The execute_client_command function runs a command which a client has sent,
+ * on one of the dispatch workers. A SAY is broadcast to every client, a KICK
+ * kicks the named client, and a LIST is answered with the active client list.
+ * Commands from a client which is no longer communicating are ignored.
+ *
+ * A SAY is streamed to the room in frames of at most MAX_FRAME bytes as each
+ * piece of its line arrives (see CAP_CHUNKED), so that the server never holds
+ * more than one piece of a long message. Only the first maxMessage bytes of
+ * a message are sent, though the message is always ended.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - The client which sent the command
+ *      command - The hash of the command
+ *      argument - The command's argument, or NULL
+ *      isCut - Whether the argument carries on in the client's next command
+ */
+void execute_client_command(Server* server, Client* client, int command,
+        char* argument, int isCut);
+
+/* The end_chat_stream function ends a chat message which a client was part
+ * way through sending when it stopped communicating, so that the room is
+ * sent whatever it had sent of the message.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - A client whose commands have all been run
+ */
+void end_chat_stream(Server* server, Client* client);
+
 /* The broadcast_to_clients function broadcasts a message to all valid, 
  * connected clients in the server. It also emits a readable version of the 
- * message to the server's stdout.
+ * message to the server's stdout. Large rooms are fanned out across several
+ * threads (see fanout.h), and each client is sent the rendition of the
+ * message made for it. The caller must hold clientAccess.
  *
  * Parameters:
  *      clientList - A pointer to the head of the client linked list
@@ -177,8 +510,10 @@ void broadcast_to_clients(Server* clientList, char* message);
 /* The kick_client function finds a client instance by a given name, and 
  * attempts to kick this client if this client is connected to the server.
  *
- * Once the client has been kicked, they are not allowed to communicate
- * with the server in the time it takes them to leave.
+ * Once the client has been kicked, it is removed from the client list and the
+ * other clients are told it has left. Anything still queued for it is
+ * discarded, and its socket is shut down as soon as it has been sent KICK, so
+ * that its thread reclaims the connection straight away.
  *
  * Parameters:
  *      server - An instance of the main server datastructure
@@ -189,7 +524,9 @@ void kick_client(Server* server, char* name);
 
 /* The update_active_client_list function concatenates all of the valid,
  * connected clients' names into a buffer, and formats this into a valid
- * LIST message to send to the client which has requested it.
+ * LIST message to send to the client which has requested it. If the server
+ * is federated, the names of members on linked servers are merged in, and
+ * any names which would not fit into MAX_BUF are left out.
  *
  * Parameters:
  *      server - An instance of the main server datastructure
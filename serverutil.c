@@ -6,15 +6,32 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <netdb.h>
 #include <signal.h>
+#include <getopt.h>
 #include "server.h"
 #include "sharedutil.h"
 #include "serverutil.h"
+#include "outqueue.h"
+#include "federation.h"
+#include "admission.h"
+#include "authtable.h"
+#include "trace.h"
+#include "metrics.h"
+#include "clienttable.h"
+#include "nametable.h"
+#include "session.h"
+
+int setup_server_connection(char* port, int backlog) {
+    // A path is served on a Unix domain socket instead of a port
+    if (strchr(port, '/') != NULL) {
+        return setup_unix_connection(port, backlog);
+    }
 
-int setup_server_connection(char* port) {
     // Setup correct address information
     struct addrinfo* ai = 0;
     struct addrinfo hints;
@@ -35,31 +52,256 @@ int setup_server_connection(char* port) {
         return 0;
     }
 
-    struct sockaddr_in ad;
-    memset(&ad, 0, sizeof(struct sockaddr_in));
-    socklen_t len = sizeof(struct sockaddr_in);
-    if (getsockname(serverSocket, (struct sockaddr*) &ad, &len)) {
+    if (listen(serverSocket, backlog)) {
         return 0;
     }
+    
+    print_listener_address(serverSocket);
+    freeaddrinfo(ai);
+    return serverSocket;
+}
 
-    if (listen(serverSocket, INF)) {
+int setup_unix_connection(char* path, int backlog) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
         return 0;
     }
-    
-    fprintf(stderr, "%u\n", ntohs(ad.sin_port));
-    freeaddrinfo(ai);
+    strcpy(address.sun_path, path);
+
+    // Replace any stale path left by a previous server
+    unlink(path);
+    int serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serverSocket < 0 || bind(serverSocket, (struct sockaddr*) &address,
+            sizeof(struct sockaddr_un)) || listen(serverSocket, backlog)) {
+        if (serverSocket >= 0) {
+            close(serverSocket);
+        }
+        return 0;
+    }
+
+    print_listener_address(serverSocket);
     return serverSocket;
 }
 
-Server* setup_server_instance(char* authString) {
+void print_listener_address(int listener) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(struct sockaddr_storage);
+    if (getsockname(listener, (struct sockaddr*) &address, &length)) {
+        return;
+    }
+    if (address.ss_family == AF_UNIX) {
+        fprintf(stderr, "%s\n", ((struct sockaddr_un*) &address)->sun_path);
+    } else if (address.ss_family == AF_INET) {
+        fprintf(stderr, "%u\n",
+                ntohs(((struct sockaddr_in*) &address)->sin_port));
+    }
+}
+
+int parse_server_options(int argc, char* argv[], ServerOptions* options) {
+    options->highWater = DEFAULT_HIGH_WATER;
+    options->lowWater = DEFAULT_LOW_WATER;
+    options->slowPolicy = DISCONNECT;
+    options->coalesceWindow = 0;
+    options->handoffPath = NULL;
+    options->takeoverPath = NULL;
+    options->federationAddress = NULL;
+    options->peerAddresses = NULL;
+    options->numPeers = 0;
+    options->compressLevel = DEFAULT_COMPRESS_LEVEL;
+    options->handshakeTimeout = DEFAULT_HANDSHAKE_TIMEOUT;
+    options->idleTimeout = 0;
+    options->pingInterval = 0;
+    options->maxClients = DEFAULT_MAX_CLIENTS;
+    options->maxPerAddress = 0;
+    options->backlog = SOMAXCONN;
+    options->numWorkers = DEFAULT_WORKERS;
+    options->unixPath = NULL;
+    options->resumeHistory = DEFAULT_RESUME_HISTORY;
+    options->resumeGrace = DEFAULT_RESUME_GRACE;
+    options->maxMessage = DEFAULT_MAX_MESSAGE;
+    options->presenceWindow = DEFAULT_PRESENCE_WINDOW * 1000;
+    options->numFanOutHelpers = sysconf(_SC_NPROCESSORS_ONLN) > 1 ?
+            sysconf(_SC_NPROCESSORS_ONLN) - 1 : 0;
+#ifdef TRACE
+    options->traceSample = TRACE_DEFAULT_SAMPLE;
+    options->traceFile = NULL;
+#endif
+
+    struct option longOptions[] = {
+        {"high-water", required_argument, NULL, 'h'},
+        {"low-water", required_argument, NULL, 'l'},
+        {"slow-policy", required_argument, NULL, 'p'},
+        {"coalesce-window", required_argument, NULL, 'w'},
+        {"handoff-path", required_argument, NULL, 'H'},
+        {"takeover", required_argument, NULL, 'T'},
+        {"federation-listen", required_argument, NULL, 'F'},
+        {"peer", required_argument, NULL, 'P'},
+        {"compress-level", required_argument, NULL, 'z'},
+        {"handshake-timeout", required_argument, NULL, 'a'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"ping-interval", required_argument, NULL, 'k'},
+        {"max-clients", required_argument, NULL, 'm'},
+        {"max-per-address", required_argument, NULL, 'n'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"workers", required_argument, NULL, 'W'},
+        {"fanout-threads", required_argument, NULL, 'f'},
+        {"unix-listen", required_argument, NULL, 'U'},
+        {"resume-history", required_argument, NULL, 'R'},
+        {"resume-grace", required_argument, NULL, 'g'},
+        {"max-message", required_argument, NULL, 'M'},
+        {"presence-window", required_argument, NULL, 'e'},
+#ifdef TRACE
+        {"trace-sample", required_argument, NULL, 's'},
+        {"trace-file", required_argument, NULL, 't'},
+#endif
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'h':
+                options->highWater = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                options->lowWater = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                if (!strcmp(optarg, "oldest")) {
+                    options->slowPolicy = DROP_OLDEST;
+                } else if (!strcmp(optarg, "new")) {
+                    options->slowPolicy = DROP_NEW;
+                } else if (!strcmp(optarg, "disconnect")) {
+                    options->slowPolicy = DISCONNECT;
+                } else {
+                    return -1;
+                }
+                break;
+            case 'w':
+                options->coalesceWindow = (long long) (atof(optarg) * 1000);
+                break;
+            case 'H':
+                options->handoffPath = optarg;
+                break;
+            case 'T':
+                options->takeoverPath = optarg;
+                break;
+            case 'F':
+                options->federationAddress = optarg;
+                break;
+            case 'P':
+                options->peerAddresses = realloc(options->peerAddresses,
+                        sizeof(char*) * (options->numPeers + 1));
+                options->peerAddresses[options->numPeers++] = optarg;
+                break;
+            case 'z':
+                options->compressLevel = atoi(optarg);
+                break;
+            case 'a':
+                options->handshakeTimeout = atoll(optarg);
+                break;
+            case 'i':
+                options->idleTimeout = atoll(optarg);
+                break;
+            case 'k':
+                options->pingInterval = atoll(optarg);
+                break;
+            case 'm':
+                options->maxClients = atoi(optarg);
+                break;
+            case 'n':
+                options->maxPerAddress = atoi(optarg);
+                break;
+            case 'b':
+                options->backlog = atoi(optarg);
+                break;
+            case 'W':
+                options->numWorkers = atoi(optarg);
+                break;
+            case 'f':
+                options->numFanOutHelpers = atoi(optarg);
+                break;
+            case 'U':
+                options->unixPath = optarg;
+                break;
+            case 'R':
+                options->resumeHistory = atoi(optarg);
+                break;
+            case 'g':
+                options->resumeGrace = atoll(optarg);
+                break;
+            case 'M':
+                options->maxMessage = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                options->presenceWindow = (long long) (atof(optarg) * 1000);
+                break;
+#ifdef TRACE
+            case 's':
+                options->traceSample = atoi(optarg);
+                break;
+            case 't':
+                options->traceFile = optarg;
+                break;
+#endif
+            default:
+                return -1;
+        }
+    }
+
+    // A client must be able to catch up before it can fall behind again
+    if (options->highWater < MAX_BUF || 
+            options->lowWater >= options->highWater ||
+            options->coalesceWindow < 0 || options->compressLevel < 0 ||
+            options->compressLevel > 9 || options->handshakeTimeout < 0 ||
+            options->idleTimeout < 0 || options->pingInterval < 0 ||
+            options->maxClients < 0 || options->maxPerAddress < 0 ||
+            options->backlog < 1 || options->numWorkers < 1 ||
+            options->numFanOutHelpers < 0 || options->resumeHistory < 0 ||
+            options->resumeGrace < 0 || options->maxMessage < 1 ||
+            options->presenceWindow < 0) {
+        return -1;
+    }
+    return optind;
+}
+
+Server* setup_server_instance(char* authPath, AuthTable* authTable, 
+        ServerOptions* options) {
     
     Server* server = malloc(sizeof(Server));
+    server->options = options;
+    server->serverSocket = 0;
+    server->unixSocket = 0;
+    server->handoffSocket = 0;
+
+    // Nothing is being handed over until a new process connects
+    server->isHandingOff = 0;
+    server->isAcceptParked = 0;
+    server->handoffResume = malloc(sizeof(sem_t));
+    sem_init(server->handoffResume, 0, 0);
+
+    // Peer links are only set up once the server is listening, and timers
+    // only once SIGHUP has been blocked
+    server->federation = NULL;
+    server->timers = NULL;
+    server->admission = create_admission();
+    server->dispatch = NULL;
+    server->fanOut = NULL;
+    server->presence = NULL;
     
-    // Give server the authstring. This should never be updated
-    server->authString = authString; 
+    // Give server its auth tokens. These are only replaced by a reload
+    server->authPath = authPath;
+    server->authTable = authTable;
     
     // Setup clientList lock which locks on any updating of the client list
     server->clientAccess = create_lock(malloc(sizeof(sem_t)));
+    server->newClient = NULL;
+    server->numHandshaking = 0;
+    server->clientList = NULL;
+    server->clientTable = create_client_table();
+    server->nameTable = create_name_table();
+    server->sessions = create_session_table(options->resumeHistory);
     
     // Initialise server stats and stats lock and give to server
     server->statsAccess = create_lock(malloc(sizeof(sem_t)));
@@ -74,6 +316,7 @@ void initialise_sighup_handler(Server* server) {
     sigset_t* signalMask = malloc(sizeof(sigset_t));
     sigemptyset(signalMask);
     sigaddset(signalMask, SIGHUP);
+    sigaddset(signalMask, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, signalMask, NULL);
  
     SignalHandler* handler = malloc(sizeof(SignalHandler));
@@ -88,7 +331,11 @@ void* sigholdup_handler(void* args) {
     Server* server = handler->server;
     int signal;
     while (!sigwait(handler->signalMask, &signal)) {       
-        print_server_stats(server);
+        if (signal == SIGUSR1) {
+            reload_auth_table(server);
+        } else {
+            print_server_stats(server);
+        }
     }
     pthread_exit(0);
 }
@@ -181,18 +428,139 @@ Client* remove_client(Client* clientList, char* name) {
         // and then free
         Client* tempClient = clientList;
         clientList = clientList->next;
-        free_client(tempClient);
+        close_client(tempClient);
     
     // Otherwise, we can simply link up the previous clients and the
     // next clients ends and free the client in the middle
     } else {
         clientPrevious->next = clientToRemove->next;
-        free_client(clientToRemove);
+        close_client(clientToRemove);
+    }
+
+    return clientList;
+}
+
+Client* detach_client(Client* clientList, Client* client) {
+    
+    // Compare instances rather than names, as a detached client's name may
+    // already have been taken by a new client
+    Client* currentClient = clientList;
+    Client* previousClient = NULL;
+    while (currentClient != NULL && currentClient != client) {
+        previousClient = currentClient;
+        currentClient = currentClient->next;
     }
 
+    if (currentClient != NULL) {
+        if (previousClient == NULL) {
+            clientList = client->next;
+        } else {
+            previousClient->next = client->next;
+        }
+        client->next = NULL;
+    }
     return clientList;
 }
 
+/* Fires when a client has taken too long over its handshake, and shuts down
+ * its socket so that the handshake fails.
+ */
+static long long handshake_expired(Timer* timer) {
+    ClientTimers* timers = (ClientTimers*) timer->arg;
+    shutdown(timers->client->socket, SHUT_RDWR);
+    add_to_server_stats(timers->server, STAT_TIMEOUT);
+    return 0;
+}
+
+/* Fires when a client may have been idle for the server's idle timeout, and
+ * evicts it if so. Otherwise, fires again when it next could have been.
+ */
+static long long idle_expired(Timer* timer) {
+    ClientTimers* timers = (ClientTimers*) timer->arg;
+    long long idleTimeout = timers->server->options->idleTimeout;
+    long long idleMs = (current_time_us() - timers->lastActivity) / 1000;
+    if (idleMs < idleTimeout) {
+        return idleTimeout - idleMs;
+    }
+
+    evict_client(timers->client, "IDLE");
+    add_to_server_stats(timers->server, STAT_TIMEOUT);
+    return 0;
+}
+
+/* Fires every ping interval, and sends PING to the client if it has sent
+ * nothing in that time. The first unanswered PING is timed, so that the
+ * client's round trip time can be measured once it answers.
+ */
+static long long ping_due(Timer* timer) {
+    ClientTimers* timers = (ClientTimers*) timer->arg;
+    long long pingInterval = timers->server->options->pingInterval;
+    long long idleMs = (current_time_us() - timers->lastActivity) / 1000;
+    if (idleMs >= pingInterval) {
+        ClientMetrics* metrics = timers->client->metrics;
+        if (metrics->pingSentAt == 0) {
+            set_metric(&metrics->pingSentAt, current_time_us());
+        }
+        queue_control_message(timers->client, "PING:");
+        return pingInterval;
+    }
+    return pingInterval - idleMs;
+}
+
+void watch_handshake(Server* server, Client* client) {
+    ClientTimers* timers = malloc(sizeof(ClientTimers));
+    timers->server = server;
+    timers->client = client;
+    timers->lastActivity = current_time_us();
+    init_timer(&timers->handshake, handshake_expired, timers);
+    init_timer(&timers->idle, idle_expired, timers);
+    init_timer(&timers->ping, ping_due, timers);
+    client->timers = timers;
+
+    if (server->options->handshakeTimeout > 0) {
+        arm_timer(server->timers, &timers->handshake, 
+                server->options->handshakeTimeout);
+    }
+}
+
+void watch_connection(Server* server, Client* client) {
+    // Clients handed over from another process skip the handshake
+    if (client->timers == NULL) {
+        watch_handshake(server, client);
+    }
+    ClientTimers* timers = client->timers;
+    cancel_timer(server->timers, &timers->handshake);
+    timers->lastActivity = current_time_us();
+
+    ServerOptions* options = server->options;
+    if (options->idleTimeout > 0) {
+        arm_timer(server->timers, &timers->idle, options->idleTimeout);
+    }
+    if (options->pingInterval > 0) {
+        arm_timer(server->timers, &timers->ping, options->pingInterval);
+    }
+}
+
+void stop_watching(Client* client) {
+    ClientTimers* timers = client->timers;
+    if (timers == NULL) {
+        return;
+    }
+
+    TimerWheel* wheel = timers->server->timers;
+    cancel_timer(wheel, &timers->handshake);
+    cancel_timer(wheel, &timers->idle);
+    cancel_timer(wheel, &timers->ping);
+    free(timers);
+    client->timers = NULL;
+}
+
+void close_client(Client* client) {
+    stop_watching(client);
+    destroy_out_queue(client);
+    free_client(client);
+}
+
 void add_to_server_stats(Server* server, int statCode) {
     // If stat code in range, increment stat counter
     if (statCode >= 0 && statCode < NUM_SERVER_STATS) {
@@ -241,4 +609,57 @@ void print_server_stats(Server* server) {
             serverStats[STAT_LIST], serverStats[STAT_LEAVE]);
  
     release_lock(server->statsAccess);
+
+    // Finally, show which clients are falling behind on their messages
+    take_lock(server->clientAccess);
+    fprintf(stderr, "@OUTBOUND@\n");
+    for (currentClient = server->clientList; currentClient != NULL; 
+            currentClient = currentClient->next) {
+        OutQueue* queue = currentClient->outQueue;
+        ClientMetrics metrics;
+        snapshot_client_metrics(currentClient, &metrics);
+        take_lock(queue->queueAccess);
+        fprintf(stderr, "%s:QUEUED:%zu:DELIVERED:%lld:WRITES:%lld:"
+                "DROPPED:%lld:LAGGING:%d\n", currentClient->name, 
+                queue->queuedBytes, metrics.delivered, metrics.writes, 
+                metrics.dropped, queue->isLagging);
+        release_lock(queue->queueAccess);
+    }
+    release_lock(server->clientAccess);
+
+    take_lock(server->statsAccess);
+    fprintf(stderr, "server:DROPPED:%d:EVICTED:%d:TIMED_OUT:%d:REJECTED:%d\n", 
+            serverStats[STAT_DROP], serverStats[STAT_EVICT], 
+            serverStats[STAT_TIMEOUT], serverStats[STAT_REJECT]);
+    release_lock(server->statsAccess);
+
+    // Show how much traffic each connection is carrying
+    print_client_metrics(server);
+
+    // Show how well each compressed connection is compressing
+    take_lock(server->clientAccess);
+    fprintf(stderr, "@COMPRESSION@\n");
+    size_t plainTotal = 0;
+    size_t compressedTotal = 0;
+    for (currentClient = server->clientList; currentClient != NULL; 
+            currentClient = currentClient->next) {
+        Compression* compression = currentClient->compression;
+        if (compression != NULL) {
+            size_t plain = compression->plainOut + compression->plainIn;
+            size_t compressed = 
+                    compression->compressedOut + compression->compressedIn;
+            fprintf(stderr, "%s:SENT:%zu:RAW_SENT:%zu:RECEIVED:%zu:"
+                    "RAW_RECEIVED:%zu\n", currentClient->name, 
+                    compression->compressedOut, compression->plainOut,
+                    compression->compressedIn, compression->plainIn);
+            plainTotal += plain;
+            compressedTotal += compressed;
+        }
+    }
+    release_lock(server->clientAccess);
+    fprintf(stderr, "server:RATIO:%.2f\n", compressedTotal == 0 ? 1.0 :
+            (double) plainTotal / compressedTotal);
+
+    print_federation_stats(server);
+    TRACE_PRINT_STATS();
 }
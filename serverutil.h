@@ -7,15 +7,18 @@
 #include <semaphore.h>
 #include "sharedutil.h"
 #include "server.h"
-#define NUM_SERVER_STATS 6
+#define NUM_SERVER_STATS 10
 
 /* The setup_server_connection function sets up a server on the localhost
- * using IPv4 with the TCP protocol. 
+ * using IPv4 with the TCP protocol. If port is a path (containing a '/'), the
+ * server listens on a Unix domain socket at that path instead (see
+ * setup_unix_connection).
  *
  * It first creates a socket file descriptor on the specified port 
  * as a communication end-point, and then attaches the localhost address 
  * to this socket. The server then listens on this port to indicate 
- * willingness to accept connections.
+ * willingness to accept connections, with the kernel queueing up to backlog
+ * connections which have not yet been accepted.
  *
  * If an ephemeral port is used (either not specified or specified as 0),
  * then the server will output the free port it is given by the kernel to 
@@ -26,12 +29,111 @@
  *
  * Parameters:
  *      port - the port number which the server should listen on
+ *      backlog - the length of the queue of pending connections
  *
  * Returns:
  *      (int) 0 - if the server could not setup a connection
  *      (int) 1 - if the server successfully setup a connection.
  */
-int setup_server_connection(char* port);
+int setup_server_connection(char* port, int backlog);
+
+/* The setup_unix_connection function sets up a server listening on a Unix
+ * domain socket, for clients on the same host. These clients speak exactly
+ * the same protocol as clients connected over TCP, but skip the loopback
+ * network stack. Any stale socket left at the path by a previous server is
+ * replaced, and the path is output to stderr once the server is listening.
+ *
+ * Parameters:
+ *      path - the path of the socket
+ *      backlog - the length of the queue of pending connections
+ *
+ * Returns:
+ *      (int) 0 - if the server could not setup a connection
+ *      (int) - the listening socket, if the server successfully setup a
+ *          connection.
+ */
+int setup_unix_connection(char* path, int backlog);
+
+/* The print_listener_address function outputs the address a listening socket
+ * is bound to on stderr: its port for a TCP socket, or its path for a Unix
+ * domain socket.
+ *
+ * Parameters:
+ *      listener - a listening socket
+ */
+void print_listener_address(int listener);
+
+/* The parse_server_options function reads any options given to the server on
+ * the command line into a ServerOptions datastructure, filling in defaults
+ * for any options that are not given. The options accepted are:
+ *
+ *  --high-water bytes - the outbound queue size at which a client has fallen
+ *      behind (default DEFAULT_HIGH_WATER)
+ *  --low-water bytes - the outbound queue size at which a client which has 
+ *      fallen behind has caught up (default DEFAULT_LOW_WATER)
+ *  --slow-policy oldest|new|disconnect - whether a client which has fallen 
+ *      behind has its oldest or newest messages dropped, or is disconnected
+ *      (default disconnect)
+ *  --coalesce-window ms - how long messages may be held back to be written to
+ *      a client in one batch, which may be fractional (default 0)
+ *  --handoff-path path - a Unix domain socket path which new server processes
+ *      can connect to in order to take over from this server
+ *  --takeover path - take over from the running server with this handoff
+ *      path, instead of listening on a port
+ *  --federation-listen address - a Unix domain socket path or loopback port
+ *      which other server processes can link to, so that they share one room
+ *  --peer address - the federation address of another server process to link
+ *      to, which may be given more than once
+ *  --compress-level 0-9 - the zlib level used for clients which ask for
+ *      compression, trading CPU time for bandwidth, where 0 refuses to
+ *      compress (default DEFAULT_COMPRESS_LEVEL)
+ *  --handshake-timeout ms - how long a new connection has to finish its
+ *      handshake, where 0 waits forever (default DEFAULT_HANDSHAKE_TIMEOUT)
+ *  --idle-timeout ms - how long a client may send nothing before it is
+ *      disconnected, where 0 waits forever (default 0)
+ *  --ping-interval ms - how long a client may send nothing before it is sent
+ *      PING, where 0 never sends PING (default 0)
+ *  --max-clients n - how many connections the server holds at once, beyond
+ *      which new ones are sent ERR:FULL and closed, where 0 is unlimited
+ *      (default DEFAULT_MAX_CLIENTS)
+ *  --max-per-address n - how many of those connections may come from one
+ *      source address, beyond which new ones are sent ERR:BUSY and closed,
+ *      where 0 is unlimited (default 0)
+ *  --backlog n - how many connections the kernel queues before they are
+ *      accepted (default SOMAXCONN)
+ *  --workers n - how many threads run client commands, at least 1 (default
+ *      DEFAULT_WORKERS)
+ *  --fanout-threads n - how many threads help to queue broadcasts to rooms of
+ *      at least FANOUT_THRESHOLD members, where 0 queues every broadcast on
+ *      one thread (default one fewer than the number of processors)
+ *  --unix-listen path - also accept clients on the same host on a Unix
+ *      domain socket at this path
+ *  --resume-history n - how many recent broadcasts are kept for clients
+ *      which resume their sessions, where 0 never gives out sessions
+ *      (default DEFAULT_RESUME_HISTORY)
+ *  --resume-grace ms - how long a client whose connection drops has to
+ *      resume its session before it is said to have left, where 0 says so
+ *      straight away (default DEFAULT_RESUME_GRACE)
+ *  --max-message bytes - the most bytes of a single chat message which are
+ *      streamed to the room (default DEFAULT_MAX_MESSAGE)
+ *  --presence-window ms - how long ENTER and LEAVE events may be held back
+ *      to be sent to the room in one batch, which may be fractional, where 0
+ *      sends each on its own (default DEFAULT_PRESENCE_WINDOW)
+ *  --trace-sample n - trace one in every n SAY messages, only when built with
+ *      TRACE (default TRACE_DEFAULT_SAMPLE)
+ *  --trace-file path - write a Chrome trace of the latest traced messages
+ *      here whenever the stats are printed, only when built with TRACE
+ *
+ * Parameters:
+ *      argc - The number of command line arguments
+ *      argv - The command line arguments
+ *      options - The datastructure which the options are read into
+ *
+ * Returns:
+ *      (int) - The index in argv of the first positional argument
+ *      (int) -1 - if any of the options are invalid
+ */
+int parse_server_options(int argc, char* argv[], ServerOptions* options);
 
 /* The setup_server_instance function initiliases the main server datastructure
  * that is used by the server to keep track of all necessary variables. The
@@ -40,17 +142,20 @@ int setup_server_connection(char* port);
  * can be found in the server.h header file.
  *
  * Parameters:
- *      authString - The auth string given in the authfile when the server is 
- *          created.
+ *      authPath - The path of the authfile given when the server is created.
+ *      authTable - The tokens read from the authfile (see authtable.h).
+ *      options - The settings given to the server on the command line
  * Returns:
  *      (Server*) - A pointer to the main server datastructure which has just
  *          been initiliased.
  */
-Server* setup_server_instance(char* authString);
+Server* setup_server_instance(char* authPath, struct AuthTable* authTable,
+        ServerOptions* options);
 
 /* The initialise_sighup_handler function creates a pthread signal mask which
- * blocks on SIGHUP when sigwait is called. It then creates a dedicated signal
- * handling thread which given this signal mask, and an instance of the server.
+ * blocks on SIGHUP and SIGUSR1 when sigwait is called. It then creates a
+ * dedicated signal handling thread which given this signal mask, and an
+ * instance of the server.
  * The signal handling thread is run with the sigholdup_handler routine, and is
  * run in a detached state so that pthread memory is freed on exit.
  *
@@ -64,7 +169,9 @@ void initialise_sighup_handler(Server* server);
  *
  * If sigwait(3) does not return an error, then the thread simply blocks until 
  * the process is sent a SIGHUP. When a SIGHUP is received, this thread will 
- * print the server's statistics and then wait for another SIGHUP. 
+ * print the server's statistics and then wait for another SIGHUP. When a
+ * SIGUSR1 is received, it reloads the server's authfile instead (see
+ * reload_auth_table in authtable.h).
  *
  * If there is while error calling sigwait(3), then the thread exits.
  *
@@ -138,6 +245,58 @@ Client* get_previous_client(Client* clientList, char* name);
  */
 Client* remove_client(Client* clientList, char* name);
 
+/* The detach_client function unlinks a client instance from the server's
+ * client list without freeing it, so that no other thread can reach it. Its
+ * memory can then be reclaimed with close_client once the client's own
+ * thread has finished with it.
+ *
+ * Parameters:
+ *      clientList - A pointer to the head of the server's client list.
+ *      client - The client instance to unlink, if it is in the list.
+ *
+ * Returns:
+ *      (Client*) - An updated pointer to the head of the client list.
+ */
+Client* detach_client(Client* clientList, Client* client);
+
+/* The watch_handshake function starts a new client's timers, and arms its
+ * handshake deadline if the server has a handshake timeout. When the deadline
+ * passes, the client's socket is shut down, so the handshake fails.
+ *
+ * Parameters:
+ *      server - The main server datastructure
+ *      client - A newly connected client
+ */
+void watch_handshake(Server* server, Client* client);
+
+/* The watch_connection function is called once a client has joined the
+ * server. It cancels the client's handshake deadline, and arms its idle
+ * timeout and keepalive, if the server has them. An idle client is evicted
+ * with ERR:IDLE.
+ *
+ * Parameters:
+ *      server - The main server datastructure
+ *      client - A client which has joined the server
+ */
+void watch_connection(Server* server, Client* client);
+
+/* The stop_watching function cancels all of a client's timers, and frees
+ * them. Once this returns, none of the client's timers are running.
+ *
+ * Parameters:
+ *      client - A client instance, which may not have any timers
+ */
+void stop_watching(Client* client);
+
+/* The close_client function stops a client's timers and writer thread and
+ * destroys its outbound queue, before freeing all of the client's memory.
+ * This should be used serverside in place of free_client.
+ *
+ * Parameters:
+ *      client - An instance of a client that will have its memory cleaned up.
+ */
+void close_client(Client* client);
+
 /* The add_to_server_stats function increments a statistic in the server by 1
  * if a valid statCode index is given (see Stats enumeration in server.h 
  * for valid codes). Otherwise, it does nothing.
@@ -160,7 +319,13 @@ void add_to_client_stats(Client* client, int statCode);
 
 /* The print_server_stats function grabs all currently connected client stats,
  * and the cumulative server stats, formats them, and displays them 
- * on the server's stdout.
+ * on the server's stdout. These are followed by an @OUTBOUND@ section, which
+ * shows how far behind each client is, how many writes have been needed to
+ * deliver its messages, and how many messages have been dropped and clients
+ * evicted by the slow consumer policy. A @COMPRESSION@ section then shows the
+ * bytes each compressed connection has sent and received, before and after
+ * compression, along with the overall compression ratio, and a @FEDERATION@
+ * section shows the server's peer links (see print_federation_stats).
  *
  * Parameters:
  *      server - The main server datastructure
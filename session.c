@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/random.h>
+#include "server.h"
+#include "serverutil.h"
+#include "sharedutil.h"
+#include "outqueue.h"
+#include "clienttable.h"
+#include "nametable.h"
+#include "federation.h"
+#include "fanout.h"
+#include "session.h"
+
+SessionTable* create_session_table(int historySize) {
+    SessionTable* table = malloc(sizeof(SessionTable));
+    table->numBuckets = SESSION_TABLE_INITIAL;
+    table->buckets = calloc(table->numBuckets, sizeof(Session*));
+    table->numSessions = 0;
+    table->lastSequence = 0;
+    table->historySize = historySize;
+    table->history = calloc(historySize + 1, sizeof(char*));
+    return table;
+}
+
+char* record_broadcast(SessionTable* table, char* message) {
+    if (table->historySize == 0) {
+        return NULL;
+    }
+    table->lastSequence++;
+    char** entry = &table->history[table->lastSequence % table->historySize];
+    free(*entry);
+    *entry = malloc(strlen(message) + 26);
+    sprintf(*entry, "SEQ:%llu:%s", table->lastSequence, message);
+    return *entry;
+}
+
+/* Finds the session with the given token, or NULL if there is none. Tokens
+ * are random, so their low bits are used as the hash.
+ */
+static Session* find_session(SessionTable* table, unsigned long long token) {
+    Session* session = table->buckets[token & (table->numBuckets - 1)];
+    while (session != NULL && session->token != token) {
+        session = session->next;
+    }
+    return session;
+}
+
+/* Doubles the number of buckets in the table, moving every session into its
+ * new bucket.
+ */
+static void grow_session_table(SessionTable* table) {
+    int numBuckets = table->numBuckets * 2;
+    Session** buckets = calloc(numBuckets, sizeof(Session*));
+    for (int i = 0; i < table->numBuckets; i++) {
+        Session* session = table->buckets[i];
+        while (session != NULL) {
+            Session* next = session->next;
+            Session** bucket = &buckets[session->token & (numBuckets - 1)];
+            session->next = *bucket;
+            *bucket = session;
+            session = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->numBuckets = numBuckets;
+}
+
+/* Adds a new session with the given token to the table, held by a client
+ * which will be sent every broadcast with its sequence number.
+ */
+static void add_session(SessionTable* table, Client* client,
+        unsigned long long token) {
+    if (table->numSessions >= table->numBuckets) {
+        grow_session_table(table);
+    }
+
+    Session* session = malloc(sizeof(Session));
+    session->token = token;
+    session->client = client;
+    session->isDetached = 0;
+    session->isEnded = 0;
+    session->resumed = malloc(sizeof(sem_t));
+    sem_init(session->resumed, 0, 0);
+    Session** bucket = &table->buckets[token & (table->numBuckets - 1)];
+    session->next = *bucket;
+    *bucket = session;
+    table->numSessions++;
+
+    client->session = session;
+    client->outQueue->isSequenced = 1;
+}
+
+/* Takes a session out of the table and frees it.
+ */
+static void remove_session(SessionTable* table, Session* session) {
+    Session** link = &table->buckets[session->token & (table->numBuckets - 1)];
+    while (*link != session) {
+        link = &(*link)->next;
+    }
+    *link = session->next;
+    table->numSessions--;
+    sem_destroy(session->resumed);
+    free(session->resumed);
+    free(session);
+}
+
+/* Releases the name of a detached session's client, and tells the room that
+ * the client has left.
+ */
+static void announce_departure(Server* server, Session* session) {
+    char* name = session->client->name;
+    char buffer[strlen(name) + 7];
+    sprintf(buffer, "LEAVE:%s", name);
+    remove_client_name(server->nameTable, name);
+    broadcast_to_clients(server, buffer);
+    federate_event(server, buffer);
+}
+
+void open_session(Server* server, Client* client) {
+    // Zero is never a token, so that it can stand for no session
+    unsigned long long token = 0;
+    while (token == 0 || find_session(server->sessions, token) != NULL) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            token = (unsigned long long) current_time_us() *
+                    2654435761ULL ^ (unsigned long long) client;
+        }
+    }
+    add_session(server->sessions, client, token);
+    update_client_slot(server->clientTable, client);
+
+    char reply[strlen("SESSION:") + 17];
+    sprintf(reply, "SESSION:%016llx", token);
+    queue_control_message(client, reply);
+}
+
+int resume_session(Server* server, Client* client, unsigned long long token) {
+    Session* session = find_session(server->sessions, token);
+    if (session == NULL || session->isEnded) {
+        return 0;
+    }
+
+    // A session still held by a connection in the client list is taken from
+    // it, as that connection is most likely the one which dropped
+    Client* previous = session->client;
+    if (!session->isDetached) {
+        if (find_client_slot(server->clientTable, previous->handle) !=
+                previous) {
+            return 0;
+        }
+        server->clientList = detach_client(server->clientList, previous);
+        remove_client_slot(server->clientTable, previous);
+        disconnect_client(previous, "ERR:RESUMED");
+    }
+
+    client->name = strcpy(realloc(client->name, strlen(previous->name) + 1),
+            previous->name);
+    client->session = session;
+    client->outQueue->isSequenced = 1;
+    session->client = client;
+    if (session->isDetached) {
+        session->isDetached = 0;
+        sem_post(session->resumed);
+    }
+    return 1;
+}
+
+/* Returns the sequence number of the oldest broadcast still in the history.
+ */
+static unsigned long long first_in_history(SessionTable* table) {
+    return table->lastSequence > table->historySize ?
+            table->lastSequence - table->historySize + 1 : 1;
+}
+
+int can_replay_from(SessionTable* table, unsigned long long lastSequence) {
+    return lastSequence + 1 >= first_in_history(table);
+}
+
+void replay_broadcasts(Server* server, Client* client,
+        unsigned long long lastSequence) {
+    SessionTable* table = server->sessions;
+    unsigned long long first = first_in_history(table);
+    if (lastSequence + 1 > first) {
+        first = lastSequence + 1;
+    }
+    int isUnchunked = rendition_for(client->outQueue) & RENDER_UNCHUNKED;
+    for (unsigned long long sequence = first;
+            sequence <= table->lastSequence; sequence++) {
+        char* message = table->history[sequence % table->historySize];
+
+        // The history keeps the copy for clients which asked for
+        // CAPS:CHUNKED, so any other client is sent each piece as MSG
+        char* event = strchr(strchr(message, ':') + 1, ':') + 1;
+        if (isUnchunked &&
+                !strncmp(event, "MSGPART:", strlen("MSGPART:"))) {
+            char unchunked[strlen(message) + 1];
+            sprintf(unchunked, "SEQ:%llu:MSG:%s", sequence,
+                    event + strlen("MSGPART:"));
+            enqueue_message(client->outQueue, unchunked);
+        } else {
+            enqueue_message(client->outQueue, message);
+        }
+    }
+}
+
+int detach_session(Server* server, Client* client) {
+    Session* session = client->session;
+    if (session == NULL || session->client != client ||
+            client->outQueue->isEvicted ||
+            server->options->resumeGrace == 0) {
+        return 0;
+    }
+
+    // Forget any wakeup left over from an earlier resume
+    while (!sem_trywait(session->resumed)) {
+        ;
+    }
+    session->isDetached = 1;
+    return 1;
+}
+
+void wait_for_resume(Server* server, Client* client) {
+    Session* session = client->session;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long grace = server->options->resumeGrace;
+    long long nanoseconds = deadline.tv_nsec + (grace % 1000) * 1000000;
+    deadline.tv_sec += grace / 1000 + nanoseconds / 1000000000;
+    deadline.tv_nsec = nanoseconds % 1000000000;
+    while (sem_timedwait(session->resumed, &deadline) && errno == EINTR) {
+        ;
+    }
+
+    // Whether the session was resumed is only decided under clientAccess, as
+    // it may have been resumed after the wait timed out
+    take_lock(server->clientAccess);
+    if (session->client == client) {
+        if (!session->isEnded) {
+            announce_departure(server, session);
+        }
+        remove_session(server->sessions, session);
+    }
+    client->session = NULL;
+    release_lock(server->clientAccess);
+}
+
+void close_session(Server* server, Client* client) {
+    Session* session = client->session;
+    if (session != NULL && session->client == client) {
+        remove_session(server->sessions, session);
+    }
+    client->session = NULL;
+}
+
+/* Gives up on a detached session, telling the room that its client has
+ * left, and wakes the thread of the connection which dropped.
+ */
+static void end_detached_session(Server* server, Session* session) {
+    session->isEnded = 1;
+    announce_departure(server, session);
+    sem_post(session->resumed);
+}
+
+void end_session(Server* server, unsigned long long token) {
+    Session* session = find_session(server->sessions, token);
+    if (session == NULL || session->isEnded) {
+        return;
+    }
+
+    // A connection still holding the session leaves the room as normal once
+    // it has been disconnected
+    if (session->isDetached) {
+        end_detached_session(server, session);
+    } else {
+        disconnect_client(session->client, "ERR:RESUMED");
+    }
+}
+
+void end_detached_sessions(Server* server) {
+    SessionTable* table = server->sessions;
+    for (int i = 0; i < table->numBuckets; i++) {
+        for (Session* session = table->buckets[i]; session != NULL;
+                session = session->next) {
+            if (session->isDetached && !session->isEnded) {
+                end_detached_session(server, session);
+            }
+        }
+    }
+}
+
+void restore_session(Server* server, Client* client, unsigned long long token) {
+    add_session(server->sessions, client, token);
+}
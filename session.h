@@ -0,0 +1,238 @@
+#ifndef SESSION_H
+#define SESSION_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "server.h"
+#define SESSION_TABLE_INITIAL 256
+
+/* The Session datastructure holds a single resumable session, given to a
+ * client which asked for CAPS:RESUME when it joined. The session outlives
+ * the connection it was opened on: if that connection drops without the
+ * client leaving, then the client's name is kept, nobody is told it has
+ * gone, and a new connection presenting the session's token within the
+ * server's resume grace period takes its place as if it had never left.
+ *
+ * token: The random token the client resumes the session with.
+ *
+ * client: The client holding the session. While the session is detached,
+ *  this is still the client whose connection dropped, whose thread waits to
+ *  see whether the session is resumed.
+ *
+ * isDetached: Set while the session's connection has dropped, and nothing
+ *  has resumed it yet.
+ *
+ * isEnded: Set once a detached session has been given up on, and the room
+ *  has been told that its client has left.
+ *
+ * resumed: Posted when a detached session is resumed or ended, waking the
+ *  thread of the connection which dropped.
+ *
+ * next: A pointer to the next session in the same bucket.
+ */
+typedef struct Session {
+    unsigned long long token;
+    Client* client;
+    int isDetached;
+    int isEnded;
+    sem_t* resumed;
+    struct Session* next;
+} Session;
+
+/* The SessionTable datastructure holds every resumable session in the
+ * server, hashed by token, along with a bounded history of recent
+ * broadcasts. Every broadcast is given the next sequence number, and clients
+ * holding a session are sent it as SEQ:<sequence>:<message>. A client which
+ * resumes presents the last sequence number it saw, and is sent only the
+ * broadcasts it missed from the history, so a reconnect costs the messages
+ * missed rather than a full join. The table is only changed or read while
+ * holding the server's clientAccess.
+ *
+ * buckets: The hash buckets, each a linked list of Sessions.
+ *
+ * numBuckets: The number of buckets, which is always a power of 2.
+ *
+ * numSessions: The number of sessions in the table. The table doubles its
+ *  buckets once there are more sessions than buckets.
+ *
+ * lastSequence: The sequence number of the most recent broadcast.
+ *
+ * history: The most recent historySize broadcasts, each already prefixed
+ *  with its sequence number, where sequence s is held at s % historySize.
+ *
+ * historySize: The number of broadcasts kept, or 0 if sessions cannot be
+ *  resumed.
+ */
+typedef struct SessionTable {
+    Session** buckets;
+    int numBuckets;
+    int numSessions;
+    unsigned long long lastSequence;
+    char** history;
+    int historySize;
+} SessionTable;
+
+/* The create_session_table function initialises an empty session table with
+ * SESSION_TABLE_INITIAL buckets, and room for the given number of broadcasts
+ * in its history.
+ *
+ * Parameters:
+ *      historySize - The number of broadcasts to keep, or 0
+ *
+ * Returns:
+ *      (SessionTable*) - The newly allocated table
+ */
+SessionTable* create_session_table(int historySize);
+
+/* The record_broadcast function gives a broadcast the next sequence number,
+ * and keeps it in the history, pushing out the oldest broadcast if the
+ * history is full.
+ *
+ * Parameters:
+ *      table - The server's session table
+ *      message - The message being broadcast
+ *
+ * Returns:
+ *      (char*) - The message prefixed with its sequence number, which is
+ *          owned by the table and only valid until clientAccess is released
+ *      (char*) NULL - if the server keeps no history
+ */
+char* record_broadcast(SessionTable* table, char* message);
+
+/* The open_session function gives a client which asked for CAPS:RESUME a new
+ * session with a random token, and sends the client SESSION:<token>. Every
+ * broadcast the client is sent from then on carries its sequence number. The
+ * caller must hold clientAccess.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - A client which has just been added to the client list
+ */
+void open_session(Server* server, Client* client);
+
+/* The resume_session function hands a session to a client which has sent
+ * RESUME:<token>:<sequence> in place of its name, if the session is detached,
+ * or is still held by a connection in the client list (which the server may
+ * not yet have noticed has dropped). That connection is then disconnected
+ * with ERR:RESUMED, without the room being told. The client takes the
+ * session's name, which is still in use, so the caller must not add the name
+ * again. A kicked client's session cannot be resumed. The caller must hold
+ * clientAccess.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - A client which has authenticated
+ *      token - The token the client presented
+ *
+ * Returns:
+ *      (int) 0 - if there is no such session to resume
+ *      (int) 1 - if the client now holds the session
+ */
+int resume_session(Server* server, Client* client, unsigned long long token);
+
+/* The can_replay_from function checks whether the history still holds every
+ * broadcast after the given sequence number, so that a client which last saw
+ * it can be caught up completely.
+ *
+ * Parameters:
+ *      table - The server's session table
+ *      lastSequence - The last sequence number a client saw
+ *
+ * Returns:
+ *      (int) 1 - if no broadcast the client missed has left the history
+ *      (int) 0 - if some have, so the session cannot be resumed
+ */
+int can_replay_from(SessionTable* table, unsigned long long lastSequence);
+
+/* The replay_broadcasts function queues every broadcast in the history after
+ * the given sequence number for a client which has resumed its session, which
+ * should first be checked with can_replay_from. Each is sent as the copy the
+ * client would have been sent at the time (see rendition_for), so pieces of a
+ * long chat message are sent as MSG unless it asked for CAPS:CHUNKED. The
+ * caller must hold clientAccess, and only add the client to the client table
+ * afterwards, so that no broadcast can come between the two.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - A client which has just resumed its session
+ *      lastSequence - The last sequence number the client saw
+ */
+void replay_broadcasts(Server* server, Client* client,
+        unsigned long long lastSequence);
+
+/* The detach_session function keeps a client's session open once its
+ * connection has dropped without the client leaving, so that it can be
+ * resumed. A client which was evicted by the server cannot be detached. The
+ * caller must hold clientAccess, and have taken the client out of the client
+ * list and table but not the name table.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - A client whose connection has dropped
+ *
+ * Returns:
+ *      (int) 0 - if the client has no session to keep, and should leave
+ *      (int) 1 - if the session has been detached, after which the client's
+ *          thread should call wait_for_resume
+ */
+int detach_session(Server* server, Client* client);
+
+/* The wait_for_resume function waits for a detached session to be resumed,
+ * for at most the server's resume grace period. If it is not, then the
+ * client's name is released and the room is told that it has left, just as
+ * if it had left when its connection dropped. Either way, the session no
+ * longer belongs to the client once this returns. It must be called without
+ * clientAccess held.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - A client whose session has been detached
+ */
+void wait_for_resume(Server* server, Client* client);
+
+/* The close_session function ends a client's session when the client leaves
+ * (or is kicked or evicted), unless the session has since been resumed by
+ * another connection. Clients without a session are ignored. The caller must
+ * hold clientAccess.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - A client which is leaving
+ */
+void close_session(Server* server, Client* client);
+
+/* The end_session function ends the session with the given token, e.g. once
+ * the broadcasts its client missed have left the history, so that the client
+ * can join afresh. A detached session is given up on, and the room is told
+ * that its client has left. A connection still holding the session is
+ * disconnected with ERR:RESUMED, and leaves the room as normal. Tokens with
+ * no session are ignored. The caller must hold clientAccess.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      token - The token the client presented
+ */
+void end_session(Server* server, unsigned long long token);
+
+/* The end_detached_sessions function gives up on every detached session
+ * straight away, telling the room that each of their clients has left, e.g.
+ * before the server is handed over to another process, which only takes
+ * over connected clients. The caller must hold clientAccess.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ */
+void end_detached_sessions(Server* server);
+
+/* The restore_session function gives a client handed over from another
+ * server process the session it held there, so that it can still resume it.
+ *
+ * Parameters:
+ *      server - An instance of the main server datastructure
+ *      client - A client restored from the other server process
+ *      token - The session's token
+ */
+void restore_session(Server* server, Client* client, unsigned long long token);
+#endif
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "sharedutil.h"
+#include "sharedring.h"
+
+/* The size of each ring in the mapping, including its header.
+ */
+#define RING_STRIDE (sizeof(RingHeader) + RING_SIZE)
+
+/* Points one end's view of a ring at ring number which (0 for the ring the
+ * client writes to, 1 for the ring the server writes to) in the mapping.
+ */
+static void map_ring(SharedRings* rings, SharedRing* ring, int which) {
+    ring->header = (RingHeader*) (rings->mapping + which * RING_STRIDE);
+    ring->data = rings->mapping + which * RING_STRIDE + sizeof(RingHeader);
+    ring->index = 0;
+    ring->dataEvent = rings->fds[1 + which * 2];
+    ring->spaceEvent = rings->fds[2 + which * 2];
+}
+
+/* Wakes whichever end is waiting on an eventfd. The eventfd is non-blocking,
+ * so this can never stall, and a count which has somehow reached its limit
+ * wakes the end anyway.
+ */
+static void signal_event(int event) {
+    uint64_t one = 1;
+    write(event, &one, sizeof(uint64_t));
+}
+
+SharedRings* create_shared_rings(void) {
+    SharedRings* rings = malloc(sizeof(SharedRings));
+    for (int i = 0; i < RING_FDS; i++) {
+        rings->fds[i] = -1;
+    }
+    rings->mapping = MAP_FAILED;
+
+    rings->fds[0] = memfd_create("chat-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    int isReady = rings->fds[0] >= 0 &&
+            !ftruncate(rings->fds[0], 2 * RING_STRIDE) &&
+            !fcntl(rings->fds[0], F_ADD_SEALS,
+                F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    for (int i = 1; i < RING_FDS && isReady; i++) {
+        rings->fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        isReady = rings->fds[i] >= 0;
+    }
+    if (isReady) {
+        rings->mapping = mmap(NULL, 2 * RING_STRIDE, PROT_READ | PROT_WRITE,
+                MAP_SHARED, rings->fds[0], 0);
+    }
+    if (rings->mapping == MAP_FAILED) {
+        rings->mapping = NULL;
+        free_shared_rings(rings);
+        return NULL;
+    }
+
+    // The client writes to the first ring, and reads from the second
+    map_ring(rings, &rings->outbound, 0);
+    map_ring(rings, &rings->inbound, 1);
+    return rings;
+}
+
+int offer_shared_rings(Client* client, char* message) {
+    SharedRings* rings = client->offeredRings;
+    sanitise_message(message);
+    size_t length = strlen(message) + 1;
+    char line[length + 1];
+    sprintf(line, "%s\n", message);
+
+    char control[CMSG_SPACE(sizeof(int) * RING_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec vector = {.iov_base = line, .iov_len = length};
+    struct msghdr header = {
+        .msg_iov = &vector, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr* attached = CMSG_FIRSTHDR(&header);
+    attached->cmsg_level = SOL_SOCKET;
+    attached->cmsg_type = SCM_RIGHTS;
+    attached->cmsg_len = CMSG_LEN(sizeof(int) * RING_FDS);
+    memcpy(CMSG_DATA(attached), rings->fds, sizeof(int) * RING_FDS);
+
+    // The file descriptors go with the first byte, so send any remainder
+    // as normal
+    take_lock(client->writeLock);
+    ssize_t sent = sendmsg(client->socket, &header, MSG_NOSIGNAL);
+    size_t offset = sent > 0 ? sent : 0;
+    while (sent > 0 && offset < length) {
+        sent = send(client->socket, line + offset, length - offset,
+                MSG_NOSIGNAL);
+        offset += sent > 0 ? sent : 0;
+    }
+    release_lock(client->writeLock);
+    return offset == length;
+}
+
+void take_offered_rings(Client* client, int* fds, int numFds) {
+    struct stat status;
+    int seals = numFds == RING_FDS ? fcntl(fds[0], F_GET_SEALS) : -1;
+    if (client->rings != NULL || client->offeredRings != NULL ||
+            seals < 0 || !(seals & F_SEAL_SHRINK) ||
+            fstat(fds[0], &status) || status.st_size != 2 * RING_STRIDE) {
+        for (int i = 0; i < numFds; i++) {
+            close(fds[i]);
+        }
+        return;
+    }
+
+    SharedRings* rings = malloc(sizeof(SharedRings));
+    memcpy(rings->fds, fds, sizeof(int) * RING_FDS);
+    rings->mapping = mmap(NULL, 2 * RING_STRIDE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fds[0], 0);
+    if (rings->mapping == MAP_FAILED) {
+        rings->mapping = NULL;
+        free_shared_rings(rings);
+        return;
+    }
+
+    // Waking the client must never block the server, whatever it passed
+    for (int i = 1; i < RING_FDS; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+    map_ring(rings, &rings->inbound, 0);
+    map_ring(rings, &rings->outbound, 1);
+    client->offeredRings = rings;
+}
+
+void enable_shared_rings(Client* client) {
+    client->rings = client->offeredRings;
+    client->offeredRings = NULL;
+}
+
+ssize_t ring_send(SharedRings* rings, char* bytes, size_t length) {
+    SharedRing* ring = &rings->outbound;
+    unsigned long long used = ring->index -
+            __atomic_load_n(&ring->header->readIndex, __ATOMIC_SEQ_CST);
+    if (used > RING_SIZE) {
+        errno = EPROTO;
+        return -1;
+    } else if (used == RING_SIZE) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Copy in as much as fits, wrapping around the end of the ring
+    size_t count = length < RING_SIZE - used ? length : RING_SIZE - used;
+    size_t offset = ring->index & (RING_SIZE - 1);
+    size_t first = count < RING_SIZE - offset ? count : RING_SIZE - offset;
+    memcpy(ring->data + offset, bytes, first);
+    memcpy(ring->data, bytes + first, count - first);
+
+    // Publish the bytes, then wake the reader only if it could have seen the
+    // ring empty. Both accesses are sequentially consistent, so either the
+    // reader sees the new index, or this sees the reader caught up.
+    unsigned long long previous = ring->index;
+    ring->index += count;
+    __atomic_store_n(&ring->header->writeIndex, ring->index, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->header->readIndex, __ATOMIC_SEQ_CST) ==
+            previous) {
+        signal_event(ring->dataEvent);
+    }
+    return count;
+}
+
+size_t ring_available(SharedRings* rings) {
+    SharedRing* ring = &rings->inbound;
+    return __atomic_load_n(&ring->header->writeIndex, __ATOMIC_SEQ_CST) -
+            ring->index;
+}
+
+ssize_t ring_receive(SharedRings* rings, char* space, size_t size) {
+    SharedRing* ring = &rings->inbound;
+    unsigned long long available =
+            __atomic_load_n(&ring->header->writeIndex, __ATOMIC_SEQ_CST) -
+            ring->index;
+    if (available > RING_SIZE) {
+        errno = EPROTO;
+        return -1;
+    } else if (available == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t count = size < available ? size : available;
+    size_t offset = ring->index & (RING_SIZE - 1);
+    size_t first = count < RING_SIZE - offset ? count : RING_SIZE - offset;
+    memcpy(space, ring->data + offset, first);
+    memcpy(space + first, ring->data, count - first);
+
+    // Free the space, then wake the writer only if it could have seen the
+    // ring full
+    unsigned long long previous = ring->index;
+    ring->index += count;
+    __atomic_store_n(&ring->header->readIndex, ring->index, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->header->writeIndex, __ATOMIC_SEQ_CST) -
+            previous == RING_SIZE) {
+        signal_event(ring->spaceEvent);
+    }
+    return count;
+}
+
+int wait_for_ring(SharedRings* rings, int socket, short events, int timeout) {
+    struct pollfd waits[] = {
+        {.fd = events == POLLIN ? rings->inbound.dataEvent :
+            rings->outbound.spaceEvent, .events = POLLIN},
+        {.fd = socket, .events = POLLIN}
+    };
+    int result = poll(waits, 2, timeout);
+
+    // Nothing is sent on the socket once the rings are in use, so anything
+    // there is the other end leaving
+    if (result > 0 && waits[1].revents) {
+        errno = EPIPE;
+        return -1;
+    } else if (result > 0) {
+        // Reset the eventfd, so that the next wait blocks until the next
+        // wakeup
+        uint64_t count;
+        read(waits[0].fd, &count, sizeof(uint64_t));
+        return 1;
+    }
+    return result;
+}
+
+ssize_t read_shared_rings(SharedRings* rings, int socket, char* space,
+        size_t size) {
+    while (1) {
+        ssize_t bytesRead = ring_receive(rings, space, size);
+        if (bytesRead >= 0 || errno != EAGAIN) {
+            return bytesRead;
+        }
+        if (wait_for_ring(rings, socket, POLLIN, -1) < 0) {
+            if (errno != EPIPE) {
+                return -1;
+            }
+            // The other end has gone, but anything it wrote first is still
+            // read before EOF
+            bytesRead = ring_receive(rings, space, size);
+            return bytesRead > 0 ? bytesRead : 0;
+        }
+    }
+}
+
+int write_shared_rings(SharedRings* rings, int socket, char* bytes,
+        size_t length) {
+    while (length > 0) {
+        ssize_t written = ring_send(rings, bytes, length);
+        if (written > 0) {
+            bytes += written;
+            length -= written;
+        } else if (errno != EAGAIN ||
+                (wait_for_ring(rings, socket, POLLOUT, -1) < 0 &&
+                errno != EINTR)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void free_shared_rings(SharedRings* rings) {
+    if (rings == NULL) {
+        return;
+    }
+    if (rings->mapping != NULL) {
+        munmap(rings->mapping, 2 * RING_STRIDE);
+    }
+    for (int i = 0; i < RING_FDS; i++) {
+        if (rings->fds[i] >= 0) {
+            close(rings->fds[i]);
+        }
+    }
+    free(rings);
+}
@@ -0,0 +1,229 @@
+#ifndef SHAREDRING_H
+#define SHAREDRING_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "sharedutil.h"
+#define CACHE_LINE 64
+#define RING_SIZE (1 << 20)
+#define RING_FDS 5
+
+/* The RingHeader datastructure sits in front of each ring's bytes in the
+ * shared mapping. Both indexes only ever grow, and count every byte that has
+ * passed through the ring, so the bytes waiting in it are those between
+ * readIndex and writeIndex, at those indexes modulo RING_SIZE. Each index is
+ * only written by one end, and sits on its own cache line so that the two
+ * ends never contend over the same line.
+ *
+ * writeIndex: The number of bytes ever written to the ring.
+ *
+ * readIndex: The number of bytes ever read from the ring.
+ */
+typedef struct RingHeader {
+    volatile unsigned long long writeIndex __attribute__((aligned(CACHE_LINE)));
+    volatile unsigned long long readIndex __attribute__((aligned(CACHE_LINE)));
+} RingHeader;
+
+/* The SharedRing datastructure holds one end's view of a single direction of
+ * a shared memory connection.
+ *
+ * header: The ring's indexes in the shared mapping.
+ *
+ * data: The ring's RING_SIZE bytes in the shared mapping.
+ *
+ * index: This end's own index (the write index of a ring it writes to, or the
+ *  read index of a ring it reads from). This end's index is never read back
+ *  from the mapping, so the other end cannot make it read or write outside of
+ *  the ring.
+ *
+ * dataEvent: An eventfd written to whenever the ring goes from empty to not
+ *  empty, which the reading end waits on.
+ *
+ * spaceEvent: An eventfd written to whenever the ring goes from full to not
+ *  full, which the writing end waits on.
+ */
+typedef struct SharedRing {
+    RingHeader* header;
+    char* data;
+    unsigned long long index;
+    int dataEvent;
+    int spaceEvent;
+} SharedRing;
+
+/* The SharedRings datastructure holds a connection between a client and the
+ * server on the same host which has moved from its socket onto a pair of
+ * single producer, single consumer rings in shared memory (see CAPS:SHM). A
+ * batch of messages is then passed with a copy into the mapping, and only
+ * costs a system call when the other end has to be woken. The socket stays
+ * open, but carries nothing, so that either end notices the other leaving
+ * (or being disconnected with shutdown(2)) as it always has.
+ *
+ * mapping: The shared mapping holding both rings, the one the client writes
+ *  to first.
+ *
+ * fds: The memfd holding the mapping, followed by the dataEvent and
+ *  spaceEvent of each ring, in the order in which they are passed over the
+ *  socket.
+ *
+ * inbound: The ring this end reads from.
+ *
+ * outbound: The ring this end writes to.
+ */
+typedef struct SharedRings {
+    char* mapping;
+    int fds[RING_FDS];
+    SharedRing inbound;
+    SharedRing outbound;
+} SharedRings;
+
+/* The create_shared_rings function sets up a new pair of empty rings
+ * clientside, in a memfd sealed so that it can never shrink under the server,
+ * along with the eventfds used to wake each end.
+ *
+ * Returns:
+ *      (SharedRings*) - The new rings, to be offered with offer_shared_rings
+ *      (SharedRings*) NULL - if the rings could not be set up
+ */
+SharedRings* create_shared_rings(void);
+
+/* The offer_shared_rings function sends a message over a client's socket in
+ * the same way as send_message, with the file descriptors of the client's
+ * offered rings passed along with it. The message should be the one which
+ * asks for CAPS:SHM.
+ *
+ * Parameters:
+ *      client - A client instance with offered rings and a Unix domain socket
+ *      message - The message to send, which may hold several lines
+ *
+ * Returns:
+ *      (int) 0 - if the message could not be sent
+ *      (int) 1 - if the message was sent along with the rings
+ */
+int offer_shared_rings(Client* client, char* message);
+
+/* The take_offered_rings function takes file descriptors passed along with
+ * bytes read from a client's socket as the rings it is offering (serverside).
+ * The rings are only attached if they are exactly what create_shared_rings
+ * sets up, i.e. a memfd of the right size which can never shrink, and the
+ * client has not offered rings already. Otherwise the file descriptors are
+ * closed, so that a client cannot leave any open in the server.
+ *
+ * Parameters:
+ *      client - A client instance reading from its socket
+ *      fds - The file descriptors which arrived
+ *      numFds - The number of file descriptors which arrived
+ */
+void take_offered_rings(Client* client, int* fds, int numFds);
+
+/* The enable_shared_rings function moves a connection from its socket onto
+ * the rings offered during its handshake, once both ends have agreed to.
+ * Nothing more is written to the socket by either end from then on.
+ *
+ * Parameters:
+ *      client - A client instance with offered rings
+ */
+void enable_shared_rings(Client* client);
+
+/* The ring_send function writes as many of the given bytes as there is room
+ * for to a connection's outbound ring, without ever blocking, and wakes the
+ * other end if the ring was empty.
+ *
+ * Parameters:
+ *      rings - The connection's rings
+ *      bytes - The bytes to write
+ *      length - The number of bytes to write
+ *
+ * Returns:
+ *      (ssize_t) - The number of bytes written
+ *      (ssize_t) -1 - if the ring is full (errno EAGAIN), or the other end
+ *          has corrupted it (errno EPROTO)
+ */
+ssize_t ring_send(SharedRings* rings, char* bytes, size_t length);
+
+/* The ring_available function counts the bytes waiting in a connection's
+ * inbound ring, without reading them.
+ *
+ * Parameters:
+ *      rings - The connection's rings
+ *
+ * Returns:
+ *      (size_t) - The number of bytes waiting
+ */
+size_t ring_available(SharedRings* rings);
+
+/* The ring_receive function reads as many bytes as are waiting (up to size)
+ * from a connection's inbound ring, without ever blocking, and wakes the other
+ * end if the ring was full.
+ *
+ * Parameters:
+ *      rings - The connection's rings
+ *      space - Where the bytes are read to
+ *      size - The most bytes to read
+ *
+ * Returns:
+ *      (ssize_t) - The number of bytes read
+ *      (ssize_t) -1 - if the ring is empty (errno EAGAIN), or the other end
+ *          has corrupted it (errno EPROTO)
+ */
+ssize_t ring_receive(SharedRings* rings, char* space, size_t size);
+
+/* The wait_for_ring function blocks until a connection's inbound ring may
+ * have bytes to read (POLLIN), or its outbound ring may have room (POLLOUT),
+ * or the connection's socket shows that the other end has gone.
+ *
+ * Parameters:
+ *      rings - The connection's rings
+ *      socket - The connection's socket
+ *      events - POLLIN or POLLOUT
+ *      timeout - The most milliseconds to wait, or -1 to wait forever
+ *
+ * Returns:
+ *      (int) 1 - if the ring may be ready
+ *      (int) 0 - if the timeout passed
+ *      (int) -1 - if the other end has gone (errno EPIPE), or the wait failed
+ *          (e.g. errno EINTR)
+ */
+int wait_for_ring(SharedRings* rings, int socket, short events, int timeout);
+
+/* The read_shared_rings function reads from a connection's inbound ring in
+ * the same way as read(2) reads from a socket, blocking until there is
+ * something to read. Once the other end has gone, every byte it wrote is
+ * still read before EOF.
+ *
+ * Parameters:
+ *      rings - The connection's rings
+ *      socket - The connection's socket
+ *      space - Where the bytes are read to
+ *      size - The most bytes to read
+ *
+ * Returns:
+ *      (ssize_t) - The number of bytes read, or 0 on EOF
+ *      (ssize_t) -1 - if the read failed
+ */
+ssize_t read_shared_rings(SharedRings* rings, int socket, char* space,
+        size_t size);
+
+/* The write_shared_rings function writes all of the given bytes to a
+ * connection's outbound ring, blocking whenever the ring is full.
+ *
+ * Parameters:
+ *      rings - The connection's rings
+ *      socket - The connection's socket
+ *      bytes - The bytes to write
+ *      length - The number of bytes to write
+ *
+ * Returns:
+ *      (int) 0 - if the other end has gone, or the write failed
+ *      (int) 1 - if every byte was written
+ */
+int write_shared_rings(SharedRings* rings, int socket, char* bytes,
+        size_t length);
+
+/* The free_shared_rings function unmaps a connection's rings and closes
+ * their file descriptors. NULL is ignored.
+ *
+ * Parameters:
+ *      rings - The rings to free
+ */
+void free_shared_rings(SharedRings* rings);
+#endif
@@ -4,7 +4,12 @@
 #include <string.h>
 #include <strings.h>
 #include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include "sharedutil.h"
+#include "sharedring.h"
 
 sem_t* create_lock(sem_t* lock) {
     sem_init(lock, 0, 1);
@@ -12,7 +17,10 @@ sem_t* create_lock(sem_t* lock) {
 }
 
 void take_lock(sem_t* lock) {
-    sem_wait(lock);
+    // Keep waiting if a signal handler interrupts the wait
+    while (sem_wait(lock) && errno == EINTR) {
+        ;
+    }
 }
 
 void release_lock(sem_t* lock) {
@@ -29,6 +37,34 @@ int hash_input(char* input) {
     return hash;
 }
 
+unsigned long long hash_seeded(unsigned long long seed, char* bytes,
+        size_t length) {
+    unsigned long long hash = 14695981039346656037ULL ^ seed;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+long long current_time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void sanitise_message(char* message) {
+    // Update any bad characters in the message with a '?' char
+    for (int i = 0; message[i] != '\0'; i++) {
+        if (message[i] < 32 && message[i] != '\n') {
+            message[i] = '?';
+        }
+    }
+}
+
 int send_message(Client* client, char* message) {
     
     if (message == NULL) {
@@ -36,16 +72,22 @@ int send_message(Client* client, char* message) {
     }
     
     take_lock(client->writeLock);
-    
-    // Update any bad characters in the message with a '?' char
-    for (int i = 0; i < strlen(message); i++) {
-        if (message[i] < 32 && message[i] != '\n') {
-            message[i] = '?';
-        }
-    }
+    sanitise_message(message);
 
     // If the message can still be sent, send it.
-    if (!ferror(client->writeHandle)) {
+    if (client->rings != NULL) {
+        char line[strlen(message) + 2];
+        size_t length = sprintf(line, "%s\n", message);
+        write_shared_rings(client->rings, client->socket, line, length);
+    } else if (!ferror(client->writeHandle) && client->compression != NULL) {
+        char line[strlen(message) + 2];
+        size_t length = sprintf(line, "%s\n", message);
+        char* compressed = compress_bytes(client->compression, line, length,
+                &length);
+        fwrite(compressed, 1, length, client->writeHandle);
+        fflush(client->writeHandle);
+        free(compressed);
+    } else if (!ferror(client->writeHandle)) {
         fprintf(client->writeHandle, "%s\n", message);
         fflush(client->writeHandle);
     }
@@ -54,15 +96,130 @@ int send_message(Client* client, char* message) {
     return 1;
 }
 
+/* Reads from a connection's socket, or from its rings once it has moved onto
+ * shared memory, in the same way as read(2). Any file descriptors passed along
+ * with the bytes read from the socket are taken as offered rings.
+ */
+static ssize_t read_connection(Client* client, char* space, size_t size) {
+    if (client->rings != NULL) {
+        return read_shared_rings(client->rings, client->socket, space, size);
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * RING_FDS)];
+    struct iovec vector = {.iov_base = space, .iov_len = size};
+    struct msghdr header = {
+        .msg_iov = &vector, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+    ssize_t bytesRead = recvmsg(client->socket, &header, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr* attached = bytesRead > 0 ? 
+            CMSG_FIRSTHDR(&header) : NULL; attached != NULL; 
+            attached = CMSG_NXTHDR(&header, attached)) {
+        int numFds = (attached->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (attached->cmsg_level == SOL_SOCKET &&
+                attached->cmsg_type == SCM_RIGHTS && numFds > 0) {
+            int fds[numFds];
+            memcpy(fds, CMSG_DATA(attached), sizeof(int) * numFds);
+            take_offered_rings(client, fds, numFds);
+        }
+    }
+    return bytesRead;
+}
+
+/* Reads from a compressed connection's socket, and decompresses as many bytes
+ * as fit into the given space. Behaves like read(2), so returns 0 on EOF and
+ * -1 on failure (including a corrupt stream).
+ */
+static ssize_t read_compressed(Client* client, char* space, size_t size) {
+    Compression* compression = client->compression;
+    z_stream* inflater = &compression->inflater;
+
+    while (1) {
+        inflater->next_out = (Bytef*) space;
+        inflater->avail_out = size;
+        if (inflater->avail_in > 0) {
+            int result = inflate(inflater, Z_SYNC_FLUSH);
+            if (result != Z_OK && result != Z_BUF_ERROR) {
+                errno = EPROTO;
+                return -1;
+            }
+            size_t produced = size - inflater->avail_out;
+            if (produced > 0) {
+                compression->plainIn += produced;
+                return produced;
+            }
+        }
+
+        // Everything read so far has been decompressed, so read some more
+        memmove(compression->rawBuffer, inflater->next_in, inflater->avail_in);
+        ssize_t bytesRead = read_connection(client, 
+                compression->rawBuffer + inflater->avail_in,
+                READ_BUFFER_SIZE - inflater->avail_in);
+        if (bytesRead <= 0) {
+            return bytesRead;
+        }
+        compression->compressedIn += bytesRead;
+        inflater->next_in = (Bytef*) compression->rawBuffer;
+        inflater->avail_in += bytesRead;
+    }
+}
+
 int receive_message(Client* client, char* buffer) {
-    // If there are any file handle errors or EOF is reached, return 0
-    if (!ferror(client->readHandle)) {
-        if (fgets(buffer, MAX_BUF - 1, client->readHandle)) {
-            strtok(buffer, "\n");
+    while (1) {
+        // Return the next line if it has been read, or as much of it as fits
+        char* start = client->readBuffer + client->readStart;
+        size_t available = client->readEnd - client->readStart;
+        size_t limit = available < MAX_BUF - 2 ? available : MAX_BUF - 2;
+        char* newline = memchr(start, '\n', limit);
+        if (newline != NULL || available >= MAX_BUF - 2) {
+            size_t length = newline != NULL ? newline - start : limit;
+            memcpy(buffer, start, length);
+            buffer[length] = '\0';
+            client->readStart += newline != NULL ? length + 1 : length;
+            client->isLineCut = newline == NULL;
             return 1;
         }
+
+        // Otherwise, move the partial line to the front and read some more
+        memmove(client->readBuffer, start, available);
+        client->readStart = 0;
+        client->readEnd = available;
+        ssize_t bytesRead = client->compression != NULL ?
+                read_compressed(client, client->readBuffer + available, 
+                    READ_BUFFER_SIZE - available) :
+                read_connection(client, client->readBuffer + available, 
+                    READ_BUFFER_SIZE - available);
+        if (bytesRead > 0) {
+            client->readEnd += bytesRead;
+        } else if (bytesRead == 0 && available > 0) {
+            // Return the final unterminated line before reporting EOF
+            memcpy(buffer, client->readBuffer, available);
+            buffer[available] = '\0';
+            client->readStart = client->readEnd;
+            client->isLineCut = 0;
+            return 1;
+        } else {
+            return 0;
+        }
     }
-    return 0;
+}
+
+int is_message_waiting(Client* client) {
+    size_t available = client->readEnd - client->readStart;
+    if (available >= MAX_BUF - 2 || memchr(client->readBuffer +
+            client->readStart, '\n', available) != NULL) {
+        return 1;
+    }
+    if (client->compression != NULL &&
+            client->compression->inflater.avail_in > 0) {
+        return 1;
+    }
+    if (client->rings != NULL && ring_available(client->rings) > 0) {
+        return 1;
+    }
+
+    struct pollfd wait = {.fd = client->socket, .events = POLLIN};
+    return poll(&wait, 1, 0) > 0;
 }
 
 int handle_server_message(char* message) {
@@ -72,18 +229,24 @@ int handle_server_message(char* message) {
     char* command = strtok(message, ":");
     char* optArg1 = strtok(NULL, ":");
     char* optArg2 = strtok(NULL, "\n");
-    int hashCommand = hash_input(command);
+    int hashCommand = command != NULL ? hash_input(command) : 0;
 
     // Outputs readable message from command if command is valid
     switch (hashCommand) {
         case ENTER:
-            fprintf(stdout, "(%s has entered the chat)\n", optArg1);
-            break;
         case LEAVE:
-            fprintf(stdout, "(%s has left the chat)\n", optArg1);
+            // A batch of events (see CAP_PRESENCE) is shown one per line
+            for (char* name = optArg1 != NULL ? strtok(optArg1, ",") : NULL;
+                    name != NULL; name = strtok(NULL, ",")) {
+                fprintf(stdout, hashCommand == ENTER ?
+                        "(%s has entered the chat)\n" :
+                        "(%s has left the chat)\n", name);
+            }
             break;
         case MSG:
-            fprintf(stdout, "%s: %s\n", optArg1, optArg2);
+        case MSGPART:
+            fprintf(stdout, "%s: %s\n", optArg1, 
+                    optArg2 != NULL ? optArg2 : "");
             break;
         case KICK: 
             fprintf(stderr, "Kicked\n");
@@ -91,11 +254,17 @@ int handle_server_message(char* message) {
         case LIST:
             fprintf(stdout, "(current chatters: %s)\n", optArg1);
             break;
+        case PING:
+            // Answered by the caller, so that the user never sees it
+            return PING;
+        case ERR:
+            // The server is about to disconnect this client
+            fprintf(stderr, "Disconnected by server (%s)\n", optArg1);
+            break;
         default:
             break;
     }
 
-    fflush(stdout);
     return 0;
 }
 
@@ -103,10 +272,13 @@ Client* setup_client(int socket, char* name, char* authString) {
     Client* client = malloc(sizeof(Client));
     client->next = NULL; 
 
-    // Create pointers to the socket file handles and give to thread
-    int extraSocket = dup(socket);
-    client->readHandle = fdopen(socket, "r");
-    client->writeHandle = fdopen(extraSocket, "w");
+    // Read directly from the socket, and create a file handle to write to it
+    client->socket = socket;
+    client->readBuffer = malloc(sizeof(char) * READ_BUFFER_SIZE);
+    client->readStart = 0;
+    client->readEnd = 0;
+    client->isLineCut = 0;
+    client->writeHandle = fdopen(dup(socket), "w");
     
     // Initialise writing lock and give to thread
     client->writeLock = create_lock(malloc(sizeof(sem_t)));
@@ -126,16 +298,55 @@ Client* setup_client(int socket, char* name, char* authString) {
 
     // Set the initial status of the client to be communicating
     client->isCommunicating = 1;
+    client->isParked = 0;
+    client->outQueue = NULL;
+    client->replay = NULL;
+    client->compression = NULL;
+    client->timers = NULL;
+    client->sourceAddress = 0;
+    client->isAdmitted = 0;
+    client->pendingCommands = 0;
+    client->metrics = NULL;
+    client->handle = 0;
+    client->capabilities = 0;
+    client->rings = NULL;
+    client->offeredRings = NULL;
+    client->session = NULL;
+    client->reconnect = NULL;
+    client->cutCommand = 0;
+    client->streamedLength = 0;
+    client->isStreaming = 0;
+    client->assembler = NULL;
+    client->isOutputBuffered = 0;
 
     return client;
 }
 
+/* Closes a client's socket and write handle, and frees the compression state
+ * and shared memory rings of its connection.
+ */
+static void close_connection(Client* client) {
+    close(client->socket);
+    fclose(client->writeHandle);
+    free_shared_rings(client->rings);
+    free_shared_rings(client->offeredRings);
+    client->rings = NULL;
+    client->offeredRings = NULL;
+    if (client->compression != NULL) {
+        deflateEnd(&client->compression->deflater);
+        inflateEnd(&client->compression->inflater);
+        free(client->compression->rawBuffer);
+        free(client->compression);
+        client->compression = NULL;
+    }
+}
+
 void free_client(Client* client) {
     // If the client instance exists (which it always should), free all
     // allocated variables in the client
     if (client != NULL) {
-        fclose(client->readHandle);
-        fclose(client->writeHandle);
+        close_connection(client);
+        free(client->readBuffer);
         free(client->name);
         free(client->authString);
         free(client->writeLock);
@@ -143,3 +354,60 @@ void free_client(Client* client) {
         free(client);   
     }
 }
+
+void reopen_connection(Client* client, int socket) {
+    close_connection(client);
+    client->socket = socket;
+    client->writeHandle = fdopen(dup(socket), "w");
+    client->readStart = 0;
+    client->readEnd = 0;
+    client->isLineCut = 0;
+    client->capabilities = 0;
+}
+
+void enable_compression(Client* client, int level) {
+    Compression* compression = calloc(1, sizeof(Compression));
+    deflateInit(&compression->deflater, level);
+    inflateInit(&compression->inflater);
+    compression->rawBuffer = malloc(sizeof(char) * READ_BUFFER_SIZE);
+
+    // Anything left in the read buffer arrived compressed
+    size_t unread = client->readEnd - client->readStart;
+    memcpy(compression->rawBuffer, client->readBuffer + client->readStart, 
+            unread);
+    compression->inflater.next_in = (Bytef*) compression->rawBuffer;
+    compression->inflater.avail_in = unread;
+    compression->compressedIn = unread;
+    client->readStart = 0;
+    client->readEnd = 0;
+
+    client->compression = compression;
+}
+
+char* compress_bytes(Compression* compression, char* bytes, size_t length,
+        size_t* compressedLength) {
+    z_stream* deflater = &compression->deflater;
+    size_t capacity = deflateBound(deflater, length) + 16;
+    char* compressed = malloc(capacity);
+    size_t produced = 0;
+
+    // Keep flushing until the deflater has room left over, which means it
+    // has nothing more to give
+    deflater->next_in = (Bytef*) bytes;
+    deflater->avail_in = length;
+    do {
+        if (produced == capacity) {
+            capacity *= 2;
+            compressed = realloc(compressed, capacity);
+        }
+        deflater->next_out = (Bytef*) compressed + produced;
+        deflater->avail_out = capacity - produced;
+        deflate(deflater, Z_SYNC_FLUSH);
+        produced = capacity - deflater->avail_out;
+    } while (deflater->avail_out == 0);
+
+    compression->plainOut += length;
+    compression->compressedOut += produced;
+    *compressedLength = produced;
+    return compressed;
+}
@@ -5,8 +5,13 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <zlib.h>
 #define MAX_BUF 512
 #define NUM_CLIENT_STATS 3
+#define READ_BUFFER_SIZE 4096
+#define MAX_NAME 128
+#define MAX_FRAME 448
+#define DEFAULT_MAX_MESSAGE 65536
 
 /* The ErrorCodes enum holds the specified exit codes for the client or server
  * to use whenever exiting.
@@ -22,9 +27,89 @@ enum ErrorCodes {
  */
 enum HashedCommands {
     WHO = 1078, NAME_TAKEN = 2213043, AUTH = 2844, MSG = 1013, KICK = 2958, 
-    LIST = 3042, SAY = 1031, ENTER = 8740, LEAVE = 8931, NAME = 2991 
+    LIST = 3042, SAY = 1031, ENTER = 8740, LEAVE = 8931, NAME = 2991,
+    ERR = 949, CAPS = 2717, PING = 3122, PONG = 3176, RESUME = 28821,
+    SESSION = 87210, SEQ = 1035, MSGPART = 85128
 };
 
+/* The Capabilities enum holds the optional protocol features which a client
+ * can ask for by listing them after CAPS: before its auth string, e.g.
+ * CAPS:DEFLATE,SUFFIX. A server which does not know a feature ignores it.
+ *
+ * CAP_DEFLATE: The connection is compressed (see Compression below).
+ *
+ * CAP_SUFFIX: If the client's name is taken, the server gives it the next
+ *  free name with NAME:<name> before OK, rather than replying NAME_TAKEN.
+ *
+ * CAP_FASTJOIN: The client sends its CAPS, AUTH and NAME lines in one burst
+ *  without waiting to be asked. The server does not send WHO:, and answers
+ *  with a single OK: once both have been checked, agreeing with CAPS:FASTJOIN
+ *  first.
+ *
+ * CAP_SHM: The client is on the same host, and has passed a pair of shared
+ *  memory rings over its Unix domain socket along with its CAPS line. If the
+ *  server agrees, then the connection moves onto the rings from the server's
+ *  OK onwards (see sharedring.h). Such a connection is never compressed.
+ *
+ * CAP_RESUME: The client is given a session once it has joined, with
+ *  SESSION:<token>, and every broadcast it is sent is prefixed with its
+ *  sequence number, as SEQ:<sequence>:<message>. If its connection drops, the
+ *  client can come back by answering WHO: with RESUME:<token>:<sequence>,
+ *  giving the last sequence number it saw, in place of its name. It is then
+ *  sent OK: and every broadcast it missed, and the room is never told that it
+ *  left. A session which cannot be resumed is answered with WHO: again (see
+ *  session.h).
+ *
+ * CAP_CHUNKED: The client can put chat messages longer than a single line
+ *  back together. The server streams a long SAY: line to the room in pieces
+ *  as it arrives, each sent as a frame of at most MAX_FRAME bytes, so that it
+ *  never holds more than one piece of it. Every piece but the last is sent
+ *  as MSGPART:<name>:<piece>, and the last as MSG:<name>:<piece>. Clients
+ *  which did not ask for CHUNKED are sent every piece as a message of its
+ *  own instead. MAX_FRAME leaves room within MAX_BUF for the sequence number
+ *  or federation header a frame may be sent with.
+ *
+ * CAP_PRESENCE: The client can read a batch of ENTER or LEAVE events from a
+ *  single line. The server holds these events back for its presence window,
+ *  and sends the client each batch as ENTER:<name>,<name>,... or
+ *  LEAVE:<name>,<name>,..., so that a storm of joins costs it a few messages
+ *  rather than one for each client. Clients which did not ask for PRESENCE
+ *  are sent a line for each event instead (see presence.h).
+ */
+enum Capabilities {
+    CAP_DEFLATE = 1, CAP_SUFFIX = 2, CAP_FASTJOIN = 4, CAP_SHM = 8,
+    CAP_RESUME = 16, CAP_CHUNKED = 32, CAP_PRESENCE = 64
+};
+
+/* The Compression datastructure holds the streaming compression state of a
+ * connection which has negotiated compression (see CAPS:DEFLATE). Each
+ * direction is one persistent deflate stream, flushed after every write, so
+ * that later messages are compressed against everything sent before them.
+ *
+ * deflater: The stream which outgoing bytes are compressed with.
+ *
+ * inflater: The stream which incoming bytes are decompressed with.
+ *
+ * rawBuffer: Holds any compressed bytes which have been read from the socket,
+ *  but not yet decompressed.
+ *
+ * plainOut/compressedOut: The number of bytes given to the deflater, and the
+ *  number of compressed bytes it produced.
+ *
+ * plainIn/compressedIn: The number of compressed bytes read from the socket,
+ *  and the number of bytes they decompressed to.
+ */
+typedef struct Compression {
+    z_stream deflater;
+    z_stream inflater;
+    char* rawBuffer;
+
+    volatile size_t plainOut;
+    volatile size_t compressedOut;
+    volatile size_t plainIn;
+    volatile size_t compressedIn;
+} Compression;
+
 /* The Client datastructure holds all necessary variables for a client that 
  * connects to the server to function. The datastructure can be used on either
  * the clientside or the serverside to store information about a specific
@@ -41,11 +126,19 @@ enum HashedCommands {
  *  to ensure mutual exclusion over other clients that also might want to send 
  *  this client a message.
  *
- * readHandle: A stdio file pointer that this client can use to read messages.
- *  On the clientside, the client can use this handle to read messages from the
- *  server. 
- *  On the serverside, the client in the server can use this to read messages
- *  from the client.
+ * socket: The socket file descriptor that this client reads messages from.
+ *  On the clientside, the client reads messages from the server on it.
+ *  On the serverside, the client in the server reads messages from the client
+ *  on it.
+ *
+ * readBuffer: Holds any bytes which have been read from the socket, but not
+ *  yet returned as a message by receive_message. Unlike a stdio buffer, these
+ *  bytes are always available to the rest of the program.
+ *
+ * readStart/readEnd: The range of readBuffer holding unreturned bytes.
+ *
+ * isLineCut: Set when the last message returned by receive_message was only
+ *  the start of a line too long to return at once, whose rest follows.
  *
  * writeHandle: A stdio file pointer that this client can use to send messages.
  *  On the clientside, the client can use this handle to send messages to the
@@ -66,13 +159,87 @@ enum HashedCommands {
  * isCommunicating: A flag that can be used serverside to ensure that
  *  even if the client is still sending messages, these messages are never
  *  processed on the serverside.
+ *
+ * reader: The thread which reads messages from this client (serverside only).
+ *
+ * isParked: Set while the client's thread is parked during a handoff to
+ *  another server process (serverside only).
+ *
+ * outQueue: The queue of messages waiting to be written to this client
+ *  (serverside only). Every message the server sends to a client goes through
+ *  this queue, so that only the client's own writer thread ever blocks on it.
+ *
+ * replay: The state of a scripted replay session (clientside only). This is
+ *  NULL unless the client was started with a replay script, in which case
+ *  the server listening thread uses it to time the client's echoed messages.
+ *
+ * compression: The connection's compression state, or NULL if the connection
+ *  is not compressed. Once set, every byte read from and written to the
+ *  socket is compressed.
+ *
+ * timers: The timers which reclaim this client if it stops responding
+ *  (serverside only).
+ *
+ * sourceAddress: The IPv4 address the client connected from, or 0 (serverside
+ *  only).
+ *
+ * isAdmitted: Whether the client is counted against the server's connection
+ *  limits (serverside only).
+ *
+ * pendingCommands: The number of commands the client has sent which are yet
+ *  to be run by a worker (serverside only).
+ *
+ * metrics: The running totals of the client's traffic (serverside only, see
+ *  metrics.h). They are created and freed along with its outbound queue.
+ *
+ * handle: The client's handle in the server's client table while it is in the
+ *  client list, or 0 (serverside only, see clienttable.h).
+ *
+ * capabilities: The Capabilities the client asked for during its handshake
+ *  (serverside), or those the server agreed to (clientside).
+ *
+ * rings: The shared memory rings the connection has moved onto, or NULL if
+ *  it still uses its socket (see sharedring.h). Once set, every byte read
+ *  from and written to the connection goes through the rings.
+ *
+ * offeredRings: Shared memory rings offered during the handshake (by the
+ *  client clientside, or passed in by the client serverside), which are not
+ *  yet in use.
+ *
+ * session: The resumable session the client holds, or NULL (serverside only,
+ *  see session.h).
+ *
+ * reconnect: The state used to rejoin the server whenever the connection
+ *  drops (clientside only). This is NULL unless the client was started with
+ *  --reconnect, in which case the client exits only if it is kicked or leaves.
+ *
+ * cutCommand: The command whose line was cut short by receive_message, and
+ *  whose rest is still to be read, or 0 (serverside only).
+ *
+ * streamedLength: The number of bytes of the chat message the client is part
+ *  way through sending which have been streamed to the room (serverside
+ *  only, see CAP_CHUNKED).
+ *
+ * isStreaming: Set while the client is part way through sending a chat
+ *  message which has been cut into pieces (serverside only).
+ *
+ * assembler: The chat messages being put back together from their pieces
+ *  (clientside only, see clientutil.h).
+ *
+ * isOutputBuffered: Set when the messages shown to the user are batched up
+ *  in stdout's buffer, rather than flushed one at a time (clientside only, see
+ *  setup_output).
  */
 typedef struct Client {
     char* name;
     char* authString;
 
     sem_t* writeLock;
-    FILE* readHandle;
+    int socket;
+    char* readBuffer;
+    size_t readStart;
+    size_t readEnd;
+    int isLineCut;
     FILE* writeHandle;
 
     struct Client* next;
@@ -80,6 +247,28 @@ typedef struct Client {
     volatile int* stats;
 
     volatile int isCommunicating;
+
+    pthread_t reader;
+    volatile int isParked;
+    struct OutQueue* outQueue;
+    struct Replay* replay;
+    Compression* compression;
+    struct ClientTimers* timers;
+    unsigned int sourceAddress;
+    int isAdmitted;
+    volatile int pendingCommands;
+    struct ClientMetrics* metrics;
+    unsigned int handle;
+    int capabilities;
+    struct SharedRings* rings;
+    struct SharedRings* offeredRings;
+    struct Session* session;
+    struct Reconnect* reconnect;
+    int cutCommand;
+    size_t streamedLength;
+    int isStreaming;
+    struct Assembler* assembler;
+    int isOutputBuffered;
 } Client;
 
 /* The create_lock function initialises a lock which uses semaphores to ensure 
@@ -94,7 +283,8 @@ typedef struct Client {
  */
 sem_t* create_lock(sem_t* lock);
 
-/* The take_lock function blocks until it is able to take the lock it is given.
+/* The take_lock function blocks until it is able to take the lock it is given,
+ * even if the calling thread is interrupted by a signal while waiting.
  *
  * Parameters:
  *      lock - A pointer to an initialised semaphore lock.
@@ -121,9 +311,45 @@ void release_lock(sem_t* lock);
  */
 int hash_input(char* input);
 
+/* The hash_seeded function hashes a run of bytes for a hash table, using
+ * FNV-1a followed by a final mix so that every bit of the seed affects every
+ * bit of the hash. Tables seed it randomly, so that clients cannot choose
+ * names or tokens which all land in the same bucket.
+ *
+ * Parameters:
+ *      seed - The table's seed
+ *      bytes - The bytes to hash
+ *      length - The number of bytes to hash
+ *
+ * Returns:
+ *      (unsigned long long) - The hash of the bytes
+ */
+unsigned long long hash_seeded(unsigned long long seed, char* bytes,
+        size_t length);
+
+/* The current_time_us function reads the monotonic clock, so that durations
+ * measured with it are never affected by changes to the system time.
+ *
+ * Returns:
+ *      (long long) - The current monotonic time in microseconds
+ */
+long long current_time_us(void);
+
+/* The sanitise_message function replaces any unrecognised characters 
+ * (ASCII value < 32, other than newlines) in a message with '?' characters.
+ * This is the same substitution that is made to every message before it is
+ * sent, so it can be used to predict exactly what the other end will receive.
+ *
+ * Parameters:
+ *      message - A null terminated message which is updated in place
+ */
+void sanitise_message(char* message);
+
 /* The send_message function sends a message to/from a client. Any unrecognised
  * characters (ASCII value < 32), will be converted to '?' characters before 
- * sending. 
+ * sending. If the connection is compressed, the message is compressed first.
+ * If the connection has moved onto shared memory rings, the message is
+ * written to the rings, blocking while they are full.
  *
  * Parameters:
  *      client - A client instance with valid read/write handles.
@@ -136,7 +362,19 @@ int hash_input(char* input);
  */
 int send_message(Client* client, char* message);
 
-/* The receive_message function receives a message to/from a client. 
+/* The receive_message function receives a message to/from a client. Much like
+ * fgets, a message is a line of at most MAX_BUF - 2 characters, and any longer
+ * line is received as several messages, with isLineCut set on the client for
+ * every one but the last. The trailing newline is removed.
+ *
+ * Bytes are read from the client's socket into its read buffer, and any bytes
+ * after the message stay there for the next call. If reading fails part way
+ * through a line (including being interrupted by a signal), the partial line
+ * is left in the read buffer. If the connection is compressed, the bytes read
+ * are decompressed into the read buffer. If the connection has moved onto
+ * shared memory rings, the bytes are read from the rings instead. Any file
+ * descriptors passed along with bytes on the socket are taken as offered
+ * rings (see take_offered_rings).
  *
  * Parameters:
  *      client - A client instance with valid read/write handles
@@ -145,15 +383,32 @@ int send_message(Client* client, char* message);
  *
  * Returns:
  *      (int) 0 - if the client/server has reached EOF, or there is an error
- *          with the file handles.
+ *          reading from the socket.
  *      (int) 1 - if the message was successfully received.
  */
 int receive_message(Client* client, char* buffer);
 
+/* The is_message_waiting function checks whether receive_message could
+ * return a message straight away, i.e. a whole line is already in the read
+ * buffer, or there are bytes waiting to be read from the connection (or its
+ * compressed stream or rings). EOF counts as waiting.
+ *
+ * Parameters:
+ *      client - A client instance with a valid connection
+ *
+ * Returns:
+ *      (int) 0 - if receive_message would block
+ *      (int) 1 - if receive_message may return without blocking
+ */
+int is_message_waiting(Client* client);
+
 /* The handle_server_message function takes a message sent from the server,
  * parses the message, and displays this message to the user as per the spec.
  * This function can be used serverside whenever a client broadcasts a message
  * to all other clients, to echo all client messages to the server's stdout.
+ * stdout is not flushed, so that the caller can show many messages at once.
+ * A batch of ENTER or LEAVE events (see CAP_PRESENCE) is shown as a line for
+ * each event.
  * 
  * Parameters:
  *      message - A message sent from the server to the client
@@ -169,8 +424,8 @@ int handle_server_message(char* message);
  * found in the declaration of the Client struct above.
  *
  * Parameters:
- *      socket - A socket file descriptor which can be opened into a read
- *          and write handle for the client to the server
+ *      socket - A socket file descriptor which the client reads from, and
+ *          which is duplicated into a write handle for the client
  *      name - The name given to the client on startup
  *      authString - The authentication string given to the client on startup
  * 
@@ -188,4 +443,46 @@ Client* setup_client(int socket, char* name, char* authString);
  *      client - An instance of a client that will have its memory cleaned up.
  */
 void free_client(Client* client);
+
+/* The reopen_connection function moves a client onto a new socket, once its
+ * old connection has dropped (clientside only). The old socket and write
+ * handle are closed, and any compression or shared memory rings the old
+ * connection used are freed, and the capabilities it agreed are forgotten,
+ * along with anything left in the read buffer, so
+ * that the new connection starts from a handshake exactly like the first.
+ * The caller must hold the client's writeLock.
+ *
+ * Parameters:
+ *      client - A client instance whose connection has dropped
+ *      socket - A socket file descriptor connected to the server
+ */
+void reopen_connection(Client* client, int socket);
+
+/* The enable_compression function starts compressing a connection in both
+ * directions, once both ends have agreed to. Any bytes already read from the
+ * socket but not yet received as a message were sent after the agreement, so
+ * they are decompressed too.
+ *
+ * Parameters:
+ *      client - A client instance with an uncompressed connection
+ *      level - The zlib compression level (1-9) used for outgoing bytes, where
+ *          higher levels spend more CPU time for smaller messages
+ */
+void enable_compression(Client* client, int level);
+
+/* The compress_bytes function compresses a block of bytes with a connection's
+ * deflate stream, and flushes the stream so that the other end can
+ * decompress every byte given so far.
+ *
+ * Parameters:
+ *      compression - The compression state of the connection
+ *      bytes - The bytes to compress
+ *      length - The number of bytes to compress
+ *      compressedLength - Updated with the number of compressed bytes
+ *
+ * Returns:
+ *      (char*) - A newly allocated buffer holding the compressed bytes
+ */
+char* compress_bytes(Compression* compression, char* bytes, size_t length,
+        size_t* compressedLength);
 #endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "timerwheel.h"
+
+TimerWheel* create_timer_wheel(void) {
+    TimerWheel* wheel = calloc(1, sizeof(TimerWheel));
+    wheel->wheelAccess = create_lock(malloc(sizeof(sem_t)));
+    wheel->currentTick = 0;
+    wheel->startedAt = current_time_us();
+
+    pthread_create(&wheel->thread, 0, drive_timer_wheel, wheel);
+    pthread_detach(wheel->thread);
+    return wheel;
+}
+
+void init_timer(Timer* timer, long long (*callback)(Timer*), void* arg) {
+    timer->expiry = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->slot = NULL;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->isArmed = 0;
+}
+
+/* Places an armed timer into the lowest level of the wheel which reaches its
+ * expiry. Timers beyond the top level wait in its furthest slot, and are
+ * placed again when it comes round. The wheel's lock must be held by the
+ * caller.
+ */
+static void place_timer(TimerWheel* wheel, Timer* timer) {
+    long long ticks = timer->expiry - wheel->currentTick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+            ticks >= (1LL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    long long slotTick = timer->expiry;
+    if (ticks >= (1LL << (WHEEL_BITS * WHEEL_LEVELS))) {
+        slotTick = wheel->currentTick +
+                (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    int slot = (slotTick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+    timer->slot = &wheel->slots[level][slot];
+    timer->prev = NULL;
+    timer->next = *timer->slot;
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    *timer->slot = timer;
+    timer->isArmed = 1;
+}
+
+/* Unlinks an armed timer from whichever slot it is in. The wheel's lock must
+ * be held by the caller.
+ */
+static void unlink_timer(Timer* timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->isArmed = 0;
+}
+
+void arm_timer(TimerWheel* wheel, Timer* timer, long long delayMs) {
+    take_lock(wheel->wheelAccess);
+    if (timer->isArmed) {
+        unlink_timer(timer);
+    }
+    long long ticks = (delayMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer->expiry = wheel->currentTick + (ticks > 0 ? ticks : 1);
+    place_timer(wheel, timer);
+    release_lock(wheel->wheelAccess);
+}
+
+void cancel_timer(TimerWheel* wheel, Timer* timer) {
+    take_lock(wheel->wheelAccess);
+    if (timer->isArmed) {
+        unlink_timer(timer);
+    }
+    release_lock(wheel->wheelAccess);
+}
+
+/* Takes every timer out of a slot, returning them as a list. The wheel's lock
+ * must be held by the caller.
+ */
+static Timer* empty_slot(TimerWheel* wheel, int level, int slot) {
+    Timer* timers = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    for (Timer* timer = timers; timer != NULL; timer = timer->next) {
+        timer->isArmed = 0;
+    }
+    return timers;
+}
+
+/* Advances the wheel by a single tick. Whenever a level wraps around, the
+ * next slot of the level above is moved down, and then every timer in the
+ * current level 0 slot is fired. The wheel's lock must be held by the caller.
+ */
+static void advance_wheel(TimerWheel* wheel) {
+    wheel->currentTick++;
+
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        long long levelTick = wheel->currentTick >> (WHEEL_BITS * level);
+        if (wheel->currentTick & ((1LL << (WHEEL_BITS * level)) - 1)) {
+            break;
+        }
+        Timer* timer = empty_slot(wheel, level,
+                levelTick & (WHEEL_SLOTS - 1));
+        while (timer != NULL) {
+            Timer* next = timer->next;
+            place_timer(wheel, timer);
+            timer = next;
+        }
+    }
+
+    Timer* timer = empty_slot(wheel, 0,
+            wheel->currentTick & (WHEEL_SLOTS - 1));
+    while (timer != NULL) {
+        Timer* next = timer->next;
+        timer->prev = NULL;
+        timer->next = NULL;
+        long long delayMs = timer->callback(timer);
+        if (delayMs > 0) {
+            long long ticks = (delayMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+            timer->expiry = wheel->currentTick + ticks;
+            place_timer(wheel, timer);
+        }
+        timer = next;
+    }
+}
+
+void* drive_timer_wheel(void* args) {
+    TimerWheel* wheel = (TimerWheel*) args;
+
+    while (1) {
+        usleep(TIMER_TICK_MS * 1000);
+
+        // Catch up on every tick which has passed, in case this thread was
+        // held up
+        long long targetTick = (current_time_us() - wheel->startedAt) /
+                (TIMER_TICK_MS * 1000);
+        take_lock(wheel->wheelAccess);
+        while (wheel->currentTick < targetTick) {
+            advance_wheel(wheel);
+        }
+        release_lock(wheel->wheelAccess);
+    }
+    return NULL;
+}
@@ -0,0 +1,123 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#define TIMER_TICK_MS 50
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* The Timer datastructure holds a single timer in a TimerWheel. Timers are
+ * usually embedded in whatever they time, so that arming and cancelling them
+ * never allocates.
+ *
+ * expiry: The wheel tick at which the timer fires.
+ *
+ * callback: The function called when the timer fires. It is called by the
+ *  wheel's thread with the wheel's lock held, so it must be quick and must not
+ *  arm or cancel any timers itself. Instead, it returns the number of
+ *  milliseconds after which the timer should fire again, or 0 to stop.
+ *
+ * arg: Passed through to the callback, e.g. the client being timed.
+ *
+ * slot: The head of the slot which the timer is waiting in.
+ *
+ * prev/next: The timer's neighbours in its slot, so that it can be unlinked
+ *  from anywhere in the slot in constant time.
+ *
+ * isArmed: Whether the timer is currently waiting in the wheel.
+ */
+typedef struct Timer {
+    long long expiry;
+    long long (*callback)(struct Timer*);
+    void* arg;
+    struct Timer** slot;
+    struct Timer* prev;
+    struct Timer* next;
+    int isArmed;
+} Timer;
+
+/* The TimerWheel datastructure holds a hierarchical timing wheel. Level 0 has
+ * a slot for each of the next WHEEL_SLOTS ticks, and each level above it has
+ * slots which are WHEEL_SLOTS times as long as those of the level below.
+ * Timers are placed in the lowest level which reaches their expiry, and are
+ * moved down a level whenever the level below wraps around, so arming,
+ * cancelling and firing a timer are all constant time however many timers
+ * there are.
+ *
+ * wheelAccess: A lock that should be used when accessing any of the slots.
+ *  Timer callbacks are run with this lock held, so once a timer has been
+ *  cancelled its callback is guaranteed not to be running.
+ *
+ * currentTick: The number of ticks the wheel has advanced since it started.
+ *
+ * startedAt: The monotonic time (in microseconds) at which the wheel started,
+ *  used so that the wheel keeps time even if its thread is delayed.
+ *
+ * slots: The head of each slot's list of timers, indexed by level and slot.
+ *
+ * thread: The thread which advances the wheel and fires its timers.
+ */
+typedef struct TimerWheel {
+    sem_t* wheelAccess;
+    long long currentTick;
+    long long startedAt;
+    Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    pthread_t thread;
+} TimerWheel;
+
+/* The create_timer_wheel function initialises an empty timer wheel, and
+ * starts the thread which drives it.
+ *
+ * Returns:
+ *      (TimerWheel*) - The newly started timer wheel
+ */
+TimerWheel* create_timer_wheel(void);
+
+/* The init_timer function prepares a timer to be armed on a wheel. It must be
+ * called once before the timer is first used.
+ *
+ * Parameters:
+ *      timer - The timer to prepare
+ *      callback - The function to call when the timer fires
+ *      arg - Passed through to the callback
+ */
+void init_timer(Timer* timer, long long (*callback)(Timer*), void* arg);
+
+/* The arm_timer function sets a timer to fire after the given delay,
+ * replacing any time it was already set to fire at. The timer fires on the
+ * first tick at or after the delay.
+ *
+ * Parameters:
+ *      wheel - The timer wheel
+ *      timer - A prepared timer
+ *      delayMs - The delay in milliseconds
+ */
+void arm_timer(TimerWheel* wheel, Timer* timer, long long delayMs);
+
+/* The cancel_timer function stops a timer from firing. Once this returns, the
+ * timer's callback is not running and will not run, so whatever the timer
+ * refers to can be freed.
+ *
+ * Parameters:
+ *      wheel - The timer wheel
+ *      timer - A prepared timer, which may or may not be armed
+ */
+void cancel_timer(TimerWheel* wheel, Timer* timer);
+
+/* The drive_timer_wheel function is the main routine for a timer wheel's
+ * thread. Every TIMER_TICK_MS it advances the wheel to the current time,
+ * moving timers down the levels as they wrap, and fires every timer which
+ * has expired.
+ *
+ * Parameters:
+ *      args - The timer wheel
+ *
+ * Returns:
+ *      NULL - On exit
+ */
+void* drive_timer_wheel(void* args);
+#endif
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedutil.h"
+#include "trace.h"
+
+static const char* stageNames[NUM_TRACE_STAGES] = {
+    "parse", "dispatch", "enqueue", "write", "total"
+};
+
+static int sampleRate = TRACE_DEFAULT_SAMPLE;
+static char* tracePath = NULL;
+static volatile long long numSeen = 0;
+static volatile long long numSpans = 0;
+static TraceHistogram histograms[NUM_TRACE_STAGES];
+
+// The most recently finished spans, for the Chrome trace
+static sem_t* ringAccess = NULL;
+static TraceSpan ring[TRACE_RING_SIZE];
+static long long ringCount = 0;
+
+static __thread long long receivedAt = 0;
+static __thread TraceSpan* currentSpan = NULL;
+
+void trace_configure(int rate, char* path) {
+    sampleRate = rate > 0 ? rate : 1;
+    tracePath = path;
+    ringAccess = create_lock(malloc(sizeof(sem_t)));
+}
+
+void trace_received(void) {
+    receivedAt = current_time_us();
+}
+
+TraceSpan* trace_begin(void) {
+    if (__atomic_fetch_add(&numSeen, 1, __ATOMIC_RELAXED) % sampleRate) {
+        return NULL;
+    }
+    TraceSpan* span = calloc(1, sizeof(TraceSpan));
+    span->id = __atomic_add_fetch(&numSpans, 1, __ATOMIC_RELAXED);
+    span->receivedAt = receivedAt;
+    span->parsedAt = current_time_us();
+    span->pending = 1;
+    return span;
+}
+
+void trace_adopt(TraceSpan* span) {
+    currentSpan = span;
+}
+
+void trace_dispatched(TraceSpan* span) {
+    if (span != NULL) {
+        span->dispatchedAt = current_time_us();
+    }
+    currentSpan = span;
+}
+
+void trace_enqueued(TraceSpan* span) {
+    currentSpan = NULL;
+    if (span != NULL) {
+        span->enqueuedAt = current_time_us();
+        trace_release(span);
+    }
+}
+
+TraceSpan* trace_current(void) {
+    return currentSpan;
+}
+
+TraceSpan* trace_attach(void) {
+    TraceSpan* span = currentSpan;
+    if (span != NULL) {
+        __atomic_add_fetch(&span->pending, 1, __ATOMIC_ACQ_REL);
+    }
+    return span;
+}
+
+/* Adds a single latency to a stage's histogram.
+ */
+static void record_latency(int stage, long long latency) {
+    TraceHistogram* histogram = &histograms[stage];
+    int bucket = latency <= 0 ? 0 : 64 - __builtin_clzll(latency);
+    if (bucket >= TRACE_BUCKETS) {
+        bucket = TRACE_BUCKETS - 1;
+    }
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total, latency, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    long long max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (latency > max && !__atomic_compare_exchange_n(&histogram->max,
+            &max, latency, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+void trace_release(TraceSpan* span) {
+    if (span == NULL ||
+            __atomic_sub_fetch(&span->pending, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    span->writtenAt = current_time_us();
+    record_latency(TRACE_PARSE, span->parsedAt - span->receivedAt);
+    record_latency(TRACE_DISPATCH, span->dispatchedAt - span->parsedAt);
+    record_latency(TRACE_ENQUEUE, span->enqueuedAt - span->dispatchedAt);
+    record_latency(TRACE_WRITE, span->writtenAt - span->enqueuedAt);
+    record_latency(TRACE_TOTAL, span->writtenAt - span->receivedAt);
+
+    take_lock(ringAccess);
+    ring[ringCount++ % TRACE_RING_SIZE] = *span;
+    release_lock(ringAccess);
+    free(span);
+}
+
+/* Finds the upper bound (in us) of the bucket which holds the given fraction
+ * of a histogram's latencies, which is never more than the largest latency.
+ */
+static long long percentile(TraceHistogram* histogram, double fraction) {
+    long long target = (long long) (histogram->count * fraction);
+    long long seen = 0;
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > target) {
+            return (1LL << i) < histogram->max ? 1LL << i : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/* Writes the spans in the ring to the trace file as Chrome trace events, with
+ * one row for each span and one event for each of its stages.
+ */
+static void write_chrome_trace(void) {
+    FILE* file = fopen(tracePath, "w");
+    if (file == NULL) {
+        return;
+    }
+
+    take_lock(ringAccess);
+    long long first = ringCount > TRACE_RING_SIZE ?
+            ringCount - TRACE_RING_SIZE : 0;
+    fprintf(file, "{\"traceEvents\":[");
+    for (long long i = first; i < ringCount; i++) {
+        TraceSpan* span = &ring[i % TRACE_RING_SIZE];
+        long long stamps[] = {span->receivedAt, span->parsedAt,
+                span->dispatchedAt, span->enqueuedAt, span->writtenAt};
+        for (int stage = TRACE_PARSE; stage < TRACE_TOTAL; stage++) {
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                    "\"tid\":%lld,\"ts\":%lld,\"dur\":%lld}",
+                    i == first && stage == TRACE_PARSE ? "" : ",",
+                    stageNames[stage], (int) getpid(), span->id,
+                    stamps[stage], stamps[stage + 1] - stamps[stage]);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    release_lock(ringAccess);
+    fclose(file);
+}
+
+void print_trace_stats(void) {
+    fprintf(stderr, "@TRACE@\n");
+    for (int stage = 0; stage < NUM_TRACE_STAGES; stage++) {
+        TraceHistogram* histogram = &histograms[stage];
+        long long count = histogram->count;
+        fprintf(stderr, "%s:COUNT:%lld:MEAN_US:%lld:P50_US:%lld:P99_US:%lld:"
+                "MAX_US:%lld:HIST:", stageNames[stage], count,
+                count == 0 ? 0 : histogram->total / count,
+                percentile(histogram, 0.5), percentile(histogram, 0.99),
+                histogram->max);
+
+        // Leave out the empty buckets at the top
+        int last = TRACE_BUCKETS - 1;
+        while (last > 0 && histogram->buckets[last] == 0) {
+            last--;
+        }
+        for (int i = 0; i <= last; i++) {
+            fprintf(stderr, "%s%lld", i == 0 ? "" : ",",
+                    histogram->buckets[i]);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    if (tracePath != NULL) {
+        write_chrome_trace();
+    }
+}
@@ -0,0 +1,150 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Latency tracing follows sampled SAY messages from the moment they are read
+ * to the moment the last recipient's copy has been written. It is only built
+ * with "make TRACE=1", which defines TRACE; otherwise every TRACE_ macro below
+ * expands to nothing, and none of the tracing fields or functions exist.
+ */
+#ifdef TRACE
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#define TRACE_DEFAULT_SAMPLE 16
+#define TRACE_BUCKETS 32
+#define TRACE_RING_SIZE 1024
+
+/* The TraceStages enum indexes the stages which a traced message passes
+ * through, each of which is timed from the end of the stage before it.
+ */
+enum TraceStages {
+    TRACE_PARSE, TRACE_DISPATCH, TRACE_ENQUEUE, TRACE_WRITE, TRACE_TOTAL,
+    NUM_TRACE_STAGES
+};
+
+/* The TraceSpan datastructure holds the timestamps (monotonic microseconds)
+ * of a single sampled message.
+ *
+ * id: A number identifying the span in the Chrome trace.
+ *
+ * receivedAt: When the message was read from its sender.
+ *
+ * parsedAt: When the message had been parsed and was handed to a worker.
+ *
+ * dispatchedAt: When a worker started running the message.
+ *
+ * enqueuedAt: When the message had been queued for every recipient.
+ *
+ * writtenAt: When the last recipient's copy had been written (or dropped).
+ *
+ * pending: The number of queued copies yet to be written, plus one while the
+ *  message is still being queued. The span is finished when this reaches 0.
+ */
+typedef struct TraceSpan {
+    long long id;
+    long long receivedAt;
+    long long parsedAt;
+    long long dispatchedAt;
+    long long enqueuedAt;
+    long long writtenAt;
+    volatile int pending;
+} TraceSpan;
+
+/* The TraceHistogram datastructure holds the latencies of a single stage.
+ * Bucket 0 counts latencies under 1us, and bucket i counts latencies from
+ * 2^(i-1)us up to 2^i us. Every field is updated with atomic operations.
+ *
+ * count/total/max: The number, sum and largest of the latencies, in us.
+ *
+ * buckets: The number of latencies in each bucket.
+ */
+typedef struct TraceHistogram {
+    volatile long long count;
+    volatile long long total;
+    volatile long long max;
+    volatile long long buckets[TRACE_BUCKETS];
+} TraceHistogram;
+
+/* The trace_configure function sets how often messages are sampled, and the
+ * file which the Chrome trace is written to (or NULL).
+ *
+ * Parameters:
+ *      sampleRate - One in every sampleRate SAY messages is traced
+ *      path - The path of the Chrome trace JSON file, or NULL
+ */
+void trace_configure(int sampleRate, char* path);
+
+/* The trace_received function records that the calling thread has just read a
+ * message, in case it turns out to be sampled.
+ */
+void trace_received(void);
+
+/* The trace_begin function decides whether the message the calling thread
+ * last read is sampled, and if so starts a span for it which is parsed now.
+ *
+ * Returns:
+ *      (TraceSpan*) - The new span, or NULL if the message is not sampled
+ */
+TraceSpan* trace_begin(void);
+
+/* The trace_adopt function makes a span the calling thread's current span, so
+ * that every message the thread queues is attached to it.
+ *
+ * Parameters:
+ *      span - The span, or NULL to stop attaching messages
+ */
+void trace_adopt(TraceSpan* span);
+
+/* The trace_dispatched function records that a worker has started running a
+ * span's message, and adopts the span.
+ *
+ * Parameters:
+ *      span - The span, or NULL
+ */
+void trace_dispatched(TraceSpan* span);
+
+/* The trace_enqueued function records that a span's message has been queued
+ * for every recipient, and stops the calling thread attaching to it.
+ *
+ * Parameters:
+ *      span - The span, or NULL
+ */
+void trace_enqueued(TraceSpan* span);
+
+/* The trace_current function returns the calling thread's current span.
+ *
+ * Returns:
+ *      (TraceSpan*) - The current span, or NULL
+ */
+TraceSpan* trace_current(void);
+
+/* The trace_attach function attaches a newly queued copy of a message to the
+ * calling thread's current span, if it has one.
+ *
+ * Returns:
+ *      (TraceSpan*) - The span the copy is attached to, or NULL
+ */
+TraceSpan* trace_attach(void);
+
+/* The trace_release function records that a queued copy of a span's message
+ * has been written or thrown away. Once every copy has, the span is finished
+ * and added to the histograms and the Chrome trace.
+ *
+ * Parameters:
+ *      span - The span, or NULL
+ */
+void trace_release(TraceSpan* span);
+
+/* The print_trace_stats function prints the histogram of every stage under a
+ * @TRACE@ heading, and writes the Chrome trace of the most recently finished
+ * spans if there is a trace file.
+ */
+void print_trace_stats(void);
+
+#define TRACE_RECEIVED() trace_received()
+#define TRACE_PRINT_STATS() print_trace_stats()
+#else
+#define TRACE_RECEIVED()
+#define TRACE_PRINT_STATS()
+#endif
+#endif